@@ -9,10 +9,13 @@
 
 #include "application.h"
 #include "utils.h"
-#include "graph_opt.h"
+#include "trace.h"
 
 #include <iostream>
+#include <fstream>
+#include <iomanip>
 #include <vector>
+#include <sys/stat.h>
 
 #include <chrono>
 using namespace std::chrono;
@@ -23,10 +26,8 @@ using namespace std;
 CApplication::CApplication(const CParams &_params)
 {
 	params = _params;
-
-	// To avoid unnecessary reallocation of buffers
-	v_vcf_data_compress.reserve(no_variants_in_buf);
-	v_vcf_data_io.reserve(no_variants_in_buf);
+	no_variants_in_buf = 8192u;
+	stage_memory = max_stage_memory;
 }
 
 // ******************************************************************************
@@ -34,15 +35,33 @@ CApplication::~CApplication()
 {
 }
 
+// ******************************************************************************
+// Memory of a variant is estimated for both its VCF record and parsed fields, each FORMAT field
+// (except GT) as a single value per sample (ploidy 2 if unknown)
+void CApplication::set_batch_size(uint32_t no_samples, uint32_t ploidy)
+{
+	size_t no_fmt_values = ploidy ? ploidy : 2;
+
+	for (auto& key : keys)
+		if (key.keys_type == key_type_t::fmt)
+			++no_fmt_values;
+
+	size_t variant_size = 2 * (256 + keys.size() * (sizeof(field_desc) + 16) + 4 * no_fmt_values * no_samples);
+
+	no_variants_in_buf = min(max(stage_memory / variant_size, min_variants_in_buf), max_variants_in_buf);
+
+	if (params.verbose)
+		cerr << "Batch size: " << no_variants_in_buf << " variants (~" << variant_size * no_variants_in_buf / (1 << 20) << " MB)\n";
+}
+
 // ******************************************************************************
 bool CApplication::CompressDB()
 {
-	CBarrier barrier(4);
 	unique_ptr<CVCF> vcf(new CVCF());
 	unique_ptr<CCompressedFile> cfile(new CCompressedFile());
 	unique_ptr<CVCFIO> vcf_io(new CVCFIO());
-	bool end_of_processing = false;
 
+	vcf->SetNoIOThreads(no_io_threads());
 	if (!vcf->OpenForReading(params.vcf_file_name))
 	{
 		cerr << "Cannot open: " << params.vcf_file_name << endl;
@@ -100,212 +119,235 @@ bool CApplication::CompressDB()
     cfile->SetNoKeys((uint32_t)keys.size());
     cfile->SetKeys(keys);
 	cfile->SetCompressionLevel(params.vcs_compression_level);
-    
-	function_data_item_t empty_data_map;
+	cfile->SetCheckpointInterval(params.checkpoint_interval);
+	cfile->SetGTBlockSize(params.gt_block_size);
+	cfile->SetGTSummary(params.gt_summary);
+	cfile->SetDirectIO(params.direct_io);
 
-	vector<bool> v_empty(no_flt_keys + no_info_keys + no_fmt_keys, true);
+	// Memory budget: 1/4 for batches of variants in the pipeline, the rest for the archive buffers and packages
+	if (params.max_memory)
+	{
+		size_t max_memory = (size_t) params.max_memory << 20;
+
+		stage_memory = min(max_stage_memory, max_memory / 4 / (max<uint32_t>(1u, params.queue_depth) + 2));
+		cfile->SetMaxMemory(max_memory - max_memory / 4);
+	}
 
 	if (!cfile->OpenForWriting(params.db_file_name, no_flt_keys + no_info_keys + no_fmt_keys))
 		return false;
 
-	v_bcf_io.reserve(no_variants_in_buf);
-	v_bcf_parse.reserve(no_variants_in_buf);
-	s_bcf_io = 0;
-	s_bcf_parse = 0;
+	set_batch_size(vcf->GetNoSamples(), vcf->GetPloidy());
 
-	for (size_t i = 0; i < no_variants_in_buf; ++i)
+	if (params.verbose)
 	{
-		v_bcf_io.emplace_back(vcf_io->InitRecord());
-		v_bcf_parse.emplace_back(vcf_io->InitRecord());
+		uint32_t max_key_part, max_gt_part;
+		cfile->GetPartSizes(max_key_part, max_gt_part);
+		cerr << "Part size: " << (max_key_part >> 20) << " MB (keys), " << (max_gt_part >> 20) << " MB (GT)\n";
 	}
 
-	unique_ptr<thread> t_io(new thread([&] {
-		while (!end_of_processing)
-		{
-			s_bcf_io = 0;
-			for (size_t i = 0; i < no_variants_in_buf; ++i, ++s_bcf_io)
-				if (!vcf_io->LoadRecord(v_bcf_io[i]))
-					break;
+	// Pipeline: I/O -> parsing -> storing; stages exchange batches of variants through bounded queues,
+	// so they work continuously and batches are recycled
+	size_t queue_depth = max<uint32_t>(1u, params.queue_depth);
+	uint32_t no_parse_threads = max(1u, params.no_threads / no_threads_per_parser);
+	vector<unique_ptr<bcf_batch_t>> v_bcf_batches;
+	vector<unique_ptr<variant_batch_t>> v_variant_batches;
 
-//			cout << "s_bcf_io " + to_string(s_bcf_io) + "\n";
+	CBoundedQueue<bcf_batch_t*> q_free_bcf(queue_depth + 2);
+	CBoundedQueue<bcf_batch_t*> q_loaded_bcf(queue_depth);
+	CBoundedQueue<variant_batch_t*> q_free_variants(queue_depth + 2);
+	CBoundedQueue<variant_batch_t*> q_parsed_variants(queue_depth);
 
-			barrier.count_down_and_wait();
-			barrier.count_down_and_wait();
-		}
-	}));
+	for (size_t i = 0; i < queue_depth + 2; ++i)
+	{
+		v_bcf_batches.emplace_back(new bcf_batch_t);
+		for (size_t j = 0; j < no_variants_in_buf; ++j)
+			v_bcf_batches.back()->v_rec.emplace_back(vcf_io->InitRecord());
+		v_bcf_batches.back()->size = 0;
+		q_free_bcf.Push(v_bcf_batches.back().get());
+
+		v_variant_batches.emplace_back(new variant_batch_t);
+		v_variant_batches.back()->v_variants.reserve(no_variants_in_buf);
+		v_variant_batches.back()->size = 0;
+		v_variant_batches.back()->v_arenas.resize(no_parse_threads);
+		q_free_variants.Push(v_variant_batches.back().get());
+	}
 
+	auto t_start = steady_clock::now();
+	auto elapsed = [&] { return duration<double>(steady_clock::now() - t_start).count(); };
+	double io_time = 0, parse_time = 0;
 
-	// Thread reading VCF files in parts
-	unique_ptr<thread> t_vcf(new thread([&] {
-		barrier.count_down_and_wait();
-		barrier.count_down_and_wait();
+	// Thread for low level I/O for VCF file
+	unique_ptr<thread> t_io(new thread([&] {
+		bool eof = false;
+		int64_t i_batch = 0;
 
-		while (!end_of_processing)
+		CTracer::SetThreadName("vcf io");
+
+		while (!eof)
 		{
-//			vector<pair<int, int>> data_to_remove, size_to_remove;
-//			auto t1 = high_resolution_clock::now();
+			bcf_batch_t* p_bcf;
+			q_free_bcf.Pop(p_bcf);
 
-			v_vcf_data_io.clear();
-//			for (size_t i = 0; i < no_variants_in_buf; ++i)
-			for(size_t i = 0; i < s_bcf_parse; ++i)
 			{
-//				v_vcf_data_io.push_back(make_pair(variant_desc_t(), vector<field_desc>(keys.size())));
-				v_vcf_data_io.emplace_back(variant_desc_t(), vector<field_desc>(keys.size()));
-//				if (!vcf->GetVariant(v_vcf_data_io.back().first, v_vcf_data_io.back().second, FilterIdToFieldId, InfoIdToFieldId, FormatIdToFieldId))
-				if (!vcf->GetVariantFromRec(v_bcf_parse[i], v_vcf_data_io.back().first, v_vcf_data_io.back().second, FilterIdToFieldId, InfoIdToFieldId, FormatIdToFieldId))
-				{
-					v_vcf_data_io.pop_back();
-					break;
-				}
+				CTraceScope trace("load batch", "batch", i_batch++);
 
-#if 0
-				// Graph update
-				auto& vec = v_vcf_data_io.back().second;
+				for (p_bcf->size = 0; p_bcf->size < no_variants_in_buf; ++p_bcf->size)
+					if (!vcf_io->LoadRecord(p_bcf->v_rec[p_bcf->size]))
+					{
+						eof = true;
+						break;
+					}
+			}
 
-				// Look for empty
-				for (int j = 0; j < no_flt_keys + no_info_keys + no_fmt_keys; ++j)
-					if (vec[j].present)
-						v_empty[j] = false;
+			if (p_bcf->size)
+				q_loaded_bcf.Push(p_bcf);
+			else
+				q_free_bcf.Push(p_bcf);
+		}
 
-				data_to_remove.clear();
+		q_loaded_bcf.MarkCompleted();
+		io_time = elapsed();
+	}));
 
-				// Not used at this version - for future extension
-				for (auto& edge : function_data_graph)
-				{
-					int from = edge.first.first;
-					int to = edge.first.second;
+	// Records of a batch are parsed by a pool of threads, each with own parse buffers
+	struct parse_task_t {
+		bcf_batch_t* p_bcf;
+		variant_batch_t* p_variants;
+		size_t from;
+		size_t to;
+		CArena* arena;
+	};
 
-					if (vec[from].data_size > 4 || vec[to].data_size > 4)
-					{
-						data_to_remove.emplace_back(from, to);
-						continue;
-					}
+	CBoundedQueue<parse_task_t> q_parse_tasks(no_parse_threads);
+	CSemaphore sem_parse_tasks;
+	vector<char> v_parsed;
+	vector<thread> v_parse_threads;
 
-					vector<uint8_t> from_val(vec[from].data, vec[from].data + vec[from].data_size * 4);
-					vector<uint8_t> to_val(vec[to].data, vec[to].data + vec[to].data_size * 4);
+	for (uint32_t i = 0; i < no_parse_threads; ++i)
+		v_parse_threads.emplace_back([&] {
+			CParseBuffers buffers;
+			parse_task_t task;
 
-					// !!! Test
-					if(from_val != to_val)
-					{
-						data_to_remove.emplace_back(from, to);
-						continue;
-					}
+			CTracer::SetThreadName("parser");
 
-					auto p = edge.second.find(from_val);
-					if (p == edge.second.end())
-						edge.second.emplace(from_val, to_val);
-					else
-						if (p->second != to_val)
-							data_to_remove.emplace_back(from, to);
+			while (q_parse_tasks.Pop(task))
+			{
+				CTraceScope trace("parse records", "from", task.from);
 
-					if(edge.second.size() > max_size_of_function)
-						data_to_remove.emplace_back(from, to);
+				for (size_t i = task.from; i < task.to; ++i)
+				{
+					auto& variant = task.p_variants->v_variants[i];
+					v_parsed[i] = vcf->GetVariantFromRec(task.p_bcf->v_rec[i], variant.first, variant.second, FilterIdToFieldId, InfoIdToFieldId, FormatIdToFieldId, buffers, task.arena);
 				}
 
-				for (auto& x : data_to_remove)
-					function_data_graph.erase(x);
-#endif
+				sem_parse_tasks.Dec();
 			}
+		});
 
-/*			auto t2 = high_resolution_clock::now();
-			duration<double> time_span = duration_cast<duration<double>>(t2 - t1);
-
-			std::cout << string("    Reader                         ") + to_string(time_span.count()) + "\n";
-			*/
-
-			barrier.count_down_and_wait();
-			barrier.count_down_and_wait();
-        }
-	}));
+	// Thread splitting loaded batches into parsing tasks
+	unique_ptr<thread> t_vcf(new thread([&] {
+		bcf_batch_t* p_bcf;
+		int64_t i_batch = 0;
 
-	// Thread making PBWT and compressing data
-	unique_ptr<thread> t_compress(new thread([&] {
-		barrier.count_down_and_wait();
-		barrier.count_down_and_wait();
+		CTracer::SetThreadName("parse");
 
-		while (!end_of_processing)
+		while (q_loaded_bcf.Pop(p_bcf))
 		{
-//			auto t1 = high_resolution_clock::now();
-	
-			for (size_t i = 0; i < v_vcf_data_compress.size(); ++i)
-            {
-				i_variant++;
+			variant_batch_t* p_variants;
+			q_free_variants.Pop(p_variants);
+
+			CTraceScope trace("parse batch", "batch", i_batch++);
 
-				cfile->SetVariant(v_vcf_data_compress[i].first, v_vcf_data_compress[i].second);
+			for (size_t i = 0; i < p_bcf->size; ++i)
+				p_variants->Add(keys.size());
+			v_parsed.assign(p_bcf->size, 0);
 
-                for(size_t j = 0; j < keys.size(); ++j)
-                {
-                    if(v_vcf_data_compress[i].second[j].data_size > 0)
-                    {
-						if(v_vcf_data_compress[i].second[j].data)
-							delete[] v_vcf_data_compress[i].second[j].data;
-                        v_vcf_data_compress[i].second[j].data = nullptr;
-                        v_vcf_data_compress[i].second[j].data_size = 0;
-                    }
-                }
-            }
+			// Each slice has own arena for field data
+			size_t part_size = (p_bcf->size + no_parse_threads - 1) / no_parse_threads;
 
-/*			auto t2 = high_resolution_clock::now();
-			duration<double> time_span = duration_cast<duration<double>>(t2 - t1);
+			sem_parse_tasks.IncNum((int) ((p_bcf->size + part_size - 1) / part_size));
+			for (size_t i = 0; i < p_bcf->size; i += part_size)
+				q_parse_tasks.Push(parse_task_t{ p_bcf, p_variants, i, min(i + part_size, p_bcf->size), &p_variants->v_arenas[i / part_size] });
+			sem_parse_tasks.WaitForZero();
 
-			std::cout << string("*** Storer  ") + to_string(time_span.count()) + "\n";*/
+			// Variants behind the first record that cannot be parsed are dropped
+			p_variants->size = find(v_parsed.begin(), v_parsed.end(), 0) - v_parsed.begin();
+			trace.Stop();
 
-            barrier.count_down_and_wait();
-			barrier.count_down_and_wait();
+			q_free_bcf.Push(p_bcf);
+			q_parsed_variants.Push(p_variants);
 		}
+
+		q_parse_tasks.MarkCompleted();
+		q_parsed_variants.MarkCompleted();
+		parse_time = elapsed();
 	}));
 
-	// Synchronization
+	// Making PBWT and compressing data
 	size_t no_variants = 0;
-	while (!end_of_processing)
+	variant_batch_t* p_variants;
+	int64_t i_batch = 0;
+
+	CTracer::SetThreadName("store");
+
+	while (q_parsed_variants.Pop(p_variants))
 	{
-		barrier.count_down_and_wait();
-		
-		swap(v_bcf_io, v_bcf_parse);
-		s_bcf_parse = s_bcf_io;
+		{
+			CTraceScope trace("store batch", "batch", i_batch++);
 
-		swap(v_vcf_data_compress, v_vcf_data_io);
-		if (v_vcf_data_compress.empty() && s_bcf_parse == 0)
-			end_of_processing = true;
+			for (size_t i = 0; i < p_variants->size; ++i)
+			{
+				i_variant++;
 
-		barrier.count_down_and_wait();
+				cfile->SetVariant(p_variants->v_variants[i].first, p_variants->v_variants[i].second);
+			}
+		}
 
-		no_variants += v_vcf_data_compress.size();
+		no_variants += p_variants->size;
 		cout << no_variants << "\r";
-//		cout << "No variants" + to_string(no_variants) + "\n";
 		fflush(stdout);
+
+		p_variants->Recycle();
+		q_free_variants.Push(p_variants);
 	}
 
-	t_compress->join();
+	double store_time = elapsed();
+
 	t_vcf->join();
 	t_io->join();
 
-	for (auto p : v_bcf_io)
-		vcf_io->ReleaseRecord(p);
-	for (auto p : v_bcf_parse)
-		vcf_io->ReleaseRecord(p);
+	for (auto& t : v_parse_threads)
+		t.join();
 
-	cfile->Close();
+	v_stage_stats.clear();
+	v_stage_stats.push_back(stage_stats_t{ "io", io_time, q_free_bcf.GetPopWaitTime(), q_loaded_bcf.GetPushWaitTime() });
+	v_stage_stats.push_back(stage_stats_t{ "parse", parse_time, q_loaded_bcf.GetPopWaitTime() + q_free_variants.GetPopWaitTime(), q_parsed_variants.GetPushWaitTime() });
+	v_stage_stats.push_back(stage_stats_t{ "store", store_time, q_parsed_variants.GetPopWaitTime(), 0.0 });
 
-	vcf->Close();
-	cout << endl;
+	for (auto& p : v_bcf_batches)
+		for (auto q : p->v_rec)
+			vcf_io->ReleaseRecord(q);
 
-	cfile->OptimizeDB(function_size_graph, function_data_graph);
+	// False if the archive could not be written in whole
+	bool ok = cfile->Close();
 
+	vcf->Close();
 	cout << endl;
 
-	return true;
+	if (!params.stats_file_name.empty())
+		store_stats({ cfile.get() }, no_variants, elapsed());
+
+	return ok;
 }
 
 // ******************************************************************************
 bool CApplication::DecompressDB()
 {
-	CBarrier barrier(4);
 	unique_ptr<CVCF> vcf(new CVCF());
 	unique_ptr<CCompressedFile> cfile(new CCompressedFile());
 	unique_ptr<CVCFIO> vcf_io(new CVCFIO());
-	bool end_of_processing = false;
 
+	vcf->SetNoIOThreads(no_io_threads());
 	if (!vcf->OpenForWriting(params.vcf_file_name, params.out_type, params.bcf_compression_level))
 	{
 		cerr << "Cannot open: " << params.vcf_file_name << endl;
@@ -314,12 +356,14 @@ bool CApplication::DecompressDB()
 
 	cfile->SetNoThreads(params.no_threads);
 
+	if (!params.region_chrom.empty())
+		cfile->SetRegion(params.region_chrom, params.region_from, params.region_to);
+
 	if (!cfile->OpenForReading(params.db_file_name))
 		return false;
 
 	params.neglect_limit = cfile->GetNeglectLimit();
 
-	uint32_t no_variants = cfile->GetNoVariants();
 	uint32_t i_variant = 0;
 
 	string header;
@@ -329,113 +373,1076 @@ bool CApplication::DecompressDB()
 	cfile->GetSamples(v_samples);
     cfile->GetKeys(keys);
 	vcf->SetHeader(header);
-	vcf->AddSamples(v_samples);
+
+	// Key names are taken before keys not selected are removed from the header
+	CSiteFilter site_filter;
+	if (!make_site_filter(vcf.get(), site_filter))
+		return false;
+
+	// Streams of keys not selected are not read, so e.g. sites-only output is not slowed by FORMAT keys
+	vector<bool> v_selected_keys;
+	if (!select_keys(vcf.get(), v_selected_keys))
+		return false;
+	cfile->SetKeysToDecode(v_selected_keys);
+
+	bool any_fmt_key = false;
+	for (size_t i = 0; i < keys.size(); ++i)
+		if (v_selected_keys[i] && keys[i].keys_type == key_type_t::fmt)
+			any_fmt_key = true;
+
+	// Genotypes are decoded only in GT blocks of selected samples, other FORMAT fields are subset when records are made
+	vector<uint32_t> v_sample_ids;
+	if (!select_samples(v_samples, v_sample_ids))
+		return false;
+
+	vector<bool> v_selected_samples(v_samples.size(), v_sample_ids.empty());
+	for (auto id : v_sample_ids)
+		v_selected_samples[id] = true;
+	cfile->SetSamplesToDecode(v_selected_samples);
+	cfile->SetFilter(site_filter);
+
+	if (params.fields.empty() || any_fmt_key)
+	{
+		if (v_sample_ids.empty())
+			vcf->AddSamples(v_samples);
+		else
+		{
+			vector<string> v_out_samples;
+			for (auto id : v_sample_ids)
+				v_out_samples.emplace_back(v_samples[id]);
+			vcf->AddSamples(v_out_samples);
+		}
+	}
 	vcf->WriteHeader();
 	vcf->SetPloidy(cfile->GetPloidy());
 
 	vcf_io->Connect(vcf.get());
 
-	v_bcf_io.reserve(no_variants_in_buf);
-	v_bcf_parse.reserve(no_variants_in_buf);
-	s_bcf_io = 0;
-	s_bcf_parse = 0;
+	set_batch_size((uint32_t) v_samples.size(), cfile->GetPloidy());
 
-	for (size_t i = 0; i < no_variants_in_buf; ++i)
-	{
-		v_bcf_io.emplace_back(vcf_io->InitRecord());
-		v_bcf_parse.emplace_back(vcf_io->InitRecord());
-	}
+	// Independent chunks of the archive are decoded in parallel by separate decoders
+	uint32_t first_chunk, last_chunk;
+	uint32_t no_chunk_decoders = 1;
 
-	// Thread for low level I/O for VCF file
-	unique_ptr<thread> t_io(new thread([&] {
-		barrier.count_down_and_wait();
-		barrier.count_down_and_wait();
+	if (cfile->GetChunkRange(first_chunk, last_chunk))
+		no_chunk_decoders = min(last_chunk - first_chunk + 1, max(1u, params.no_threads / no_threads_per_chunk_decoder));
 
-		while (!end_of_processing)
-		{
-			for (size_t i = 0; i < s_bcf_io; ++i)
-				if (!vcf_io->StoreRecord(v_bcf_io[i]))
-					break;
+	// Each chunk decoder passes decoded batches (in order) through own bounded queue, so it cannot run more than
+	// queue_depth batches ahead of the output. End of a chunk is marked by a batch without an arena.
+	struct decoded_batch_t {
+		CCompressedFile::variant_columns_t columns;
+		shared_ptr<CArena> arena;
+	};
 
-			//			cout << "s_bcf_io " + to_string(s_bcf_io) + "\n";
+	size_t queue_depth = max<uint32_t>(1u, params.queue_depth);
+	vector<unique_ptr<CCompressedFile>> v_chunk_cfiles;
+	vector<unique_ptr<CBoundedQueue<decoded_batch_t>>> v_chunk_queues;
+	vector<unique_ptr<thread>> v_chunk_threads;
+	uint32_t next_chunk = first_chunk;
 
-			barrier.count_down_and_wait();
-			barrier.count_down_and_wait();
+	if (no_chunk_decoders > 1)
+		for (uint32_t i = 0; i < no_chunk_decoders; ++i)
+		{
+			v_chunk_cfiles.emplace_back(new CCompressedFile());
+			v_chunk_cfiles.back()->SetNoThreads(max(2u, params.no_threads / no_chunk_decoders));
+			if (!params.region_chrom.empty())
+				v_chunk_cfiles.back()->SetRegion(params.region_chrom, params.region_from, params.region_to);
+
+			if (!v_chunk_cfiles.back()->OpenForReading(params.db_file_name))
+				return false;
+			v_chunk_cfiles.back()->SetKeysToDecode(v_selected_keys);
+			v_chunk_cfiles.back()->SetSamplesToDecode(v_selected_samples);
+			v_chunk_cfiles.back()->SetFilter(site_filter);
+
+			v_chunk_queues.emplace_back(new CBoundedQueue<decoded_batch_t>(queue_depth));
 		}
+
+	for (uint32_t i = 0; i < v_chunk_cfiles.size(); ++i)
+		v_chunk_threads.emplace_back(new thread([&, i] {
+			CCompressedFile* chunk_cfile = v_chunk_cfiles[i].get();
+			auto& q_batches = *v_chunk_queues[i];
+
+			CTracer::SetThreadName("chunk decoder");
+
+			for (uint32_t c = first_chunk + i; c <= last_chunk; c += no_chunk_decoders)
+			{
+				CTraceScope trace("decode chunk", "chunk", c);
+
+				chunk_cfile->SetChunkRange(c, c);
+
+				while (true)
+				{
+					// Field data of a batch are in its own arena, released when the batch is recycled
+					decoded_batch_t batch;
+					batch.arena = make_shared<CArena>();
+
+					if (!chunk_cfile->GetVariants(batch.columns, no_variants_in_buf, batch.arena.get()))
+						break;
+
+					q_batches.Push(move(batch));
+				}
+
+				q_batches.Push(decoded_batch_t());
+			}
+
+			q_batches.MarkCompleted();
 		}));
 
+	// Get the next batch of variants (in the original order)
+	auto get_batch = [&](variant_batch_t* p_variants) -> bool {
+		if (no_chunk_decoders == 1)
+			return cfile->GetVariants(p_variants->columns, no_variants_in_buf, &p_variants->v_arenas.front());
+
+		decoded_batch_t batch;
+
+		while (true)
+		{
+			if (next_chunk > last_chunk)
+				return false;
+
+			if (!v_chunk_queues[(next_chunk - first_chunk) % no_chunk_decoders]->Pop(batch))
+				return false;
+
+			if (batch.arena)
+				break;
+
+			++next_chunk;
+		}
+
+		swap(p_variants->columns, batch.columns);
+		p_variants->v_chunk_arenas.push_back(batch.arena);
+
+		return true;
+	};
+
+	// Pipeline: decoding -> making records -> I/O; stages exchange batches of variants through bounded queues,
+	// so they work continuously and batches are recycled
+	vector<unique_ptr<bcf_batch_t>> v_bcf_batches;
+	vector<unique_ptr<variant_batch_t>> v_variant_batches;
+
+	CBoundedQueue<variant_batch_t*> q_free_variants(queue_depth + 2);
+	CBoundedQueue<variant_batch_t*> q_decoded_variants(queue_depth);
+	CBoundedQueue<bcf_batch_t*> q_free_bcf(queue_depth + 2);
+	CBoundedQueue<bcf_batch_t*> q_ready_bcf(queue_depth);
+
+	for (size_t i = 0; i < queue_depth + 2; ++i)
+	{
+		v_bcf_batches.emplace_back(new bcf_batch_t);
+		for (size_t j = 0; j < no_variants_in_buf; ++j)
+			v_bcf_batches.back()->v_rec.emplace_back(vcf_io->InitRecord());
+		v_bcf_batches.back()->size = 0;
+		q_free_bcf.Push(v_bcf_batches.back().get());
+
+		v_variant_batches.emplace_back(new variant_batch_t);
+		v_variant_batches.back()->size = 0;
+		v_variant_batches.back()->v_arenas.resize(1);
+		q_free_variants.Push(v_variant_batches.back().get());
+	}
+
+	auto t_start = steady_clock::now();
+	auto elapsed = [&] { return duration<double>(steady_clock::now() - t_start).count(); };
+	double decode_time = 0, records_time = 0;
+
 	// Thread making rev-PBWT and decompressing data
 	unique_ptr<thread> t_compress(new thread([&] {
-		while (!end_of_processing)
+		int64_t i_batch = 0;
+
+		CTracer::SetThreadName("decode");
+
+		while (true)
 		{
-			v_vcf_data_compress.clear();
+			variant_batch_t* p_variants;
+			q_free_variants.Pop(p_variants);
+
+			CTraceScope trace("decode batch", "batch", i_batch++);
 
-			for (size_t i = 0; i < no_variants_in_buf && i_variant < no_variants; ++i, ++i_variant)
+			if (!get_batch(p_variants))
 			{
-//				v_vcf_data_compress.push_back(make_pair(variant_desc_t(), vector<field_desc>(keys.size())));
-				v_vcf_data_compress.emplace_back(variant_desc_t(), vector<field_desc>(keys.size()));
-				cfile->GetVariant(v_vcf_data_compress.back().first, v_vcf_data_compress.back().second);
+				q_free_variants.Push(p_variants);
+				break;
 			}
-			
-			barrier.count_down_and_wait();
-			barrier.count_down_and_wait();
+
+			i_variant += (uint32_t) p_variants->columns.no_variants;
+			trace.Stop();
+
+			q_decoded_variants.Push(p_variants);
 		}
+
+		q_decoded_variants.MarkCompleted();
+		decode_time = elapsed();
 	}));
 
-	// Thread writing VCF files in parts
+	// Records of a batch are made by a pool of threads, each filling own slice of records
+	struct build_task_t {
+		variant_batch_t* p_variants;
+		bcf_batch_t* p_bcf;
+		size_t from;
+		size_t to;
+	};
+
+	uint32_t no_builder_threads = max(1u, params.no_threads / no_threads_per_record_builder);
+	CBoundedQueue<build_task_t> q_build_tasks(no_builder_threads);
+	CSemaphore sem_build_tasks;
+	vector<thread> v_builder_threads;
+
+	for (uint32_t i = 0; i < no_builder_threads; ++i)
+		v_builder_threads.emplace_back([&] {
+			build_task_t task;
+			vector<field_desc> fields(keys.size());
+			vector<vector<char>> v_subsets(keys.size());
+			uint32_t no_samples = (uint32_t) v_samples.size();
+
+			CTracer::SetThreadName("record builder");
+
+			while (q_build_tasks.Pop(task))
+			{
+				CTraceScope trace("build records", "from", task.from);
+				auto& columns = task.p_variants->columns;
+
+				for (size_t i = task.from; i < task.to; ++i)
+				{
+					for (size_t j = 0; j < keys.size(); ++j)
+						fields[j] = columns.v_columns[j][i];
+
+					// FORMAT fields have the same no. of values for each sample
+					if (!v_sample_ids.empty())
+						for (size_t j = 0; j < keys.size(); ++j)
+							if (keys[j].keys_type == key_type_t::fmt && fields[j].present && no_samples)
+							{
+								size_t value_size = keys[j].type == BCF_HT_STR ? 1 : 4;
+								size_t sample_size = fields[j].data_size / no_samples * value_size;
+								auto& subset = v_subsets[j];
+
+								subset.resize(max<size_t>(1, v_sample_ids.size() * sample_size));
+								for (size_t k = 0; k < v_sample_ids.size(); ++k)
+									copy_n(fields[j].data + v_sample_ids[k] * sample_size, sample_size, subset.data() + k * sample_size);
+
+								fields[j].data = subset.data();
+								fields[j].data_size = (uint32_t) (v_sample_ids.size() * sample_size / value_size);
+							}
+
+					vcf->SetVariantToRec(task.p_bcf->v_rec[i], columns.v_desc[i], fields, keys);
+				}
+
+				sem_build_tasks.Dec();
+			}
+		});
+
+	// Thread splitting decoded batches into record making tasks
 	unique_ptr<thread> t_vcf(new thread([&] {
-		while (!end_of_processing)
+		variant_batch_t* p_variants;
+		string last_chrom;
+		int64_t i_batch = 0;
+
+		CTracer::SetThreadName("records");
+
+		while (q_decoded_variants.Pop(p_variants))
 		{
-			s_bcf_parse = 0;
-			for (size_t i = 0; i < v_vcf_data_io.size(); ++i, ++s_bcf_parse)
-            {
-                vcf->SetVariantToRec(v_bcf_parse[i], v_vcf_data_io[i].first, v_vcf_data_io[i].second, keys);
-                
-                for(size_t j = 0; j < keys.size(); ++j)
-                    if(v_vcf_data_io[i].second[j].data_size)
-                    {
-                        delete[] v_vcf_data_io[i].second[j].data;
-                        v_vcf_data_io[i].second[j].data = nullptr;
-                        v_vcf_data_io[i].second[j].data_size = 0;
-                    }
-            }
-            v_vcf_data_io.clear();
-
-			barrier.count_down_and_wait();
-			barrier.count_down_and_wait();
+			bcf_batch_t* p_bcf;
+			q_free_bcf.Pop(p_bcf);
+
+			CTraceScope trace("make records", "batch", i_batch++);
+
+			// Header must not be modified when records are made in parallel
+			for (size_t i = 0; i < p_variants->columns.no_variants; ++i)
+				if (p_variants->columns.v_desc[i].chrom != last_chrom)
+				{
+					last_chrom = p_variants->columns.v_desc[i].chrom;
+					vcf->AddContig(last_chrom);
+				}
+
+			p_bcf->size = p_variants->columns.no_variants;
+
+			size_t part_size = (p_bcf->size + no_builder_threads - 1) / no_builder_threads;
+
+			sem_build_tasks.IncNum((int) ((p_bcf->size + part_size - 1) / part_size));
+			for (size_t i = 0; i < p_bcf->size; i += part_size)
+				q_build_tasks.Push(build_task_t{ p_variants, p_bcf, i, min(i + part_size, p_bcf->size) });
+			sem_build_tasks.WaitForZero();
+			trace.Stop();
+
+			p_variants->Recycle();
+			q_free_variants.Push(p_variants);
+			q_ready_bcf.Push(p_bcf);
 		}
+
+		q_build_tasks.MarkCompleted();
+		q_ready_bcf.MarkCompleted();
+		records_time = elapsed();
 	}));
 
-	// Synchronization
-	while (!end_of_processing)
-	{
-		barrier.count_down_and_wait();
+	// Low level I/O for VCF file
+	size_t no_variants = 0;
+	bcf_batch_t* p_bcf;
+	int64_t i_batch = 0;
 
-		swap(v_bcf_io, v_bcf_parse);
-		s_bcf_io = s_bcf_parse;
+	CTracer::SetThreadName("vcf io");
 
-		swap(v_vcf_data_compress, v_vcf_data_io);
-		if (v_vcf_data_io.empty() && s_bcf_io == 0)
-			end_of_processing = true;
+	while (q_ready_bcf.Pop(p_bcf))
+	{
+		{
+			CTraceScope trace("write batch", "batch", i_batch++);
 
-		cout << i_variant << "\r";
+			for (size_t i = 0; i < p_bcf->size; ++i)
+				if (!vcf_io->StoreRecord(p_bcf->v_rec[i]))
+					break;
+		}
+
+		no_variants += p_bcf->size;
+		cout << no_variants << "\r";
 		fflush(stdout);
-		barrier.count_down_and_wait();
+
+		q_free_bcf.Push(p_bcf);
 	}
 
+	double io_time = elapsed();
+
 	t_compress->join();
 	t_vcf->join();
-	t_io->join();
 
-	for (auto p : v_bcf_io)
-		vcf_io->ReleaseRecord(p);
-	for (auto p : v_bcf_parse)
-		vcf_io->ReleaseRecord(p);
+	for (auto& t : v_builder_threads)
+		t.join();
+
+	v_stage_stats.clear();
+	v_stage_stats.push_back(stage_stats_t{ "decode", decode_time, q_free_variants.GetPopWaitTime(), q_decoded_variants.GetPushWaitTime() });
+	v_stage_stats.push_back(stage_stats_t{ "records", records_time, q_decoded_variants.GetPopWaitTime() + q_free_bcf.GetPopWaitTime(), q_ready_bcf.GetPushWaitTime() });
+	v_stage_stats.push_back(stage_stats_t{ "io", io_time, q_ready_bcf.GetPopWaitTime(), 0.0 });
 
+	for (auto& t : v_chunk_threads)
+		t->join();
+
+	for (auto& p : v_bcf_batches)
+		for (auto q : p->v_rec)
+			vcf_io->ReleaseRecord(q);
+
+	for (auto& p : v_chunk_cfiles)
+		p->Close();
 	cfile->Close();
 	vcf->Close();
 	cout << endl;
 
+	if (!params.stats_file_name.empty())
+	{
+		vector<CCompressedFile*> v_cfiles{ cfile.get() };
+		for (auto& p : v_chunk_cfiles)
+			v_cfiles.emplace_back(p.get());
+
+		store_stats(v_cfiles, no_variants, elapsed());
+	}
+
+	return true;
+}
+
+// ******************************************************************************
+// Statistics of a run in JSON: pipeline stages, coder threads (of all decoders), streams with coding times
+// of their keys or db fields and totals per coder. Streams are described by the first (main) file.
+bool CApplication::store_stats(const vector<CCompressedFile*> &v_cfiles, size_t no_variants, double time)
+{
+	ofstream out(params.stats_file_name);
+
+	if (!out)
+	{
+		cerr << "Cannot open: " << params.stats_file_name << endl;
+		return false;
+	}
+
+	auto quote = [](const string& s) -> string {
+		string r = "\"";
+		for (auto c : s)
+		{
+			if (c == '"' || c == '\\')
+				r += '\\';
+			r += c;
+		}
+
+		return r + "\"";
+	};
+
+	// Size of a file or -1 for stdin/stdout
+	auto file_size = [](const string& file_name) -> int64_t {
+		struct stat st;
+
+		if (file_name == "-" || stat(file_name.c_str(), &st) != 0)
+			return -1;
+
+		return (int64_t) st.st_size;
+	};
+
+	vector<CCompressedFile::stream_desc_t> v_desc;
+	vector<double> v_key_times, v_db_times;
+	CCompressedFile::work_stats_t work_stats;
+	double queue_wait_time = 0, lock_wait_time = 0;
+	vector<double> v_thread_times;
+
+	v_cfiles.front()->GetStreamsInfo(v_desc);
+
+	for (auto cfile : v_cfiles)
+	{
+		vector<double> v_kt, v_dt;
+		cfile->GetCodingTimes(v_kt, v_dt);
+		cfile->GetWorkStats(work_stats);
+
+		v_key_times.resize(max(v_key_times.size(), v_kt.size()), 0.0);
+		v_db_times.resize(max(v_db_times.size(), v_dt.size()), 0.0);
+		for (size_t i = 0; i < v_kt.size(); ++i)
+			v_key_times[i] += v_kt[i];
+		for (size_t i = 0; i < v_dt.size(); ++i)
+			v_db_times[i] += v_dt[i];
+
+		v_thread_times.insert(v_thread_times.end(), work_stats.v_thread_busy_time.begin(), work_stats.v_thread_busy_time.end());
+		queue_wait_time += work_stats.queue_wait_time;
+		lock_wait_time += work_stats.lock_wait_time;
+	}
+
+	struct coder_stats_t {
+		double time = 0;
+		size_t raw_size = 0;
+		size_t packed_size = 0;
+	};
+
+	map<string, coder_stats_t> m_coders;
+	size_t archive_size = 0;
+
+	for (auto& x : v_desc)
+	{
+		auto& cs = m_coders[x.coder];
+		cs.raw_size += x.info.raw_size;
+		cs.packed_size += x.info.packed_size - x.info.linked_size;
+		archive_size += x.info.packed_size - x.info.linked_size;
+	}
+
+	auto stream_time = [&](CCompressedFile::stream_desc_t& x) -> double {
+		if (!x.is_data)
+			return 0.0;
+		if (x.key_id >= 0)
+			return x.key_id < (int) v_key_times.size() ? v_key_times[x.key_id] : 0.0;
+		if (x.db_id >= 0)
+			return x.db_id < (int) v_db_times.size() ? v_db_times[x.db_id] : 0.0;
+		return 0.0;
+	};
+
+	for (auto& x : v_desc)
+		m_coders[x.coder].time += stream_time(x);
+
+	bool compress = params.work_mode == work_mode_t::compress;
+	string in_name = compress ? params.vcf_file_name : params.db_file_name;
+	string out_name = compress ? params.db_file_name : params.vcf_file_name;
+	int64_t in_size = file_size(in_name);
+	int64_t out_size = file_size(out_name);
+
+	// Archive streamed through stdin/stdout has the size of its parts (+ small metadata)
+	if (compress && out_size < 0)
+		out_size = (int64_t) archive_size;
+	if (!compress && in_size < 0)
+		in_size = (int64_t) archive_size;
+
+	auto size_str = [](int64_t x) -> string {
+		return x < 0 ? "null" : to_string(x);
+	};
+
+	out << fixed << setprecision(6);
+	out << "{\n";
+	out << "  \"mode\": " << quote(compress ? "compress" : "decompress") << ",\n";
+	out << "  \"input\": {\"file\": " << quote(in_name) << ", \"bytes\": " << size_str(in_size) << "},\n";
+	out << "  \"output\": {\"file\": " << quote(out_name) << ", \"bytes\": " << size_str(out_size) << "},\n";
+	out << "  \"variants\": " << no_variants << ",\n";
+	out << "  \"threads\": " << params.no_threads << ",\n";
+	out << "  \"time\": " << time << ",\n";
+	out << "  \"variants_per_s\": " << (time > 0 ? no_variants / time : 0.0) << ",\n";
+
+	out << "  \"stages\": [\n";
+	for (size_t i = 0; i < v_stage_stats.size(); ++i)
+	{
+		auto& x = v_stage_stats[i];
+		out << "    {\"name\": " << quote(x.name) << ", \"time\": " << x.time << ", \"busy\": " << max(0.0, x.time - x.input_wait - x.output_wait) 
+			<< ", \"input_wait\": " << x.input_wait << ", \"output_wait\": " << x.output_wait << "}" << (i + 1 < v_stage_stats.size() ? "," : "") << "\n";
+	}
+	out << "  ],\n";
+
+	out << "  \"coder_threads\": {\"busy\": [";
+	for (size_t i = 0; i < v_thread_times.size(); ++i)
+		out << (i ? ", " : "") << v_thread_times[i];
+	out << "], \"queue_wait\": " << queue_wait_time << ", \"lock_wait\": " << lock_wait_time << "},\n";
+
+	out << "  \"coders\": {\n";
+	size_t i_coder = 0;
+	for (auto& x : m_coders)
+		out << "    " << quote(x.first) << ": {\"time\": " << x.second.time << ", \"raw_bytes\": " << x.second.raw_size 
+			<< ", \"packed_bytes\": " << x.second.packed_size << "}" << (++i_coder < m_coders.size() ? "," : "") << "\n";
+	out << "  },\n";
+
+	out << "  \"streams\": [\n";
+	for (size_t i = 0; i < v_desc.size(); ++i)
+	{
+		auto& x = v_desc[i];
+		out << "    {\"id\": " << x.info.stream_id << ", \"name\": " << quote(x.info.stream_name);
+		if (x.key_id >= 0)
+			out << ", \"key\": " << x.key_id;
+		if (x.db_id >= 0)
+			out << ", \"db_field\": " << x.db_id;
+		out << ", \"coder\": " << quote(x.coder) << ", \"parts\": " << x.info.no_parts << ", \"raw_bytes\": " << x.info.raw_size 
+			<< ", \"packed_bytes\": " << x.info.packed_size << ", \"linked_bytes\": " << x.info.linked_size 
+			<< ", \"time\": " << stream_time(x) << "}" << (i + 1 < v_desc.size() ? "," : "") << "\n";
+	}
+	out << "  ]\n";
+	out << "}\n";
+
+	return true;
+}
+
+// ******************************************************************************
+// Keys given in params.fields as [FILTER/|INFO/|FORMAT/]name (without prefix: INFO or FORMAT) are selected
+// (or all except them if drop_fields), other keys are removed from the header of vcf
+bool CApplication::select_keys(CVCF *vcf, vector<bool> &v_selected)
+{
+	v_selected.assign(keys.size(), true);
+
+	if (params.fields.empty())
+		return true;
+
+	vector<bool> v_listed(keys.size(), false);
+	size_t p = 0;
+
+	while (p <= params.fields.size())
+	{
+		size_t q = params.fields.find(',', p);
+		if (q == string::npos)
+			q = params.fields.size();
+
+		string field = trim(params.fields.substr(p, q - p));
+		p = q + 1;
+
+		if (field.empty())
+			continue;
+
+		string prefix, name = field;
+		auto p_slash = field.find('/');
+
+		if (p_slash != string::npos)
+		{
+			prefix = field.substr(0, p_slash);
+			name = field.substr(p_slash + 1);
+		}
+
+		bool found = false;
+
+		for (size_t i = 0; i < keys.size(); ++i)
+		{
+			if (vcf->GetKeyName(keys[i]) != name)
+				continue;
+
+			auto type = keys[i].keys_type;
+
+			if ((prefix.empty() && type != key_type_t::flt) || (prefix == "FILTER" && type == key_type_t::flt) ||
+				(prefix == "INFO" && type == key_type_t::info) || (prefix == "FORMAT" && type == key_type_t::fmt))
+			{
+				v_listed[i] = true;
+				found = true;
+			}
+		}
+
+		if (!found)
+		{
+			cerr << "Unknown field: " << field << endl;
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i < keys.size(); ++i)
+	{
+		v_selected[i] = v_listed[i] != params.drop_fields;
+
+		if (!v_selected[i])
+			vcf->RemoveKey(keys[i]);
+	}
+
+	return true;
+}
+
+// ******************************************************************************
+// Filter given in params.include (empty filter - all variants)
+bool CApplication::make_site_filter(CVCF *vcf, CSiteFilter &site_filter)
+{
+	if (params.include.empty())
+		return true;
+
+	vector<string> v_key_names;
+	for (auto& key : keys)
+		v_key_names.emplace_back(vcf->GetKeyName(key));
+
+	return site_filter.Parse(params.include, keys, v_key_names);
+}
+
+// ******************************************************************************
+// Samples given in params.samples (comma-separated) or in params.sample_file_name (one per line) in the order
+// of output; no samples given - all samples
+bool CApplication::select_samples(const vector<string> &v_samples, vector<uint32_t> &v_sample_ids)
+{
+	vector<string> v_names;
+
+	if (!params.sample_file_name.empty())
+	{
+		ifstream in(params.sample_file_name);
+
+		if (!in)
+		{
+			cerr << "Cannot open: " << params.sample_file_name << endl;
+			return false;
+		}
+
+		string line;
+		while (getline(in, line))
+			if (!trim(line).empty())
+				v_names.emplace_back(trim(line));
+	}
+
+	size_t p = 0;
+
+	while (!params.samples.empty() && p <= params.samples.size())
+	{
+		size_t q = params.samples.find(',', p);
+		if (q == string::npos)
+			q = params.samples.size();
+
+		string name = trim(params.samples.substr(p, q - p));
+		p = q + 1;
+
+		if (!name.empty())
+			v_names.emplace_back(name);
+	}
+
+	v_sample_ids.clear();
+
+	if (v_names.empty())
+		return true;
+
+	unordered_map<string, uint32_t> m_ids;
+	for (uint32_t i = 0; i < (uint32_t) v_samples.size(); ++i)
+		m_ids.emplace(v_samples[i], i);
+
+	vector<bool> v_used(v_samples.size(), false);
+
+	for (auto& name : v_names)
+	{
+		auto q = m_ids.find(name);
+
+		if (q == m_ids.end())
+		{
+			cerr << "Unknown sample: " << name << endl;
+			return false;
+		}
+
+		if (v_used[q->second])
+		{
+			cerr << "Duplicated sample: " << name << endl;
+			return false;
+		}
+
+		v_used[q->second] = true;
+		v_sample_ids.emplace_back(q->second);
+	}
+
+	return true;
+}
+
+// ******************************************************************************
+bool CApplication::InfoDB()
+{
+	unique_ptr<CVCF> vcf(new CVCF());
+	unique_ptr<CCompressedFile> cfile(new CCompressedFile());
+
+	cfile->SetNoThreads(params.no_threads);
+
+	if (!cfile->OpenForReading(params.db_file_name))
+		return false;
+
+	string header;
+	cfile->GetHeader(header);
+	cfile->GetKeys(keys);
+	vcf->SetHeader(header);
+
+	vector<double> v_key_times, v_db_times;
+
+	if (params.info_decode_time)
+	{
+		variant_desc_t desc;
+		vector<field_desc> fields(keys.size());
+		CArena arena;
+
+		while (cfile->GetVariant(desc, fields, &arena))
+		{
+			fill(fields.begin(), fields.end(), field_desc());
+			arena.Reset();
+		}
+
+		cfile->GetCodingTimes(v_key_times, v_db_times);
+	}
+
+	vector<CCompressedFile::stream_desc_t> v_desc;
+	cfile->GetStreamsInfo(v_desc);
+
+	auto key_type_name = [](key_desc& key) -> string {
+		string s = key.keys_type == key_type_t::flt ? "FILTER" : key.keys_type == key_type_t::info ? "INFO" : "FORMAT";
+
+		switch (key.type)
+		{
+		case BCF_HT_FLAG:	return s + "/Flag";
+		case BCF_HT_INT:	return s + "/Integer";
+		case BCF_HT_REAL:	return s + "/Float";
+		case BCF_HT_STR:	return s + "/String";
+		}
+
+		return s;
+	};
+
+	size_t total_raw = 0, total_packed = 0, total_linked = 0;
+
+	cout << left << setw(6) << "id" << setw(18) << "stream" << setw(16) << "key" << setw(16) << "type" << setw(16) << "coder"
+		<< right << setw(8) << "parts" << setw(14) << "raw" << setw(14) << "packed" << setw(9) << "ratio" << setw(14) << "linked";
+	if (params.info_decode_time)
+		cout << setw(12) << "decode [s]";
+	cout << "\n";
+
+	for (auto& x : v_desc)
+	{
+		string key_name, type_name;
+
+		if (x.key_id >= 0)
+		{
+			key_name = vcf->GetKeyName(keys[x.key_id]);
+			type_name = key_type_name(keys[x.key_id]);
+		}
+
+		cout << left << setw(6) << x.info.stream_id << setw(18) << x.info.stream_name << setw(16) << key_name << setw(16) << type_name << setw(16) << x.coder
+			<< right << setw(8) << x.info.no_parts << setw(14) << x.info.raw_size << setw(14) << x.info.packed_size;
+
+		if (x.info.packed_size)
+			cout << setw(9) << fixed << setprecision(2) << (double) x.info.raw_size / x.info.packed_size;
+		else
+			cout << setw(9) << "-";
+
+		cout << setw(14) << x.info.linked_size;
+
+		// Decoding time covers both size and data streams, so it is reported once per key
+		if (params.info_decode_time)
+		{
+			if (x.is_data && x.key_id >= 0)
+				cout << setw(12) << fixed << setprecision(3) << v_key_times[x.key_id];
+			else if (x.is_data && x.db_id >= 0)
+				cout << setw(12) << fixed << setprecision(3) << v_db_times[x.db_id];
+		}
+
+		cout << "\n";
+
+		total_raw += x.info.raw_size;
+		total_packed += x.info.packed_size;
+		total_linked += x.info.linked_size;
+	}
+
+	cout << "Streams: " << v_desc.size() << "   raw: " << total_raw << "   packed: " << total_packed
+		<< "   stored (without linked parts): " << total_packed - total_linked << "\n";
+
+	cfile->Close();
+
+	return true;
+}
+
+// ******************************************************************************
+// AN, AC and AF (for each ALT allele) and missing rate of haplotypes of each variant. Only GT key is read
+// and counts are computed from runs of PBWT symbols, so genotypes are not reconstructed.
+bool CApplication::StatsDB()
+{
+	unique_ptr<CCompressedFile> cfile(new CCompressedFile());
+
+	cfile->SetNoThreads(params.no_threads);
+
+	if (!params.region_chrom.empty())
+		cfile->SetRegion(params.region_chrom, params.region_from, params.region_to);
+
+	if (!cfile->OpenForReading(params.db_file_name))
+		return false;
+
+	cfile->GetKeys(keys);
+	int gt_id = cfile->GetGTId();
+
+	if (gt_id < 0 || gt_id >= (int) keys.size())
+	{
+		cerr << "No genotypes in archive\n";
+		return false;
+	}
+
+	vector<bool> v_selected_keys(keys.size(), false);
+	v_selected_keys[gt_id] = true;
+
+	cfile->SetKeysToDecode(v_selected_keys);
+	cfile->SetGTCountsOnly(true);
+
+	FILE* out = params.vcf_file_name == "-" ? stdout : fopen(params.vcf_file_name.c_str(), "w");
+
+	if (!out)
+	{
+		cerr << "Cannot open: " << params.vcf_file_name << endl;
+		return false;
+	}
+
+	setvbuf(out, nullptr, _IOFBF, 16 << 20);
+	fprintf(out, "#CHROM\tPOS\tID\tREF\tALT\tAN\tAC\tAF\tMISSING\tHET\n");
+
+	CCompressedFile::variant_columns_t columns;
+	CArena arena;
+	size_t no_variants = 0;
+
+	while (cfile->GetVariants(columns, max_variants_in_buf, &arena))
+	{
+		for (size_t i = 0; i < columns.no_variants; ++i)
+		{
+			auto& desc = columns.v_desc[i];
+			auto& field = columns.v_columns[gt_id][i];
+
+			// No. of heterozygous samples (-1 if unknown), counts of haplotypes: missing, allele 0, allele 1, ...
+			const uint32_t* counts = field.present && field.data_size ? (const uint32_t*) field.data + 1 : nullptr;
+			uint32_t no_counts = field.present && field.data_size ? field.data_size - 1 : 0;
+			int32_t no_het = field.present && field.data_size ? ((const int32_t*) field.data)[0] : -1;
+			uint32_t no_alts = (desc.alt.empty() || desc.alt == ".") ? 0 : (uint32_t) count(desc.alt.begin(), desc.alt.end(), ',') + 1;
+
+			uint64_t an = 0;
+			uint64_t no_missing = no_counts ? counts[0] : 0;
+
+			for (uint32_t j = 1; j < no_counts; ++j)
+				an += counts[j];
+
+			string ac, af;
+
+			for (uint32_t j = 1; j <= no_alts; ++j)
+			{
+				uint32_t c = j + 1 < no_counts ? counts[j + 1] : 0;
+				char buf[32];
+
+				if (j > 1)
+				{
+					ac += ",";
+					af += ",";
+				}
+
+				ac += to_string(c);
+
+				if (an)
+					snprintf(buf, sizeof(buf), "%.6g", (double) c / an);
+				else
+					snprintf(buf, sizeof(buf), ".");
+				af += buf;
+			}
+
+			fprintf(out, "%s\t%lld\t%s\t%s\t%s\t%llu\t%s\t%s\t", desc.chrom.c_str(), (long long) desc.pos, desc.id.c_str(), desc.ref.c_str(), desc.alt.c_str(),
+				(unsigned long long) an, no_alts ? ac.c_str() : ".", no_alts ? af.c_str() : ".");
+
+			if (an + no_missing)
+				fprintf(out, "%.6g\t", (double) no_missing / (an + no_missing));
+			else
+				fprintf(out, ".\t");
+
+			if (no_het >= 0)
+				fprintf(out, "%d\n", no_het);
+			else
+				fprintf(out, ".\n");
+		}
+
+		no_variants += columns.no_variants;
+		arena.Reset();
+	}
+
+	if (out != stdout)
+		fclose(out);
+	else
+		fflush(out);
+
+	cout << "Variants: " << no_variants << endl;
+
+	cfile->Close();
+
+	return true;
+}
+
+// ******************************************************************************
+// NumPy .npy (v1.0) header of uint8 matrix; padded to 128 bytes, so it can be rewritten when no. of variants is known
+static string npy_header(size_t no_variants, size_t no_haplotypes)
+{
+	string dict = "{'descr': '|u1', 'fortran_order': False, 'shape': (" + to_string(no_variants) + ", " + to_string(no_haplotypes) + "), }";
+	string header = string("\x93NUMPY\x01\x00", 8) + "  " + dict;
+
+	header.resize(127, ' ');
+	header += '\n';
+
+	header[8] = (char) ((header.size() - 10) & 0xff);
+	header[9] = (char) ((header.size() - 10) >> 8);
+
+	return header;
+}
+
+// ******************************************************************************
+// Genotypes are written as variant x haplotype matrix (haplotypes of samples one after another), without making records:
+//   2bit - 4 haplotypes per byte (from the lowest bits), rows padded to full bytes; 0 - allele 0, 1 - allele 1, 2 - other allele, 3 - missing
+//   u8, npy - byte per haplotype; allele (up to 254), 255 - missing
+// Sites (CHROM, POS, ID, REF, ALT) and samples are written to <output>.sites and <output>.samples
+bool CApplication::GTMatrixDB()
+{
+	if (params.gt_matrix != "2bit" && params.gt_matrix != "u8" && params.gt_matrix != "npy")
+	{
+		cerr << "Unknown GT matrix format: " << params.gt_matrix << endl;
+		return false;
+	}
+
+	if (params.vcf_file_name == "-")
+	{
+		cerr << "GT matrix must be written to a file\n";
+		return false;
+	}
+
+	unique_ptr<CCompressedFile> cfile(new CCompressedFile());
+
+	cfile->SetNoThreads(params.no_threads);
+
+	if (!params.region_chrom.empty())
+		cfile->SetRegion(params.region_chrom, params.region_from, params.region_to);
+
+	if (!cfile->OpenForReading(params.db_file_name))
+		return false;
+
+	string header;
+	vector<string> v_samples;
+
+	cfile->GetHeader(header);
+	cfile->GetSamples(v_samples);
+	cfile->GetKeys(keys);
+	int gt_id = cfile->GetGTId();
+
+	if (gt_id < 0 || gt_id >= (int) keys.size())
+	{
+		cerr << "No genotypes in archive\n";
+		return false;
+	}
+
+	// Header is needed for key names of the filter only
+	CSiteFilter site_filter;
+	if (!params.include.empty())
+	{
+		unique_ptr<CVCF> vcf(new CVCF());
+
+		vcf->SetHeader(header);
+		if (!make_site_filter(vcf.get(), site_filter))
+			return false;
+	}
+
+	vector<bool> v_selected_keys(keys.size(), false);
+	v_selected_keys[gt_id] = true;
+	cfile->SetKeysToDecode(v_selected_keys);
+	cfile->SetFilter(site_filter);
+
+	vector<uint32_t> v_sample_ids;
+	if (!select_samples(v_samples, v_sample_ids))
+		return false;
+
+	if (v_sample_ids.empty())
+		for (uint32_t i = 0; i < (uint32_t) v_samples.size(); ++i)
+			v_sample_ids.emplace_back(i);
+
+	vector<bool> v_selected_samples(v_samples.size(), false);
+	for (auto id : v_sample_ids)
+		v_selected_samples[id] = true;
+	cfile->SetSamplesToDecode(v_selected_samples);
+
+	uint32_t ploidy = cfile->GetPloidy();
+	uint32_t no_samples = (uint32_t) v_samples.size();
+	size_t no_haplotypes = v_sample_ids.size() * ploidy;
+
+	FILE* out = fopen(params.vcf_file_name.c_str(), "wb");
+	FILE* out_sites = fopen((params.vcf_file_name + ".sites").c_str(), "w");
+	ofstream out_samples(params.vcf_file_name + ".samples");
+
+	if (!out || !out_sites || !out_samples)
+	{
+		cerr << "Cannot open: " << params.vcf_file_name << " (or its .sites, .samples files)" << endl;
+		if (out)
+			fclose(out);
+		if (out_sites)
+			fclose(out_sites);
+		return false;
+	}
+
+	for (auto id : v_sample_ids)
+		out_samples << v_samples[id] << "\n";
+	out_samples.close();
+
+	setvbuf(out, nullptr, _IOFBF, 16 << 20);
+	setvbuf(out_sites, nullptr, _IOFBF, 4 << 20);
+	fprintf(out_sites, "#CHROM\tPOS\tID\tREF\tALT\n");
+
+	bool packed = params.gt_matrix == "2bit";
+	uint8_t missing = packed ? 3 : 255;
+	uint8_t max_allele = packed ? 2 : 254;
+
+	if (params.gt_matrix == "npy")
+		fwrite(npy_header(0, no_haplotypes).data(), 1, 128, out);
+
+	set_batch_size(no_samples, ploidy);
+
+	CCompressedFile::variant_columns_t columns;
+	CArena arena;
+	size_t no_variants = 0;
+	vector<uint8_t> v_row;
+
+	while (cfile->GetVariants(columns, no_variants_in_buf, &arena))
+	{
+		for (size_t i = 0; i < columns.no_variants; ++i)
+		{
+			auto& desc = columns.v_desc[i];
+			auto& field = columns.v_columns[gt_id][i];
+
+			fprintf(out_sites, "%s\t%lld\t%s\t%s\t%s\n", desc.chrom.c_str(), (long long) desc.pos, desc.id.c_str(), desc.ref.c_str(), desc.alt.c_str());
+
+			// Variants without genotypes (or with lower ploidy) are missing
+			const int32_t* gt = (const int32_t*) field.data;
+			uint32_t var_ploidy = field.present && no_samples ? field.data_size / no_samples : 0;
+
+			v_row.assign(packed ? (no_haplotypes + 3) / 4 : no_haplotypes, packed ? 0xff : missing);
+
+			for (size_t k = 0; k < v_sample_ids.size(); ++k)
+				for (uint32_t j = 0; j < ploidy && j < var_ploidy; ++j)
+				{
+					int32_t x = gt[(size_t) v_sample_ids[k] * var_ploidy + j];
+					uint8_t c = missing;
+
+					if (x != bcf_int32_vector_end && (x >> 1) != 0)
+						c = (uint8_t) min<int32_t>((x >> 1) - 1, max_allele);
+
+					size_t h = k * ploidy + j;
+
+					if (packed)
+						v_row[h >> 2] = (uint8_t) ((v_row[h >> 2] & ~(3u << ((h & 3) * 2))) | (c << ((h & 3) * 2)));
+					else
+						v_row[h] = c;
+				}
+
+			fwrite(v_row.data(), 1, v_row.size(), out);
+		}
+
+		no_variants += columns.no_variants;
+		arena.Reset();
+	}
+
+	if (params.gt_matrix == "npy")
+	{
+		fseek(out, 0, SEEK_SET);
+		fwrite(npy_header(no_variants, no_haplotypes).data(), 1, 128, out);
+	}
+
+	fclose(out);
+	fclose(out_sites);
+
+	cout << "GT matrix: " << no_variants << " variants x " << no_haplotypes << " haplotypes (" << params.gt_matrix << ")" << endl;
+
+	cfile->Close();
+
 	return true;
 }
 
@@ -15,6 +15,7 @@
 #include <list>
 #include <deque>
 #include <memory>
+#include <map>
 
 #include "params.h"
 #include "vcf.h"
@@ -26,9 +27,26 @@ using namespace std;
 // ******************************************************************************
 class CApplication
 {
-	const size_t no_variants_in_buf = 8192u;
-//	const size_t no_variants_in_buf = 4096u;
-	const size_t max_size_of_function = 16384u;
+public:
+	// Time [s] a pipeline stage was running and spent on waiting for its input and for a free slot for its output
+	struct stage_stats_t {
+		string name;
+		double time;
+		double input_wait;
+		double output_wait;
+	};
+
+private:
+	// No. of variants in a batch is set from memory of a variant (estimated from no. of samples and keys)
+	size_t stage_memory;		// Target memory of a batch of variants
+	const size_t max_stage_memory = 256u << 20;
+	const size_t min_variants_in_buf = 64u;
+	const size_t max_variants_in_buf = 65536u;
+	size_t no_variants_in_buf;
+	const uint32_t no_threads_per_chunk_decoder = 4u;
+	const uint32_t no_threads_per_parser = 4u;
+	const uint32_t no_threads_per_record_builder = 4u;
+	const uint32_t no_threads_per_io_thread = 4u;
 
 	typedef pair<uint8_t, uint32_t> run_desc_t;
 
@@ -40,28 +58,77 @@ class CApplication
 
 	CParams params;
 
-	vector<pair<variant_desc_t, vector<field_desc>>> v_vcf_data_compress, v_vcf_data_io;
+	typedef pair<variant_desc_t, vector<field_desc>> variant_t;
+
+	// Variants are kept between uses of a batch (first size are valid), so their memory is reused.
+	// Decompression uses columns instead of v_variants. Field data are in arenas reset when the batch is recycled.
+	struct variant_batch_t {
+		vector<variant_t> v_variants;
+		size_t size;
+		CCompressedFile::variant_columns_t columns;
+		vector<CArena> v_arenas;
+		vector<shared_ptr<CArena>> v_chunk_arenas;		// arenas of batches from chunk decoders the variants were moved from
+
+		variant_t& Add(size_t no_keys)
+		{
+			if (size == v_variants.size())
+				v_variants.emplace_back(variant_desc_t(), vector<field_desc>(no_keys));
+			else
+				fill(v_variants[size].second.begin(), v_variants[size].second.end(), field_desc());
+
+			return v_variants[size++];
+		}
+
+		void Recycle()
+		{
+			size = 0;
+			columns.no_variants = 0;
+			for (auto& arena : v_arenas)
+				arena.Reset();
+			v_chunk_arenas.clear();
+		}
+	};
+
+	struct bcf_batch_t {
+		vector<bcf1_t*> v_rec;
+		size_t size;
+	};
+
+	vector<stage_stats_t> v_stage_stats;
 
 	vector<tuple<uint8_t, run_t, uint32_t, uint32_t>> v_sample_data_compress, v_sample_data_io;
 	vector<pair<variant_desc_t, uint8_t>> v_sample_d_data_compress, v_sample_d_data_io;
 
-	vector<bcf1_t*> v_bcf_io, v_bcf_parse;
-	size_t s_bcf_io, s_bcf_parse;
-
-	function_size_graph_t function_size_graph;
-	function_data_graph_t function_data_graph;
-
 	mutex mtx;
 	condition_variable cv;
 
     vector<key_desc> keys;
 
+	void set_batch_size(uint32_t no_samples, uint32_t ploidy);
+	bool store_stats(const vector<CCompressedFile*> &v_cfiles, size_t no_variants, double time);
+	bool select_keys(CVCF *vcf, vector<bool> &v_selected);
+	bool select_samples(const vector<string> &v_samples, vector<uint32_t> &v_sample_ids);
+	bool make_site_filter(CVCF *vcf, CSiteFilter &site_filter);
+
+	uint32_t no_io_threads()
+	{
+		return params.no_io_threads ? params.no_io_threads : max(1u, params.no_threads / no_threads_per_io_thread);
+	}
+
 public:
 	CApplication(const CParams &_params);
 	~CApplication();
 
 	bool CompressDB();
 	bool DecompressDB();
+	bool InfoDB();
+	bool StatsDB();
+	bool GTMatrixDB();
+
+	vector<stage_stats_t> GetStageStats()
+	{
+		return v_stage_stats;
+	}
 };
 
 // EOF
@@ -8,57 +8,252 @@
 // *******************************************************************************************
 
 #include "archive.h"
+#include "trace.h"
 
 #include <iostream>
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
+#include <cerrno>
 #include <utility>
+#include <list>
 
 #ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #define my_fseek	fseek
 #define my_ftell	ftell
 #else
+#include <io.h>
+#include <fcntl.h>
+
 #define my_fseek	_fseeki64
 #define my_ftell	_ftelli64
 #endif
 
 using namespace std;
 
+// Streaming layout: magic followed by records, each starting with one of the tags
+static const uint8_t streaming_magic[8] = { 'V', 'C', 'F', 'S', 'H', 'A', 'R', 'K' };
+
+enum streaming_tag_t : int { tag_stream = 'S', tag_part = 'P', tag_raw_size = 'R', tag_end = 'E' };
+
+mutex CArchive::mtx_stdin;
+shared_ptr<uint8_t> CArchive::stdin_data;
+size_t CArchive::stdin_size = 0;
+
 // ******************************************************************************
 CArchive::CArchive(bool _input_mode)
 {
 	f = nullptr;
+	f_verify = nullptr;
 	input_mode = _input_mode;
+	is_open = false;
+	is_streaming = false;
+	f_offset = 0;
+
+	q_writer = nullptr;
+	no_pending_tasks = 0;
+	direct_io = false;
+	write_failed = false;
+	out_buffer = nullptr;
+	out_filled = 0;
+
+	p_mem = nullptr;
+	archive_size = 0;
+
+#ifndef _WIN32
+	fd = -1;
+	p_map = nullptr;
+	out_fd = -1;
+#endif
 }
 
 // ******************************************************************************
 CArchive::~CArchive()
 {
-	if (f)
+	if (is_open)
 		Close();
 }
 
 // ******************************************************************************
 bool CArchive::Open(string _file_name)
 {
-	lock_guard<mutex> lck(mtx);
+	if (is_open)
+		Close();
 
-	if (f)
-		fclose(f);
+	lock_guard<mutex> lck(mtx);
 
 	m_streams.clear();
+	m_stream_ids.clear();
+	uo_signatures.clear();
+	m_part_refs.clear();
 	file_name = _file_name;
+	f_offset = 0;
+	write_failed = false;
+
+	if (input_mode)
+		return open_input();
+
+	is_streaming = file_name == "-";
 
-	f = fopen(file_name.c_str(), input_mode ? "rb" : "wb");
+#ifndef _WIN32
+	if (is_streaming)
+		out_fd = STDOUT_FILENO;
+	else
+	{
+		int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+		if (direct_io)
+			out_fd = open(file_name.c_str(), flags | O_DIRECT, 0644);
+#endif
+		if (out_fd < 0)
+			out_fd = open(file_name.c_str(), flags, 0644);
+	}
 
-	setvbuf(f, nullptr, _IOFBF, 64 << 20);
+	if (out_fd < 0)
+		return false;
+#else
+	if (is_streaming)
+	{
+		_setmode(_fileno(stdout), _O_BINARY);
+		f = stdout;
+	}
+	else
+		f = fopen(file_name.c_str(), "wb");
 
 	if (!f)
 		return false;
+#endif
 
-	if (input_mode)
-		deserialize();
+	// Buffer aligned for O_DIRECT
+	v_out_raw.resize(out_buffer_size + io_alignment);
+	out_buffer = v_out_raw.data() + (io_alignment - (size_t) v_out_raw.data() % io_alignment) % io_alignment;
+	out_filled = 0;
 
-	f_offset = 0;
+	is_open = true;
+
+	if (is_streaming)
+		append(streaming_magic, sizeof(streaming_magic));
+
+	q_writer = new CRegisteringQueue<write_task_t>(1);
+	no_pending_tasks = 0;
+	t_writer = thread([this] {writer_loop(); });
+
+	return true;
+}
+
+// ******************************************************************************
+bool CArchive::open_input()
+{
+	if (file_name == "-")
+	{
+		if (!load_stdin())
+			return false;
+	}
+	else
+	{
+#ifndef _WIN32
+		fd = open(file_name.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+
+		struct stat st;
+		if (fstat(fd, &st) != 0)
+		{
+			close(fd);
+			fd = -1;
+			return false;
+		}
+		archive_size = (size_t) st.st_size;
+
+		if (archive_size)
+		{
+			void* p = mmap(nullptr, archive_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED)
+			{
+				p_map = p;
+				p_mem = (const uint8_t*) p;
+			}
+		}
+#else
+		f = fopen(file_name.c_str(), "rb");
+		if (!f)
+			return false;
+
+		my_fseek(f, 0, SEEK_END);
+		archive_size = (size_t) my_ftell(f);
+#endif
+	}
+
+	is_open = true;
+
+	vector<uint8_t> v_magic;
+	const uint8_t* p;
+
+	is_streaming = archive_size >= sizeof(streaming_magic) && read_range(0, sizeof(streaming_magic), v_magic, p) &&
+		equal(p, p + sizeof(streaming_magic), streaming_magic);
+
+	if (!(is_streaming ? scan_streaming() : deserialize()))
+		return false;
+
+	count_part_refs();
+
+	return true;
+}
+
+// ******************************************************************************
+// Stdin is read in chunks, which are then moved one by one to a buffer of the final size (not initialized,
+// so its pages are committed as they are filled). Memory peak is thus about the archive size plus a chunk.
+bool CArchive::load_stdin()
+{
+	lock_guard<mutex> lck(mtx_stdin);
+
+	if (!stdin_data)
+	{
+#ifdef _WIN32
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif
+		list<vector<uint8_t>> l_chunks;
+		size_t size = 0;
+
+		while (true)
+		{
+			l_chunks.emplace_back(stdin_chunk_size);
+
+			auto& chunk = l_chunks.back();
+			size_t filled = 0;
+
+			while (filled < chunk.size())
+			{
+				auto r = fread(chunk.data() + filled, 1, chunk.size() - filled, stdin);
+				if (!r)
+					break;
+				filled += r;
+			}
+
+			size += filled;
+
+			if (filled < stdin_chunk_size)
+				break;
+		}
+
+		stdin_data = shared_ptr<uint8_t>(new uint8_t[max<size_t>(size, 1)], default_delete<uint8_t[]>());
+		stdin_size = size;
+
+		for (size_t pos = 0; pos < size; pos += stdin_chunk_size)
+		{
+			copy_n(l_chunks.front().data(), min(stdin_chunk_size, size - pos), stdin_data.get() + pos);
+			l_chunks.pop_front();
+		}
+	}
+
+	p_loaded = stdin_data;
+	p_mem = p_loaded.get();
+	archive_size = stdin_size;
 
 	return true;
 }
@@ -66,121 +261,314 @@ bool CArchive::Open(string _file_name)
 // ******************************************************************************
 bool CArchive::Close()
 {
+	if (q_writer)
+	{
+		q_writer->MarkCompleted();
+		t_writer.join();
+
+		delete q_writer;
+		q_writer = nullptr;
+	}
+
 	lock_guard<mutex> lck(mtx);
 
-	if (!f)
+	if (!is_open)
 		return false;
 
-	if (input_mode)
+	bool ok = true;
+
+	if (!input_mode)
 	{
-		fclose(f);
-		f = nullptr;
+		serialize();
+		flush_out(true);
+		ok = !write_failed;
+
+		v_out_raw.clear();
+		v_out_raw.shrink_to_fit();
+		out_buffer = nullptr;
 	}
-	else
+
+	if (f == stdout)
+		ok &= fflush(f) == 0;
+	else if (f)
+		ok &= fclose(f) == 0;
+	f = nullptr;
+
+	if (f_verify)
 	{
-		serialize();
-		fclose(f);
-		f = nullptr;
+		fclose(f_verify);
+		f_verify = nullptr;
 	}
 
-	return true;
+#ifndef _WIN32
+	if (p_map)
+	{
+		munmap(p_map, archive_size);
+		p_map = nullptr;
+	}
+
+	if (fd >= 0)
+	{
+		close(fd);
+		fd = -1;
+	}
+
+	if (out_fd >= 0 && out_fd != STDOUT_FILENO)
+		ok &= close(out_fd) == 0;
+	out_fd = -1;
+#endif
+
+	p_mem = nullptr;
+	p_loaded.reset();
+	archive_size = 0;
+	is_open = false;
+
+	if (!ok && !input_mode)
+		cerr << "Archive " << file_name << " is incomplete\n";
+
+	return ok;
 }
 
 // ******************************************************************************
-size_t CArchive::write_fixed(size_t x, FILE* file)
+size_t CArchive::write_fixed(size_t x)
 {
-	fwrite(&x, 1, 8, file);
+	uint8_t bytes[8];
+
+	memcpy(bytes, &x, 8);
+	append(bytes, 8);
 
 	return 8;
 }
 
 // ******************************************************************************
-size_t CArchive::write(size_t x, FILE* file)
+size_t CArchive::write(size_t x)
 {
+	uint8_t bytes[9];
 	int no_bytes = 0;
 
 	for (size_t tmp = x; tmp; tmp >>= 8)
 		++no_bytes;
 	
-	putc(no_bytes, file);
+	bytes[0] = (uint8_t) no_bytes;
 
 	for (int i = no_bytes; i; --i)
-		putc((x >> ((i - 1) * 8)) & 0xff, file);
+		bytes[no_bytes - i + 1] = (x >> ((i - 1) * 8)) & 0xff;
+
+	append(bytes, no_bytes + 1);
 
 	return no_bytes + 1;
 }
 
 // ******************************************************************************
-size_t CArchive::write(string s, FILE* file)
+size_t CArchive::write(string s)
 {
-	fwrite(s.c_str(), 1, s.size(), file);
-	putc(0, file);
+	append((const uint8_t*) s.c_str(), s.size() + 1);
 
 	return s.size() + 1;
 }
 
 // ******************************************************************************
-size_t CArchive::read_fixed(size_t& x, FILE* file)
+void CArchive::append(const uint8_t* p, size_t size)
+{
+	f_offset += size;
+
+	while (size)
+	{
+		size_t n = min(size, out_buffer_size - out_filled);
+
+		memcpy(out_buffer + out_filled, p, n);
+		out_filled += n;
+		p += n;
+		size -= n;
+
+		if (out_filled == out_buffer_size)
+			flush_out(false);
+	}
+}
+
+// ******************************************************************************
+// Writes the buffered bytes. With O_DIRECT only whole aligned blocks are written, except of the final flush.
+bool CArchive::flush_out(bool final)
+{
+	if (write_failed)
+	{
+		out_filled = 0;
+		return false;
+	}
+
+	size_t n = out_filled;
+
+#if !defined(_WIN32) && defined(O_DIRECT)
+	if (direct_io)
+	{
+		if (final)
+			fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL) & ~O_DIRECT);
+		else
+			n -= n % io_alignment;
+	}
+#endif
+
+	bool r = write_out(out_buffer, n);
+
+	if (n < out_filled)
+		memmove(out_buffer, out_buffer + n, out_filled - n);
+	out_filled -= n;
+
+	return r;
+}
+
+// ******************************************************************************
+bool CArchive::write_out(const uint8_t* p, size_t size)
 {
-	return fread(&x, 8, 1, file) * 8;
+#ifndef _WIN32
+	while (size)
+	{
+		auto r = ::write(out_fd, p, size);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+		{
+			cerr << "Cannot write to " << file_name << ": " << strerror(errno) << endl;
+			write_failed = true;
+			return false;
+		}
+
+		p += r;
+		size -= (size_t) r;
+	}
+
+	return true;
+#else
+	if (fwrite(p, 1, size, f) == size)
+		return true;
+
+	cerr << "Cannot write to " << file_name << endl;
+	write_failed = true;
+
+	return false;
+#endif
 }
 
 // ******************************************************************************
-size_t CArchive::read(size_t& x, FILE* file)
+size_t CArchive::read_fixed(size_t& x, const uint8_t* p)
 {
-	int no_bytes = getc(file);
+	memcpy(&x, p, 8);
+
+	return 8;
+}
+
+// ******************************************************************************
+size_t CArchive::read(size_t& x, const uint8_t* p)
+{
+	int no_bytes = *p++;
 
 	x = 0;
 
 	for (int i = 0; i < no_bytes; ++i)
 	{
 		x <<= 8;
-		x += (size_t)getc(file);
+		x += (size_t)*p++;
 	}
 
 	return no_bytes + 1;
 }
 
 // ******************************************************************************
-size_t CArchive::read(string& s, FILE* file)
+size_t CArchive::read(string& s, const uint8_t* p, const uint8_t* p_end)
 {
-	s.clear();
+	auto q = (const uint8_t*) memchr(p, 0, p_end - p);
 
-	while (true)
+	if (!q)
 	{
-		int c = getc(file);
-		if (c == EOF)
-			return 0;
+		s.clear();
+		return 0;
+	}
+
+	s.assign((const char*) p, (const char*) q);
 
-		if (c == 0)
-			return s.size() + 1;
+	return s.size() + 1;
+}
+
+// ******************************************************************************
+// Makes [offset, offset+size) of the input archive available at p_data.
+// When the archive is in memory no copy is made, otherwise the range is read into v_buffer.
+bool CArchive::read_range(size_t offset, size_t size, vector<uint8_t>& v_buffer, const uint8_t*& p_data)
+{
+	if (offset + size > archive_size)
+		return false;
 
-		s.push_back((char)c);
+	if (p_mem)
+	{
+		p_data = p_mem + offset;
+		return true;
+	}
+
+#ifndef _WIN32
+	v_buffer.resize(size);
+
+	for (size_t done = 0; done < size;)
+	{
+		auto r = pread(fd, v_buffer.data() + done, size - done, (off_t) (offset + done));
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+		done += (size_t) r;
 	}
+#else
+	lock_guard<mutex> lck(mtx);
 
-	return 0;
+	v_buffer.resize(size);
+
+	my_fseek(f, offset, SEEK_SET);
+	if (fread(v_buffer.data(), 1, size, f) != size)
+		return false;
+#endif
+
+	p_data = v_buffer.data();
+
+	return true;
 }
 
 // ******************************************************************************
 bool CArchive::serialize()
 {
+	if (is_streaming)
+	{
+		// Raw sizes are known only at the end, so they are stored in the closing records
+		uint8_t tag;
+
+		for (auto& stream : m_streams)
+		{
+			tag = tag_raw_size;
+			append(&tag, 1);
+			write(stream.first);
+			write(stream.second.raw_size);
+		}
+
+		tag = tag_end;
+		append(&tag, 1);
+
+		return true;
+	}
+
 	size_t footer_size = 0;
 
 	// Store stream part offsets
-	footer_size += write(m_streams.size(), f);
+	footer_size += write(m_streams.size());
 
 	for (auto& stream : m_streams)
 	{
 		size_t str_size = 0;
 
-		footer_size += write(stream.second.stream_name, f);
-		footer_size += write(stream.second.parts.size(), f);
-		footer_size += write(stream.second.raw_size, f);
+		footer_size += write(stream.second.stream_name);
+		footer_size += write(stream.second.parts.size());
+		footer_size += write(stream.second.raw_size);
 
 		for (auto& part : stream.second.parts)
 		{
-			footer_size += write(part.offset, f);
-			footer_size += write(part.size, f);
+			footer_size += write(part.offset);
+			footer_size += write(part.size);
 
 			str_size += part.size;
 		}
@@ -190,59 +578,187 @@ bool CArchive::serialize()
 #endif
 	}
 
-	write_fixed(footer_size, f);
+	write_fixed(footer_size);
 
 	return true;
 }
 
+// ******************************************************************************
+// Finds parts stored once for many part entries (deduplicated)
+void CArchive::count_part_refs()
+{
+	unordered_map<size_t, uint32_t> m_all_refs;
+
+	for (auto& stream : m_streams)
+		for (auto& part : stream.second.parts)
+			if (part.size)
+				++m_all_refs[part.offset];
+
+	m_part_refs.clear();
+
+	for (auto& x : m_all_refs)
+		if (x.second > 1)
+			m_part_refs.emplace(x);
+}
+
 // ******************************************************************************
 bool CArchive::deserialize()
 {
 	size_t footer_size;
+	vector<uint8_t> v_footer;
+	const uint8_t* p;
 
-	my_fseek(f, -8, SEEK_END);
-	read_fixed(footer_size, f);
+	if (archive_size < 8 || !read_range(archive_size - 8, 8, v_footer, p))
+		return false;
+	read_fixed(footer_size, p);
+
+	if (footer_size + 8 > archive_size || !read_range(archive_size - 8 - footer_size, footer_size, v_footer, p))
+		return false;
 
-	my_fseek(f, -(long)(8 + footer_size), SEEK_END);
+	const uint8_t* p_end = p + footer_size;
 
 	// Load stream part offsets
 	size_t n_streams;
-	read(n_streams, f);
+	p += read(n_streams, p);
 
 	for (size_t i = 0; i < n_streams; ++i)
 	{
 		m_streams[(int) i] = stream_t();
 		auto& stream_second = m_streams[(int) i];
 
-		read(stream_second.stream_name, f);
-		read(stream_second.cur_id, f);
-		read(stream_second.raw_size, f);
+		p += read(stream_second.stream_name, p, p_end);
+		m_stream_ids[stream_second.stream_name] = (int) i;
+		p += read(stream_second.cur_id, p);
+		p += read(stream_second.raw_size, p);
 
 		stream_second.parts.resize(stream_second.cur_id);
 		for (size_t j = 0; j < stream_second.cur_id; ++j)
 		{
-			read(stream_second.parts[j].offset, f);
-			read(stream_second.parts[j].size, f);
+			p += read(stream_second.parts[j].offset, p);
+			p += read(stream_second.parts[j].size, p);
 		}
 
 		stream_second.cur_id = 0;
+
+		if (p > p_end)
+			return false;
 	}
-	
-	my_fseek(f, 0, SEEK_SET);
 
 	return true;
 }
 
+// ******************************************************************************
+// Rebuilds the part lists by a single pass over the records of the streaming layout
+bool CArchive::scan_streaming()
+{
+	vector<uint8_t> v_buffer;
+	const uint8_t* p;
+	size_t pos = sizeof(streaming_magic);
+
+	while (pos < archive_size)
+	{
+		size_t len = min<size_t>(1024, archive_size - pos);
+
+		if (!read_range(pos, len, v_buffer, p))
+			return false;
+
+		const uint8_t* q = p + 1;
+		size_t stream_id, part_id, size, metadata;
+
+		switch (*p)
+		{
+		case tag_stream:
+		{
+			q += read(stream_id, q);
+
+			auto& stream = m_streams[(int) stream_id];
+			stream = stream_t();
+			stream.cur_id = 0;
+			stream.raw_size = 0;
+
+			size_t n = read(stream.stream_name, q, p + len);
+			if (!n)
+				return false;
+			q += n;
+
+			m_stream_ids[stream.stream_name] = (int) stream_id;
+			break;
+		}
+		case tag_part:
+		{
+			q += read(stream_id, q);
+			q += read(part_id, q);
+			q += read(size, q);
+
+			auto p_stream = m_streams.find((int) stream_id);
+			if (p_stream == m_streams.end())
+				return false;
+
+			auto& parts = p_stream->second.parts;
+			if (parts.size() <= part_id)
+				parts.resize(part_id + 1);
+			parts[part_id] = part_t(pos + (q - p), size);
+
+			q += read(metadata, q);
+			pos += size;
+			break;
+		}
+		case tag_raw_size:
+		{
+			q += read(stream_id, q);
+
+			auto p_stream = m_streams.find((int) stream_id);
+			if (p_stream == m_streams.end())
+				return false;
+
+			q += read(p_stream->second.raw_size, q);
+			break;
+		}
+		case tag_end:
+			return true;
+		default:
+			return false;
+		}
+
+		if (q > p + len)
+			return false;
+
+		pos += q - p;
+	}
+
+	return false;		// no end record - truncated archive
+}
+
 // ******************************************************************************
 int CArchive::RegisterStream(string stream_name)
 {
-	lock_guard<mutex> lck(mtx);
+	int id;
 
-	int id = (int) m_streams.size();
+	{
+		lock_guard<mutex> lck(mtx);
+
+		id = (int) m_streams.size();
 
-	m_streams[id] = stream_t();
-	m_streams[id].cur_id = 0;
-	m_streams[id].stream_name = stream_name;
+		m_streams[id] = stream_t();
+		m_streams[id].cur_id = 0;
+		m_streams[id].raw_size = 0;
+		m_streams[id].stream_name = stream_name;
+		m_stream_ids[stream_name] = id;
+	}
+
+	// Registration record must precede the parts of the stream
+	if (is_streaming)
+	{
+		write_task_t task;
+
+		task.stream_id = id;
+		task.part_id = -1;
+		task.metadata = 0;
+		task.signature = 0;
+		task.stream_name = stream_name;
+
+		enqueue(task);
+	}
 
 	return id;
 }
@@ -250,31 +766,20 @@ int CArchive::RegisterStream(string stream_name)
 // ******************************************************************************
 int CArchive::GetStreamId(string stream_name)
 {
-	lock_guard<mutex> lck(mtx);
+	// Stream catalog is not modified in input mode
+	unique_lock<mutex> lck(mtx, defer_lock);
+	if (!input_mode)
+		lck.lock();
 
-	for (auto& x : m_streams)
-		if (x.second.stream_name == stream_name)
-			return x.first;
+	auto p = m_stream_ids.find(stream_name);
 
-	return -1;
+	return p == m_stream_ids.end() ? -1 : p->second;
 }
 
 // ******************************************************************************
 bool CArchive::AddPart(int stream_id, vector<uint8_t> &v_data, size_t metadata)
 {
-	lock_guard<mutex> lck(mtx);
-
-	m_streams[stream_id].parts.emplace_back(f_offset, v_data.size());
-	m_streams[stream_id].signatures.emplace_back(signature(v_data) ^ metadata);
-
-	f_offset += write(metadata, f);
-
-	if(v_data.size())
-		fwrite(v_data.data(), 1, v_data.size(), f);
-
-	f_offset += v_data.size();
-
-	return true;
+	return AddPartComplete(stream_id, AddPartPrepare(stream_id), v_data, metadata);
 }
 
 // ******************************************************************************
@@ -291,16 +796,186 @@ int CArchive::AddPartPrepare(int stream_id)
 // ******************************************************************************
 bool CArchive::AddPartComplete(int stream_id, int part_id, vector<uint8_t>& v_data, size_t metadata)
 {
+	if (write_failed)
+		return false;
+
+	write_task_t task;
+
+	task.stream_id = stream_id;
+	task.part_id = part_id;
+	task.metadata = metadata;
+	task.signature = is_streaming ? 0 : signature(v_data, metadata);
+	task.v_data = move(v_data);
+	v_data.clear();
+
+	enqueue(task);
+
+	return true;
+}
+
+// ******************************************************************************
+void CArchive::enqueue(write_task_t& task)
+{
+	{
+		lock_guard<mutex> lck(mtx);
+		++no_pending_tasks;
+	}
+
+	q_writer->Emplace(task);
+}
+
+// ******************************************************************************
+void CArchive::writer_loop()
+{
+	write_task_t task;
+
+	CTracer::SetThreadName("writer");
+
+	while (q_writer->Pop(task))
+	{
+		{
+			CTraceScope trace("write part", "stream", task.stream_id);
+			store_part(task);
+		}
+
+		lock_guard<mutex> lck(mtx);
+		if (--no_pending_tasks == 0)
+			cv_pending_tasks.notify_all();
+	}
+}
+
+// ******************************************************************************
+void CArchive::wait_for_writer()
+{
+	unique_lock<mutex> lck(mtx);
+
+	cv_pending_tasks.wait(lck, [this] {return no_pending_tasks == 0; });
+}
+
+// ******************************************************************************
+// Writes the part unless a part of the same content (and metadata) is already stored in any stream.
+// In such a case the part entry just points to the stored copy, so repeated parts are written once.
+// Called only from the writer thread. Nothing is stored after a failed write.
+void CArchive::store_part(write_task_t& task)
+{
+	if (write_failed)
+		return;
+
+	uint8_t tag;
+
+	if (task.part_id < 0)
+	{
+		tag = tag_stream;
+		append(&tag, 1);
+		write(task.stream_id);
+		write(task.stream_name);
+
+		return;
+	}
+
+	part_t part;
+
+	// Stored parts cannot be read back from a pipe, so streaming archives are not deduplicated
+	if (is_streaming || task.v_data.empty() || !find_duplicate(task, part))
+	{
+		if (is_streaming)
+		{
+			tag = tag_part;
+			append(&tag, 1);
+			write(task.stream_id);
+			write(task.part_id);
+			write(task.v_data.size());
+		}
+
+		part = part_t(f_offset, task.v_data.size());
+
+		write(task.metadata);
+		append(task.v_data.data(), task.v_data.size());
+
+		if (!is_streaming && !task.v_data.empty())
+			uo_signatures.emplace(task.signature, make_pair(task.stream_id, task.part_id));
+	}
+
 	lock_guard<mutex> lck(mtx);
-	
-	m_streams[stream_id].parts[part_id] = part_t(f_offset, v_data.size());
-	m_streams[stream_id].signatures[part_id] = signature(v_data) ^ metadata;
 
-	f_offset += write(metadata, f);
-	if (v_data.size())
-		fwrite(v_data.data(), 1, v_data.size(), f);
+	auto& stream = m_streams[task.stream_id];
+	stream.parts[task.part_id] = part;
+	stream.signatures[task.part_id] = task.signature;
+}
+
+// ******************************************************************************
+bool CArchive::find_duplicate(write_task_t& task, part_t& dup_part)
+{
+	auto p = uo_signatures.find(task.signature);
+
+	if (p == uo_signatures.end())
+		return false;
+
+	part_t src_part;
+
+	{
+		lock_guard<mutex> lck(mtx);
+		src_part = m_streams[p->second.first].parts[p->second.second];
+	}
+
+	if (src_part.size != task.v_data.size() || !equal_to_stored(src_part, task.v_data, task.metadata))
+		return false;
+
+	dup_part = src_part;
+
+	return true;
+}
+
+// ******************************************************************************
+// Compares (metadata, data) with the part already stored in the output file
+bool CArchive::equal_to_stored(const part_t& part, vector<uint8_t>& v_data, size_t metadata)
+{
+	vector<uint8_t> v_meta;
+	for (size_t tmp = metadata; tmp; tmp >>= 8)
+		v_meta.insert(v_meta.begin(), (uint8_t) (tmp & 0xff));
+	v_meta.insert(v_meta.begin(), (uint8_t) v_meta.size());
+
+	vector<uint8_t> v_stored;
+
+	if (!read_stored(part.offset, v_meta.size() + v_data.size(), v_stored))
+		return false;
+
+	return equal(v_meta.begin(), v_meta.end(), v_stored.begin()) &&
+		equal(v_data.begin(), v_data.end(), v_stored.begin() + v_meta.size());
+}
+
+// ******************************************************************************
+// Reads bytes already stored in the output; they can be partially in the file and partially in out_buffer
+bool CArchive::read_stored(size_t offset, size_t size, vector<uint8_t>& v_stored)
+{
+	size_t flushed = f_offset - out_filled;
+
+	if (offset + size > f_offset)
+		return false;
+
+	v_stored.resize(size);
 
-	f_offset += v_data.size();
+	size_t n_file = offset < flushed ? min(size, flushed - offset) : 0;
+
+	if (n_file)
+	{
+		if (!f_verify)
+		{
+			f_verify = fopen(file_name.c_str(), "rb");
+			if (!f_verify)
+				return false;
+		}
+
+#ifdef _WIN32
+		fflush(f);
+#endif
+		my_fseek(f_verify, offset, SEEK_SET);
+		if (fread(v_stored.data(), 1, n_file, f_verify) != n_file)
+			return false;
+	}
+
+	if (n_file < size)
+		memcpy(v_stored.data() + n_file, out_buffer + (offset + n_file - flushed), size - n_file);
 
 	return true;
 }
@@ -342,34 +1017,70 @@ size_t CArchive::GetCompressedSize(int stream_id)
 // ******************************************************************************
 bool CArchive::GetPart(int stream_id, vector<uint8_t> &v_data, size_t &metadata)
 {
-	lock_guard<mutex> lck(mtx);
-	
-	auto& p = m_streams[stream_id];
+	const uint8_t* p_data;
+	size_t size;
+
+	if (!GetPart(stream_id, p_data, size, metadata))
+		return false;
+
+	v_data.assign(p_data, p_data + size);
+
+	return true;
+}
+
+// ******************************************************************************
+bool CArchive::GetPart(int stream_id, const uint8_t* &p_data, size_t &size, size_t &metadata)
+{
+	size_t offset;
+	uint32_t no_refs;
+
+	return GetPart(stream_id, p_data, size, metadata, offset, no_refs);
+}
+
+// ******************************************************************************
+bool CArchive::GetPart(int stream_id, const uint8_t* &p_data, size_t &size, size_t &metadata, size_t &offset, uint32_t &no_refs)
+{
+	// Stream map is not modified in input mode, so no lock is needed here
+	auto p_stream = m_streams.find(stream_id);
+
+	if (p_stream == m_streams.end())
+		return false;
+
+	auto& p = p_stream->second;
 
 	if (p.cur_id >= p.parts.size())
 		return false;
 
-	v_data.resize(p.parts[p.cur_id].size);
+	auto& part = p.parts[p.cur_id++];
 
-	my_fseek(f, p.parts[p.cur_id].offset, SEEK_SET);
+	p_data = nullptr;
+	size = part.size;
+	metadata = 0;
+	offset = part.offset;
+	no_refs = 1;
 
-	if(p.parts[p.cur_id].size != 0)
-		read(metadata, f);
-	else
-	{
-		metadata = 0;
-		p.cur_id++;
+	if (size == 0)
 		return true;
-	}
 
-	auto r = fread(v_data.data(), 1, p.parts[p.cur_id].size, f);
+	auto q_refs = m_part_refs.find(part.offset);
+	if (q_refs != m_part_refs.end())
+		no_refs = q_refs->second;
 
-	p.cur_id++;
+	// Metadata is stored in at most 9 bytes just before the data
+	size_t range_size = min<size_t>(size + 9, archive_size - min(archive_size, part.offset));
+	const uint8_t* q;
 
-	if (r != p.parts[p.cur_id-1].size)
+	if (range_size <= size || !read_range(part.offset, range_size, p.v_buffer, q))
 		return false;
 
-	return r == p.parts[p.cur_id-1].size;
+	size_t meta_size = read(metadata, q);
+
+	if (meta_size + size > range_size)
+		return false;
+
+	p_data = q + meta_size;
+
+	return true;
 }
 
 // ******************************************************************************
@@ -383,9 +1094,23 @@ bool CArchive::ResetStreamPartIterator(int stream_id)
 }
 
 // ******************************************************************************
-size_t CArchive::signature(vector<uint8_t>& v_data)
+bool CArchive::SetStreamPartIterator(int stream_id, size_t part_id)
 {
-	size_t h = 0;
+	lock_guard<mutex> lck(mtx);
+
+	auto p = m_streams.find(stream_id);
+	if (p == m_streams.end() || part_id > p->second.parts.size())
+		return false;
+
+	p->second.cur_id = part_id;
+
+	return true;
+}
+
+// ******************************************************************************
+size_t CArchive::signature(vector<uint8_t>& v_data, size_t metadata)
+{
+	size_t h = (metadata * 0xc2b2ae3d27d4eb4full) ^ v_data.size();
 
 	for (size_t i = 0; i < v_data.size(); i += 8)
 	{
@@ -399,19 +1124,79 @@ size_t CArchive::signature(vector<uint8_t>& v_data)
 		x *= 0xc4ceb9fe1a85ec53L;
 		x ^= x >> 33;
 
-		h ^= x;
+		// Order-dependent combination
+		h = ((h << 29) | (h >> 35)) ^ x;
+		h *= 0x9e3779b97f4a7c15ull;
 	}
 
 	return h;
 }
 
 // ******************************************************************************
-bool CArchive::LinkStream(int stream_id, string stream_name, int target_id)
+// True if both streams consist of the same stored parts
+bool CArchive::IsLinked(int stream_id, int target_id)
 {
-	m_streams[stream_id] = m_streams[target_id];
-	m_streams[stream_id].stream_name = stream_name;
+	wait_for_writer();
+
+	lock_guard<mutex> lck(mtx);
+
+	auto p = m_streams.find(stream_id);
+	auto q = m_streams.find(target_id);
+
+	if (p == m_streams.end() || q == m_streams.end() || p->second.parts.size() != q->second.parts.size())
+		return false;
+
+	auto& v_p = p->second.parts;
+	auto& v_q = q->second.parts;
+
+	for (size_t i = 0; i < v_p.size(); ++i)
+		if (v_p[i].size != v_q[i].size || (v_p[i].size && v_p[i].offset != v_q[i].offset))
+			return false;
 
 	return true;
 }
 
+// ******************************************************************************
+void CArchive::GetStreamsInfo(vector<stream_info_t>& v_info)
+{
+	if (!input_mode)
+		wait_for_writer();
+
+	lock_guard<mutex> lck(mtx);
+
+	unordered_set<size_t> s_stored;
+
+	v_info.clear();
+	v_info.reserve(m_streams.size());
+
+	for (auto& stream : m_streams)
+	{
+		stream_info_t info;
+
+		info.stream_id = stream.first;
+		info.stream_name = stream.second.stream_name;
+		info.raw_size = stream.second.raw_size;
+		info.packed_size = 0;
+		info.no_parts = stream.second.parts.size();
+		info.no_linked_parts = 0;
+		info.linked_size = 0;
+
+		for (auto& part : stream.second.parts)
+		{
+			info.packed_size += part.size;
+
+			if (!part.size)
+				continue;
+
+			if (!s_stored.insert(part.offset).second)
+			{
+				++info.no_linked_parts;
+				info.linked_size += part.size;
+			}
+		}
+
+		v_info.emplace_back(info);
+	}
+}
+
 // EOF
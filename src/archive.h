@@ -16,6 +16,12 @@
 #include <thread>
 #include <mutex>
 #include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <atomic>
+#include <condition_variable>
+
+#include "queue.h"
 
 using namespace std;
 
@@ -23,10 +29,57 @@ using namespace std;
 class CArchive
 {
 	bool input_mode;
+	bool is_open;
+	bool is_streaming;		// self-describing parts and no footer, so the archive can be piped ("-")
 	FILE* f;
-	size_t f_offset;
+	FILE* f_verify;			// output mode: reads back parts for duplicate verification
+	size_t f_offset;		// output mode: no. of bytes stored so far (written or in out_buffer)
 	string file_name;
 
+	// Output mode: parts are stored by a dedicated writer thread, so coder threads do not wait for storage
+	struct write_task_t {
+		int stream_id;
+		int part_id;			// -1 for stream registration
+		size_t metadata;
+		size_t signature;
+		vector<uint8_t> v_data;
+		string stream_name;
+	};
+
+	CRegisteringQueue<write_task_t>* q_writer;
+	thread t_writer;
+	size_t no_pending_tasks;
+	condition_variable cv_pending_tasks;
+
+	// Output mode: small parts are coalesced into large sequential writes
+	const size_t out_buffer_size = 16 << 20;
+	const size_t io_alignment = 4096;
+	bool direct_io;
+	atomic<bool> write_failed;		// sticky; nothing is written after a failed write
+	vector<uint8_t> v_out_raw;
+	uint8_t* out_buffer;
+	size_t out_filled;
+#ifndef _WIN32
+	int out_fd;
+#endif
+
+	// Input mode: the whole archive is at p_mem (mapped file or loaded from stdin),
+	// otherwise it is read by pread (fseek/fread on Windows)
+	const uint8_t* p_mem;
+	size_t archive_size;
+	shared_ptr<uint8_t> p_loaded;
+
+	// Stdin can be read only once, so its content is shared by all archives opened for "-"
+	const size_t stdin_chunk_size = 64 << 20;
+	static mutex mtx_stdin;
+	static shared_ptr<uint8_t> stdin_data;
+	static size_t stdin_size;
+
+#ifndef _WIN32
+	int fd;
+	void* p_map;
+#endif
+
 	struct part_t{
 		size_t offset;
 		size_t size;
@@ -44,44 +97,90 @@ class CArchive
 		size_t raw_size;
 		vector<part_t> parts;
 		vector<uint64_t> signatures;
+		vector<uint8_t> v_buffer;		// used only when the archive is not mapped
 	} stream_t;
 
 	map<int, stream_t> m_streams;
+	unordered_map<string, int> m_stream_ids;
 	mutex mtx;
 
+	// Output mode: signature of a stored part -> (stream_id, part_id) of its first copy
 	unordered_map<size_t, pair<int, int>> uo_signatures;
 
+	// Input mode: offset of a part stored once for many part entries -> no. of such entries
+	unordered_map<size_t, uint32_t> m_part_refs;
+
+	bool open_input();
+	bool load_stdin();
 	bool serialize();
 	bool deserialize();
-	size_t write_fixed(size_t x, FILE* file);
-	size_t write(size_t x, FILE *file);
-	size_t write(string s, FILE* file);
-	size_t read_fixed(size_t& x, FILE* file);
-	size_t read(size_t& x, FILE* file);
-	size_t read(string& s, FILE* file);
-	size_t signature(vector<uint8_t>& v_data);
+	bool scan_streaming();
+	void count_part_refs();
+	size_t write_fixed(size_t x);
+	size_t write(size_t x);
+	size_t write(string s);
+	void append(const uint8_t* p, size_t size);
+	bool flush_out(bool final);
+	bool write_out(const uint8_t* p, size_t size);
+	size_t read_fixed(size_t& x, const uint8_t* p);
+	size_t read(size_t& x, const uint8_t* p);
+	size_t read(string& s, const uint8_t* p, const uint8_t* p_end);
+	bool read_range(size_t offset, size_t size, vector<uint8_t>& v_buffer, const uint8_t*& p_data);
+	size_t signature(vector<uint8_t>& v_data, size_t metadata);
+	void enqueue(write_task_t& task);
+	void writer_loop();
+	void wait_for_writer();
+	void store_part(write_task_t& task);
+	bool find_duplicate(write_task_t& task, part_t& dup_part);
+	bool equal_to_stored(const part_t& part, vector<uint8_t>& v_data, size_t metadata);
+	bool read_stored(size_t offset, size_t size, vector<uint8_t>& v_stored);
 
 public:
+	struct stream_info_t {
+		int stream_id;
+		string stream_name;
+		size_t raw_size;
+		size_t packed_size;
+		size_t no_parts;
+		size_t no_linked_parts;		// parts sharing the stored copy of an earlier part (lower stream id or part id)
+		size_t linked_size;
+	};
+
 	CArchive(bool _input_mode);
 	~CArchive();
 
 	bool Open(string _file_name);
+	// Output mode: false also if any write failed
 	bool Close();
 
+	// Output mode (Linux): write the archive with O_DIRECT; must be set before Open
+	void SetDirectIO(bool _direct_io)
+	{
+		direct_io = _direct_io;
+	}
+
 	int RegisterStream(string stream_name);
 	int GetStreamId(string stream_name);
 
+	// v_data is moved to the writer thread; false after a failed write
 	bool AddPart(int stream_id, vector<uint8_t> &v_data, size_t metadata = 0);
 	int AddPartPrepare(int stream_id);
 	bool AddPartComplete(int stream_id, int part_id, vector<uint8_t>& v_data, size_t metadata = 0);
 
 	bool GetPart(int stream_id, vector<uint8_t> &v_data, size_t &metadata);
+	// Lock-free; p_data is valid until the next GetPart on the same stream (or Close if mapped).
+	// Different streams can be read concurrently, a single stream by one thread at a time.
+	bool GetPart(int stream_id, const uint8_t* &p_data, size_t &size, size_t &metadata);
+	// As above; offset identifies the stored copy and no_refs is no. of part entries (of any streams) pointing to it
+	bool GetPart(int stream_id, const uint8_t* &p_data, size_t &size, size_t &metadata, size_t &offset, uint32_t &no_refs);
 	void SetRawSize(int stream_id, size_t raw_size);
 	size_t GetRawSize(int stream_id);
 	size_t GetCompressedSize(int stream_id);
 	bool ResetStreamPartIterator(int stream_id);
+	bool SetStreamPartIterator(int stream_id, size_t part_id);
 
-	bool LinkStream(int stream_id, string stream_name, int target_id);
+	bool IsLinked(int stream_id, int target_id);
+	void GetStreamsInfo(vector<stream_info_t>& v_info);
 
 
 	size_t GetNoStreams()
@@ -0,0 +1,74 @@
+#pragma once
+// *******************************************************************************************
+// This file is a part of VCFShark software distributed under GNU GPL 3 licence.
+// The homepage of the VCFShark project is https://github.com/refresh-bio/VCFShark
+//
+// Authors: Sebastian Deorowicz, Agnieszka Danek, Marek Kokot
+// Version: 1.1
+// Date   : 2021-02-18
+// *******************************************************************************************
+
+// Memory arena for field data of a batch of variants: allocations are taken from large blocks
+// and released all at once by Reset, so the blocks are reused by the next batch
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+// *****************************************************************************************
+//
+class CArena {
+	struct block_t {
+		unique_ptr<char[]> data;
+		size_t size;
+
+		block_t(size_t _size) : data(new char[_size]), size(_size)
+		{}
+	};
+
+	size_t block_size;
+	vector<block_t> v_blocks;
+	size_t cur_block;
+	size_t cur_pos;
+
+public:
+	// *****************************************************************************************
+	//
+	CArena(size_t _block_size = 1 << 20) : block_size(_block_size), cur_block(0), cur_pos(0)
+	{}
+
+	// *****************************************************************************************
+	// Memory is 8B-aligned and valid until Reset
+	char* Allocate(size_t size)
+	{
+		size = (size + 7) & ~(size_t) 7;
+
+		while (cur_block < v_blocks.size() && cur_pos + size > v_blocks[cur_block].size)
+		{
+			++cur_block;
+			cur_pos = 0;
+		}
+
+		if (cur_block == v_blocks.size())
+			v_blocks.emplace_back(max(block_size, size));
+
+		char* p = v_blocks[cur_block].data.get() + cur_pos;
+		cur_pos += size;
+
+		return p;
+	}
+
+	// *****************************************************************************************
+	//
+	void Reset()
+	{
+		cur_block = 0;
+		cur_pos = 0;
+	}
+};
+
+// EOF
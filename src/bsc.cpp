@@ -88,31 +88,37 @@ bool CBSCWrapper::Compress(const vector<uint8_t>& v_input, vector<uint8_t>& v_ou
 // *******************************************************************************************
 bool CBSCWrapper::Decompress(vector<uint8_t>& v_input, vector<uint8_t>& v_output)
 {
-	vector<uint8_t> vi = v_input;
-	vector<uint8_t> vo;
+	return Decompress(v_input.data(), v_input.size(), v_output);
+}
 
+// *******************************************************************************************
+bool CBSCWrapper::Decompress(const uint8_t* p_input, size_t input_size, vector<uint8_t>& v_output)
+{
 	int p_block_size;
 	int p_data_size;
 
-	const unsigned char* ci = (const unsigned char*)vi.data();
-	bsc_block_info(ci, LIBBSC_HEADER_SIZE, &p_block_size, &p_data_size, 0);
+	if (input_size < LIBBSC_HEADER_SIZE)
+	{
+		v_output.clear();
+		return false;
+	}
+
+	const unsigned char* ci = (const unsigned char*)p_input;
+	if (bsc_block_info(ci, LIBBSC_HEADER_SIZE, &p_block_size, &p_data_size, 0) != LIBBSC_NO_ERROR || (size_t) p_block_size > input_size)
+	{
+		v_output.clear();
+		return false;
+	}
 
 #ifdef LOG_INFO
 	cout << "Block size " << p_block_size << endl;
 	cout << "Data size  " << p_data_size << endl;
 #endif
 
-	unsigned char* co = (unsigned char*)malloc(p_data_size);
-
-	bsc_decompress(ci, p_block_size, co, p_data_size, 0);
+	v_output.resize(p_data_size);
 
-	vo.assign(co, co + p_data_size);
-
-	free(co);
-
-	v_output = move(vo);
-
-	return true;
+	// Decode directly into the output vector
+	return bsc_decompress(ci, p_block_size, (unsigned char*)v_output.data(), p_data_size, 0) == LIBBSC_NO_ERROR;
 }
 
 // EOF
@@ -45,6 +45,7 @@ public:
 
 	bool Compress(const vector<uint8_t>& v_input, vector<uint8_t>& v_output);
 	static bool Decompress(vector<uint8_t>& v_input, vector<uint8_t>& v_output);
+	static bool Decompress(const uint8_t* p_input, size_t input_size, vector<uint8_t>& v_output);
 };
 
 // EOF
@@ -284,7 +284,7 @@ void CBuffer::permute_float_series_backward()
 }
 
 // ************************************************************************************
-void CBuffer::FuncInt(char*& p, uint32_t& size, char* src_p, uint32_t src_size)
+void CBuffer::FuncInt(char*& p, uint32_t& size, char* src_p, uint32_t src_size, CArena* arena)
 {
 	if (!src_size)
 	{
@@ -296,7 +296,7 @@ void CBuffer::FuncInt(char*& p, uint32_t& size, char* src_p, uint32_t src_size)
 
 	if (fun.empty())		// identity
 	{
-		p = new char[src_size * 4];
+		p = alloc(src_size * 4, arena);
 		copy_n(src_p, src_size * 4, p);
 		size = src_size;
 	}
@@ -306,14 +306,14 @@ void CBuffer::FuncInt(char*& p, uint32_t& size, char* src_p, uint32_t src_size)
 
 		auto& dest_vec = fun[src_vec];
 
-		p = new char[dest_vec.size()];
+		p = alloc(dest_vec.size(), arena);
 		copy_n(dest_vec.data(), dest_vec.size(), p);
 		size = (uint32_t) dest_vec.size();
 	}
 }
 
 // ************************************************************************************
-void CBuffer::FuncReal(char*& p, uint32_t& size, char* src_p, uint32_t src_size)
+void CBuffer::FuncReal(char*& p, uint32_t& size, char* src_p, uint32_t src_size, CArena* arena)
 {
 	if (!src_size)
 	{
@@ -325,7 +325,7 @@ void CBuffer::FuncReal(char*& p, uint32_t& size, char* src_p, uint32_t src_size)
 
 	if (fun.empty())	// identity
 	{
-		p = new char[src_size * 4];
+		p = alloc(src_size * 4, arena);
 		copy_n(src_p, src_size * 4, p);
 		size = src_size;
 	}
@@ -335,7 +335,7 @@ void CBuffer::FuncReal(char*& p, uint32_t& size, char* src_p, uint32_t src_size)
 
 		auto& dest_vec = fun[src_vec];
 
-		p = new char[dest_vec.size()];
+		p = alloc(dest_vec.size(), arena);
 		copy_n(dest_vec.data(), dest_vec.size(), p);
 		size = (uint32_t) dest_vec.size();
 	}
@@ -10,9 +10,11 @@
 
 #include <algorithm>
 #include <vector>
+#include <string>
 #include <cstdint>
 #include <cstring>
 #include "defs.h"
+#include "arena.h"
 
 using namespace std;
 
@@ -213,6 +215,12 @@ private:
 		return 4;
 	}
 
+	// Field data are allocated in the arena if given (and must not be deleted then)
+	char* alloc(size_t size, CArena* arena)
+	{
+		return arena ? arena->Allocate(size) : new char[size];
+	}
+
 	void permute_integer_series_forward();
 	void permute_integer_series_backward();
 	void permute_float_series_forward();
@@ -318,6 +326,11 @@ public:
 #endif
 	}
 
+	size_t GetNoItems(void)
+	{
+		return v_size.size();
+	}
+
 	// Input buffer methods
 	void ReadFlag(uint8_t &flag)
 	{
@@ -331,7 +344,7 @@ public:
 		flag = (uint8_t)v_size[v_size_pos++];
 	}
 
-	void ReadInt(char* &p, uint32_t& size)
+	void ReadInt(char* &p, uint32_t& size, CArena* arena = nullptr)
 	{
 		if (v_size.empty())
 		{
@@ -344,7 +357,7 @@ public:
 
 		if (size)
 		{
-			p = new char[size * 4];
+			p = alloc(size * 4, arena);
 
 			copy_n(v_data.begin() + v_data_pos, 4 * size, p);
 			v_data_pos += 4 * size;
@@ -353,7 +366,7 @@ public:
 			p = nullptr;
 	}
 
-	void ReadIntVarSize(char* &p, uint32_t& size)
+	void ReadIntVarSize(char* &p, uint32_t& size, CArena* arena = nullptr)
 	{
 		if (v_size.empty())
 		{
@@ -366,7 +379,7 @@ public:
 
 		if (size)
 		{
-			p = new char[size * 4];
+			p = alloc(size * 4, arena);
 			uint32_t val;
 
 			uint8_t* q = v_data.data();
@@ -397,7 +410,7 @@ public:
 			x = -x;
 	}
 
-	void ReadReal(char* &p, uint32_t& size)
+	void ReadReal(char* &p, uint32_t& size, CArena* arena = nullptr)
 	{
 		if (v_size.empty())
 		{
@@ -410,7 +423,7 @@ public:
 
 		if (size)
 		{
-			p = new char[size * 4];
+			p = alloc(size * 4, arena);
 
 			copy_n(v_data.begin() + v_data_pos, 4 * size, p);
 			v_data_pos += 4 * size;
@@ -419,7 +432,7 @@ public:
 			p = nullptr;
 	}
 
-	void ReadText(char* &p, uint32_t& size)
+	void ReadText(char* &p, uint32_t& size, CArena* arena = nullptr)
 	{
 		if (v_size.empty())
 		{
@@ -432,7 +445,7 @@ public:
 
 		if (size)
 		{
-			p = new char[size + 1];
+			p = alloc(size + 1, arena);
 
 			copy_n(v_data.begin() + v_data_pos, size, p);
 			p[size] = 0;
@@ -442,11 +455,35 @@ public:
 			p = nullptr;
 	}
 
+	// Skip item of no. of bytes per element as given
+	void Skip(uint32_t elem_size)
+	{
+		if (v_size.empty())
+			return;
+
+		v_data_pos += v_size[v_size_pos++] * elem_size;
+	}
+
+	void ReadText(string &s)
+	{
+		if (v_size.empty())
+		{
+			s.clear();
+
+			return;
+		}
+
+		uint32_t size = v_size[v_size_pos++];
+
+		s.assign((char*) v_data.data() + v_data_pos, size);
+		v_data_pos += size;
+	}
+
 	void SetBuffer(vector<uint32_t>& _v_size, vector<uint8_t>& _v_data);
 
 	void SetFunction(function_data_item_t& _fun);
-	void FuncInt(char*& p, uint32_t& size, char* src_p, uint32_t src_size);
-	void FuncReal(char*& p, uint32_t& size, char* src_p, uint32_t src_size);
+	void FuncInt(char*& p, uint32_t& size, char* src_p, uint32_t src_size, CArena* arena = nullptr);
+	void FuncReal(char*& p, uint32_t& size, char* src_p, uint32_t src_size, CArena* arena = nullptr);
 
 	bool IsEmpty()
 	{
@@ -11,11 +11,14 @@
 #include <iostream>
 #include <functional>
 #include <vector>
+#include <limits>
+#include <chrono>
 
 using namespace std;
 
 #include "cfile.h"
 #include "utils.h"
+#include "trace.h"
 
 // ************************************************************************************
 CCompressedFile::CCompressedFile()
@@ -25,21 +28,40 @@ CCompressedFile::CCompressedFile()
 	vcs_compression_level = 3;
 
 	archive = nullptr;
-	tmp_archive = nullptr;
 
 	q_packages = nullptr;
 	q_preparation_ids = nullptr;
-
-	vios_i = new CVectorIOStream(v_vios_i);
-	vios_o = new CVectorIOStream(v_vios_o);
-
-	rce = nullptr;
-	rcd = nullptr;
+	q_gt_block_jobs = nullptr;
+
+	checkpoint_interval = 0;
+	gt_block_size = 0;
+	gt_counts_only = false;
+	gt_summary = false;
+	gt_summary_stream_id = -1;
+	gt_summary_raw_size = 0;
+	shared_parts_size = 0;
+	max_buffer_size = 8 << 20;
+	max_buffer_gt_size = max_buffer_gt_size_limit;
+	max_memory = 0;
+	packages_memory = 0;
+	direct_io = false;
+	cur_checkpoint = 0;
+	end_variant = 0;
+	first_chunk = 0;
+	last_chunk = 0;
+	decoding_started = false;
+	coder_queue_wait_time = 0;
+	coder_lock_wait_time = 0;
+
+	region_from = 0;
+	region_to = numeric_limits<int64_t>::max();
 }
 
 // ************************************************************************************
 CCompressedFile::~CCompressedFile()
 {
+	stop_gt_block_workers();
+
 	v_coder_threads.clear();
 
 	using fo_t = function<void(void)>;
@@ -62,15 +84,11 @@ CCompressedFile::~CCompressedFile()
 		}
 	}));
 
-	if (rce)
-		q_fo.Push([=] {delete rce; });
-	if (rcd)
-		q_fo.Push([=] {delete rcd; });
-
-	if (vios_i)
-		q_fo.Push([=] {delete vios_i; });
-	if (vios_o)
-		q_fo.Push([=] {delete vios_o; });
+	for (auto& block : v_gt_blocks)
+	{
+		auto p = block.release();
+		q_fo.Push([=] {delete p; });
+	}
 
 	if (q_packages)
 		q_fo.Push([=] {delete q_packages; });
@@ -109,8 +127,6 @@ CCompressedFile::~CCompressedFile()
 	if (archive)
 		q_fo.Push([=] {delete archive; });
 
-	if (tmp_archive)
-		q_fo.Push([=] {delete tmp_archive; });
 		
 	q_fo.MarkCompleted();
 
@@ -140,9 +156,35 @@ bool CCompressedFile::OpenForReading(string file_name)
 	load_nodes("data_nodes", v_data_nodes);
 	load_edges("data_edges", v_data_edges, (int) v_data_nodes.size());
 
-	gt_stream_id = archive->GetStreamId("key_" + to_string(gt_key_id) + "_size");
+	first_chunk = 0;
+	if (load_index() && !region_chrom.empty())
+		select_region();
+	else
+		last_chunk = (uint32_t) v_checkpoints.size() - 1;
 
-	q_preparation_ids = new CRegisteringQueue<pair<int, int>>(1);
+	// Stream ids are resolved once, so per-part lookups do not touch the catalog
+	v_buf_ids_size.assign(no_keys, -1);
+	v_buf_ids_data.assign(no_keys, -1);
+	for (uint32_t i = 0; i < no_keys; ++i)
+	{
+		v_buf_ids_size[i] = archive->GetStreamId("key_" + to_string(i) + "_size");
+		v_buf_ids_data[i] = archive->GetStreamId("key_" + to_string(i) + "_data");
+	}
+
+	v_db_ids_size.clear();
+	for (auto& x : db_stream_name_size)
+		v_db_ids_size.emplace_back(archive->GetStreamId(x));
+
+	v_db_ids_data.clear();
+	for (auto& x : db_stream_name_data)
+		v_db_ids_data.emplace_back(archive->GetStreamId(x));
+
+	v_key_coding_time.assign(no_keys, 0.0);
+	v_db_coding_time.assign(no_db_fields, 0.0);
+	v_coder_busy_time.assign(no_coder_threads, 0.0);
+	coder_queue_wait_time = 0;
+
+	gt_stream_id = gt_key_id >= 0 && gt_key_id < (int) no_keys ? v_buf_ids_size[gt_key_id] : -1;
 
 	m_data_nodes.clear();
 	m_data_nodes.resize(no_keys, true);
@@ -152,21 +194,15 @@ bool CCompressedFile::OpenForReading(string file_name)
 	for(auto e : v_data_edges)
 		m_data_edges[e.second] = e.first;
 
-	v_packages.resize(no_keys, nullptr);
-	for (uint32_t i = 0; i < no_keys; ++i)
-		q_preparation_ids->Push(make_pair(i, -1));
+	v_key_decoded.assign(no_keys, true);
+	v_key_output.assign(no_keys, true);
+	v_key_filter.assign(no_keys, false);
 
+	v_packages.resize(no_keys, nullptr);
 	v_db_packages.resize(no_db_fields, nullptr);
-	for(uint32_t i = 0; i < no_db_fields; ++i)
-		q_preparation_ids->Push(make_pair(-1, i));
-
-	v_i_buf.resize(no_keys);
-	v_i_db_buf.resize(no_db_fields);
 
 	open_mode = open_mode_t::reading;
 
-	v_coder_threads.reserve(no_coder_threads);
-
 	v_bsc_size.resize(no_keys);
 	v_bsc_data.resize(no_keys);
 	v_text_pp.resize(no_keys);
@@ -175,40 +211,23 @@ bool CCompressedFile::OpenForReading(string file_name)
 
 	v_format_compress.resize(no_keys, nullptr);
 
-	rcd = new CRangeDecoder<CVectorIOStream>(*vios_i);
-
+	set_gt_blocks();
+	start_gt_block_workers();
 	pbwt_initialised = false;
 
-	InitPBWT();
-
 	for (uint32_t i = 0; i < no_keys; ++i)
 	{
 		v_bsc_size[i] = new CBSCWrapper;
 		v_bsc_size[i]->InitDecompress();
 
 		v_bsc_data[i] = new CBSCWrapper;
+		v_bsc_data[i]->InitDecompress();
 
 		if (keys[i].keys_type == key_type_t::fmt || keys[i].keys_type == key_type_t::info)
 		{
 			v_format_compress[i] = new CFormatCompress("key " + to_string(i), vcs_compression_level);
 			v_format_compress[i]->SetNoSamples(no_samples);
 		}
-
-		switch (keys[i].type)
-		{
-		case BCF_HT_FLAG:
-			v_bsc_data[i]->InitDecompress();
-			break;
-		case BCF_HT_INT:
-			v_bsc_data[i]->InitDecompress();
-			break;
-		case BCF_HT_REAL:
-			v_bsc_data[i]->InitDecompress();
-			break;
-		case BCF_HT_STR:
-			v_bsc_data[i]->InitDecompress();
-			break;
-		}
 	}
 
 	for (uint32_t i = 0; i < no_db_fields; ++i)
@@ -219,8 +238,92 @@ bool CCompressedFile::OpenForReading(string file_name)
 		v_bsc_db_data[i]->InitDecompress();
 	}
 
+	set_chunk_bounds();
+
+	// Decoding threads are started at the first request for a variant
+	decoding_started = false;
+
+	return true;
+}
+
+// ************************************************************************************
+void CCompressedFile::set_chunk_bounds()
+{
+	if (first_chunk > last_chunk)
+	{
+		i_variant = end_variant = 0;
+
+		return;
+	}
+
+	i_variant = v_checkpoints[first_chunk].first_variant;
+	end_variant = last_chunk + 1 < v_checkpoints.size() ? v_checkpoints[last_chunk + 1].first_variant : no_variants;
+}
+
+// ************************************************************************************
+void CCompressedFile::start_decoding()
+{
+	decoding_started = true;
+
+	if (first_chunk > last_chunk)
+		return;
+
+	auto& cp = v_checkpoints[first_chunk];
+
+	cur_checkpoint = first_chunk;
+	prev_pos = 0;
+
+	v_no_parts = cp.v_part_ids;
+
+	// Parts behind the last chunk are never decoded
+	if (last_chunk + 1 < v_checkpoints.size())
+		v_end_parts = v_checkpoints[last_chunk + 1].v_part_ids;
+	else
+		v_end_parts.assign(no_keys + no_db_fields, numeric_limits<uint32_t>::max());
+
+	for (uint32_t i = 0; i < no_keys; ++i)
+	{
+		archive->SetStreamPartIterator(v_buf_ids_size[i], cp.v_part_ids[i]);
+		archive->SetStreamPartIterator(v_buf_ids_data[i], cp.v_part_ids[i]);
+	}
+
+	for (uint32_t i = 0; i < no_db_fields; ++i)
+	{
+		archive->SetStreamPartIterator(v_db_ids_size[i], cp.v_part_ids[no_keys + i]);
+		archive->SetStreamPartIterator(v_db_ids_data[i], cp.v_part_ids[no_keys + i]);
+	}
+
+	// Chunk is decoded from the initial state of all models
+	for (uint32_t i = 0; i < no_keys; ++i)
+	{
+		v_text_pp[i].Reset();
+		reset_format_compress(i);
+	}
+
+	reset_gt_coders();
+
+	v_i_buf.clear();
+	v_i_buf.resize(no_keys);
+	v_i_db_buf.clear();
+	v_i_db_buf.resize(no_db_fields);
+
+	q_preparation_ids = new CRegisteringQueue<pair<int, int>>(1);
+
+	for (uint32_t i = 0; i < no_keys; ++i)
+		if (v_key_decoded[i])
+			q_preparation_ids->Push(make_pair(i, -1));
+
+	for(uint32_t i = 0; i < no_db_fields; ++i)
+		q_preparation_ids->Push(make_pair(-1, i));
+
+	v_coder_threads.reserve(no_coder_threads);
+
 	for (uint32_t i = 0; i < no_coder_threads; ++i)
-		v_coder_threads.emplace_back(thread([&]() {
+		v_coder_threads.emplace_back(thread([&, i]() {
+
+		double busy_time = 0;
+
+		CTracer::SetThreadName("decoder");
 
 		while (!q_preparation_ids->IsCompleted())
 		{
@@ -237,12 +340,31 @@ bool CCompressedFile::OpenForReading(string file_name)
 
 			if (p_ids.first >= 0)
 			{
-				pck->stream_id_size = archive->GetStreamId("key_" + to_string(p_ids.first) + "_size");
+				pck->stream_id_size = v_buf_ids_size[p_ids.first];
 
                 pck->is_func = !m_data_nodes[p_ids.first];
 
-				if (archive->GetPart(pck->stream_id_size, pck->v_compressed, raw_size))
+				uint32_t part_id = v_no_parts[p_ids.first]++;
+
+				if (part_id < v_end_parts[p_ids.first] && archive->GetPart(pck->stream_id_size, pck->p_compressed, pck->compressed_size, raw_size, pck->part_offset, pck->part_refs))
 				{
+					pck->part_id = (int) part_id;
+
+					// The first part of a chunk is decoded from the initial state of models
+					if (part_id && is_chunk_start(p_ids.first, part_id))
+					{
+						if ((int) pck->stream_id_size == gt_stream_id)
+							reset_gt_coders();
+						else
+						{
+							v_text_pp[p_ids.first].Reset();
+							reset_format_compress(p_ids.first);
+						}
+					}
+
+					CTraceScope trace((int) pck->stream_id_size != gt_stream_id ? "decode key" : "decode GT", "key", p_ids.first);
+					auto t_start = chrono::steady_clock::now();
+
 					if ((int) pck->stream_id_size != gt_stream_id)		// keys
 					{
 						pck->key_id = p_ids.first;
@@ -260,7 +382,11 @@ bool CCompressedFile::OpenForReading(string file_name)
 						decompress_gt(pck, raw_size);
 					}
 
+					double dt = chrono::duration<double>(chrono::steady_clock::now() - t_start).count();
+					busy_time += dt;
+
 					lock_guard<mutex> lck(m_packages);
+					v_key_coding_time[pck->key_id] += dt;
 					v_packages[pck->key_id] = pck;
 				}
 				else
@@ -277,13 +403,21 @@ bool CCompressedFile::OpenForReading(string file_name)
 			else
 			{
 				pck->db_id = p_ids.second;
-				pck->stream_id_size = archive->GetStreamId(db_stream_name_size[p_ids.second]);
-				pck->stream_id_data = archive->GetStreamId(db_stream_name_data[p_ids.second]);
-				
-				if (archive->GetPart(pck->stream_id_size, pck->v_compressed, raw_size))
+				pck->stream_id_size = v_db_ids_size[p_ids.second];
+				pck->stream_id_data = v_db_ids_data[p_ids.second];
+
+				uint32_t part_id = v_no_parts[no_keys + p_ids.second]++;
+
+				if (part_id < v_end_parts[no_keys + p_ids.second] && archive->GetPart(pck->stream_id_size, pck->p_compressed, pck->compressed_size, raw_size, pck->part_offset, pck->part_refs))
 				{
+					CTraceScope trace("decode db field", "db_field", p_ids.second);
+					auto t_start = chrono::steady_clock::now();
 					decompress_db(pck, raw_size, v_tmp);
+					double dt = chrono::duration<double>(chrono::steady_clock::now() - t_start).count();
+					busy_time += dt;
+
 					lock_guard<mutex> lck(m_packages);
+					v_db_coding_time[pck->db_id] += dt;
 					v_db_packages[pck->db_id] = pck;
 				}
 				else
@@ -298,9 +432,85 @@ bool CCompressedFile::OpenForReading(string file_name)
 						
 			cv_packages.notify_all();
 		}
+
+		lock_guard<mutex> lck(m_packages);
+		v_coder_busy_time[i] += busy_time;
 			}));
+}
 
-	return true;
+// ************************************************************************************
+void CCompressedFile::stop_decoding()
+{
+	if (!decoding_started)
+		return;
+
+	if (q_preparation_ids)
+	{
+		q_preparation_ids->MarkCompleted();
+
+		for (auto& t : v_coder_threads)
+			t.join();
+		v_coder_threads.clear();
+
+		coder_queue_wait_time += q_preparation_ids->GetPopWaitTime();
+		delete q_preparation_ids;
+		q_preparation_ids = nullptr;
+	}
+
+	for (auto& p : v_packages)
+		if (p)
+		{
+			delete p;
+			p = nullptr;
+		}
+
+	for (auto& p : v_db_packages)
+		if (p)
+		{
+			delete p;
+			p = nullptr;
+		}
+
+	// Shared parts not consumed within the decoded range
+	m_shared_parts.clear();
+	shared_parts_size = 0;
+
+	decoding_started = false;
+}
+
+// ************************************************************************************
+// Parts of keys share key_buffers_memory, GT parts hold ~gt_part_variants variants (ploidy 2 if unknown).
+// Under a memory budget, half of it is for buffers (3/4 for keys, 1/4 for GT) and parts can be smaller.
+void CCompressedFile::set_part_sizes()
+{
+	size_t key_size = key_buffers_memory / max(no_keys, 1u);
+	size_t gt_size = (size_t) gt_part_variants * 4u * (ploidy > 0 ? ploidy : 2) * no_samples;
+	size_t min_key_size = min_buffer_size;
+	size_t min_gt_size = min_buffer_gt_size;
+
+	if (max_memory)
+	{
+		key_size = min(key_size, max_memory / 2 * 3 / 4 / max(no_keys, 1u));
+		gt_size = min(gt_size, max_memory / 2 / 4);
+		min_key_size = min_gt_size = min_budget_buffer_size;
+	}
+
+	max_buffer_size = (uint32_t) min<size_t>(max<size_t>(key_size, min_key_size), max_buffer_size_limit);
+	max_buffer_gt_size = (uint32_t) min<size_t>(max<size_t>(gt_size, min_gt_size), max_buffer_gt_size_limit);
+}
+
+// ************************************************************************************
+// Must be called before OpenForWriting
+void CCompressedFile::SetMaxMemory(size_t _max_memory)
+{
+	max_memory = _max_memory;
+}
+
+// ************************************************************************************
+void CCompressedFile::GetPartSizes(uint32_t &_max_key_part, uint32_t &_max_gt_part)
+{
+	_max_key_part = max_buffer_size;
+	_max_gt_part = max_buffer_gt_size;
 }
 
 // ************************************************************************************
@@ -311,6 +521,7 @@ bool CCompressedFile::OpenForWriting(string file_name, uint32_t _no_keys)
 	if (archive)
 		delete archive;
 	archive = new CArchive(false);
+	archive->SetDirectIO(direct_io);
 
 	CBSCWrapper::InitLibrary(p_bsc_features);
 
@@ -321,6 +532,7 @@ bool CCompressedFile::OpenForWriting(string file_name, uint32_t _no_keys)
 	}
 
     no_keys = _no_keys;
+    set_part_sizes();
     
 	v_o_buf.resize(no_keys);
 	v_o_db_buf.resize(no_db_fields);
@@ -341,7 +553,15 @@ bool CCompressedFile::OpenForWriting(string file_name, uint32_t _no_keys)
 	pbwt_initialised = false;
 	no_variants = 0;
 
-	InitPBWT();
+	v_no_parts.clear();
+	v_no_parts.resize(no_keys + no_db_fields, 0);
+	v_chunk_start.clear();
+	v_chunk_start.resize(no_keys + no_db_fields, false);
+	v_raw_size_size.assign(no_keys + no_db_fields, 0);
+	v_raw_size_data.assign(no_keys + no_db_fields, 0);
+
+	v_checkpoints.clear();
+	v_checkpoints.emplace_back(checkpoint_t{0, v_no_parts, {}});
 
 	for (uint32_t i = 0; i < no_keys; i++)
 	{
@@ -379,13 +599,13 @@ bool CCompressedFile::OpenForWriting(string file_name, uint32_t _no_keys)
 		}
 	}
 
-	if (rce)
-		delete rce;
-	rce = new CRangeEncoder<CVectorIOStream>(*vios_o);
-
 	for (uint32_t i = 0; i < no_keys; i++)
 		v_buf_ids_data[i] = archive->RegisterStream("key_" + to_string(i) + "_data");
 
+	set_gt_blocks();
+	start_gt_block_workers();
+	InitPBWT();
+
 	// Register streams for variant descriptions
 	v_db_ids_size.clear();
 	for(auto x : db_stream_name_size)
@@ -438,10 +658,16 @@ bool CCompressedFile::OpenForWriting(string file_name, uint32_t _no_keys)
 	v_cnt_packages.resize(no_keys, 0);
 	v_cnt_db_packages.resize(no_db_fields, 0);
 
+	v_key_coding_time.assign(no_keys, 0.0);
+	v_db_coding_time.assign(no_db_fields, 0.0);
+	v_coder_busy_time.assign(no_coder_threads, 0.0);
+	coder_queue_wait_time = 0;
+	coder_lock_wait_time = 0;
+
 	v_coder_threads.reserve(no_coder_threads);
 
 	for (uint32_t i = 0; i < no_coder_threads; ++i)
-		v_coder_threads.emplace_back(thread([&]() {
+		v_coder_threads.emplace_back(thread([&, i]() {
 		
 		SPackage pck;
 		vector<uint8_t> v_compressed;
@@ -449,11 +675,19 @@ bool CCompressedFile::OpenForWriting(string file_name, uint32_t _no_keys)
 
 		auto fo = [this](SPackage& pck)->bool {return check_coder_compressor(pck); };
 
+		CTracer::SetThreadName("coder");
+
 		while (!q_packages->IsCompleted())
 		{
 			if (!q_packages->PopWithHint<SPackage>(pck, fo))
 				continue;
 
+			size_t pck_memory = pck.v_size.size() * 4 + pck.v_data.size();
+			bool is_db = pck.type == SPackage::package_t::db;
+			CTraceScope trace(is_db ? "compress db field" : pck.type == SPackage::package_t::gt ? "compress GT" : "compress key",
+				is_db ? "db_field" : "key", is_db ? pck.db_id : pck.key_id);
+			auto t_start = chrono::steady_clock::now();
+
 			{
 				unique_lock<mutex> lck(m_packages);
 
@@ -482,6 +716,21 @@ bool CCompressedFile::OpenForWriting(string file_name, uint32_t _no_keys)
 				compress_gt(pck);
 			else
 				compress_db(pck, v_compressed, v_tmp);
+
+			double dt = chrono::duration<double>(chrono::steady_clock::now() - t_start).count();
+
+			lock_guard<mutex> lck(m_packages);
+			if (is_db)
+				v_db_coding_time[pck.db_id] += dt;
+			else
+				v_key_coding_time[pck.key_id] += dt;
+			v_coder_busy_time[i] += dt;
+
+			if (max_memory)
+			{
+				packages_memory -= pck_memory;
+				cv_packages.notify_all();
+			}
 		}
 			}));
 
@@ -498,59 +747,69 @@ bool CCompressedFile::Close()
 		cout << i << ": " << distinct_values[i].size() << endl;
 #endif
 
+	bool ok = true;
+
 	if (open_mode == open_mode_t::writing)
 	{
-		vector<uint32_t> v_size;
-		vector<uint8_t> v_data;
-		vector<uint8_t> v_aux;
-
 		for (uint32_t i = 0; i < no_keys; ++i)
-		{
-			v_o_buf[i].GetBuffer(v_size, v_data);
-			auto part_id = archive->AddPartPrepare(v_buf_ids_size[i]);
-			archive->AddPartPrepare(v_buf_ids_data[i]);
+			flush_key_buffer(i);
+
+		for(uint32_t i = 0; i < no_db_fields; ++i)
+			flush_db_buffer(i);
 
-			SPackage pck((int) i != gt_key_id ? SPackage::package_t::fields : SPackage::package_t::gt, i, -1, v_buf_ids_size[i], v_buf_ids_data[i], part_id, v_size, v_data, v_aux);
+		q_packages->MarkCompleted();
 
-			q_packages->Push(pck);
-		}
+		for (uint32_t i = 0; i < no_coder_threads; ++i)
+			v_coder_threads[i].join();
 
-		for(uint32_t i = 0; i < no_db_fields; ++i)
+		coder_queue_wait_time = q_packages->GetPopWaitTime();
+		stop_gt_block_workers();
+
+		for (uint32_t i = 0; i < no_keys; ++i)
 		{
-			v_o_db_buf[i].GetBuffer(v_size, v_data);
-			auto part_id = archive->AddPartPrepare(v_db_ids_size[i]);
-			archive->AddPartPrepare(v_db_ids_data[i]);
+			archive->SetRawSize(v_buf_ids_size[i], v_raw_size_size[i]);
+			archive->SetRawSize(v_buf_ids_data[i], v_raw_size_data[i]);
+		}
 
-			SPackage pck(SPackage::package_t::db, -1, i, v_db_ids_size[i], v_db_ids_data[i], part_id, v_size, v_data, v_aux);
+		// Stream of GT key contains the 1st block only
+		for (auto& block : v_gt_blocks)
+			archive->SetRawSize(block->stream_id, block->raw_size);
 
-			q_packages->Push(pck);
+		for (uint32_t i = 0; i < no_db_fields; ++i)
+		{
+			archive->SetRawSize(v_db_ids_size[i], v_raw_size_size[no_keys + i]);
+			archive->SetRawSize(v_db_ids_data[i], v_raw_size_data[no_keys + i]);
 		}
 
-		q_packages->MarkCompleted();
+		if (gt_summary_stream_id >= 0)
+			archive->SetRawSize(gt_summary_stream_id, gt_summary_raw_size);
 
-		for (uint32_t i = 0; i < no_coder_threads; ++i)
-			v_coder_threads[i].join();
+		// Keys stored as copies of other keys are recorded as graph edges
+		find_links(v_buf_ids_size, v_size_nodes, v_size_edges);
+		find_links(v_buf_ids_data, v_data_nodes, v_data_edges);
 
-		save_descriptions();
+		store_nodes("size_nodes", v_size_nodes);
+		store_edges("size_edges", v_size_edges, (int) v_size_nodes.size());
+		store_nodes("data_nodes", v_data_nodes);
+		store_edges("data_edges", v_data_edges, (int) v_data_nodes.size());
 
-		delete rce;
-		rce = nullptr;
+		save_descriptions();
+		save_index();
 
-		archive->Close();
+		// Parts are stored by the writer thread of the archive, so a failed write is known only here
+		ok = archive->Close();
 	}
 	else if (open_mode == open_mode_t::reading)
 	{
-		q_preparation_ids->MarkCompleted();
-
-		for (uint32_t i = 0; i < no_coder_threads; ++i)
-			v_coder_threads[i].join();
+		stop_decoding();
+		stop_gt_block_workers();
 			
 		archive->Close();
 	}
 
 	open_mode = open_mode_t::none;
 	
-	return true;
+	return ok;
 }
 
 // ************************************************************************************
@@ -696,159 +955,594 @@ void CCompressedFile::SetNeglectLimit(uint32_t _neglect_limit)
 }
 
 // ************************************************************************************
-bool CCompressedFile::Eof()
+void CCompressedFile::SetCheckpointInterval(uint32_t _checkpoint_interval)
 {
-	if (open_mode == open_mode_t::reading)
-		return i_variant >= no_variants;
+	checkpoint_interval = _checkpoint_interval;
+}
 
-	return false;
+// ************************************************************************************
+// Must be called before OpenForWriting
+void CCompressedFile::SetGTBlockSize(uint32_t _gt_block_size)
+{
+	gt_block_size = _gt_block_size;
 }
 
 // ************************************************************************************
-bool CCompressedFile::GetVariant(variant_desc_t &desc, vector<field_desc> &fields)
+uint32_t CCompressedFile::GetGTBlockSize()
 {
-	desc.chrom.clear();
+	return gt_block_size;
+}
 
-	if (i_variant >= no_variants)
-		return false;
+// ************************************************************************************
+void CCompressedFile::SetGTSummary(bool _gt_summary)
+{
+	gt_summary = _gt_summary;
+}
 
-	int64_t pos;
+// ************************************************************************************
+bool CCompressedFile::GetGTSummary()
+{
+	return gt_summary;
+}
 
-	for (uint32_t i = 0; i < no_db_fields; ++i)
-	{
-		if (v_i_db_buf[i].IsEmpty())
-		{
-			unique_lock<mutex> lck(m_packages);
+// ************************************************************************************
+// Must be called before OpenForWriting
+void CCompressedFile::SetDirectIO(bool _direct_io)
+{
+	direct_io = _direct_io;
+}
 
-			cv_packages.wait(lck, [&, this] {return v_db_packages[i] != nullptr; });
+// ************************************************************************************
+// Must be called before OpenForReading
+void CCompressedFile::SetRegion(string _chrom, int64_t _from, int64_t _to)
+{
+	region_chrom = _chrom;
+	region_from = _from;
+	region_to = _to;
+}
 
-			v_i_db_buf[i].SetBuffer(v_db_packages[i]->v_size, v_db_packages[i]->v_data);
-			delete v_db_packages[i];
-			v_db_packages[i] = nullptr;
+// ************************************************************************************
+// Keys the requested keys are functions of are decoded too
+bool CCompressedFile::SetKeysToDecode(const vector<bool> &v_keys)
+{
+	if (open_mode != open_mode_t::reading || decoding_started)
+		return false;
 
-			q_preparation_ids->Push(make_pair(-1, i));
-		}
-	}
+	for (uint32_t i = 0; i < no_keys; ++i)
+		v_key_output[i] = i < v_keys.size() && v_keys[i];
 
-	char* str = nullptr;
-	uint32_t len = 0;
-	
-	v_i_db_buf[id_db_chrom].ReadText(str, len);
-	desc.chrom = string(str, str + len);
-	delete[] str;
+	for (uint32_t i = 0; i < no_keys; ++i)
+		if (v_key_output[i] && !m_data_nodes[i])
+			v_key_output[m_data_edges[i]] = true;
 
-	v_i_db_buf[id_db_id].ReadText(str, len);
-	desc.id = string(str, str + len);
-	delete[] str;
+	set_keys_decoded();
 
-	v_i_db_buf[id_db_ref].ReadText(str, len);
-	desc.ref = string(str, str + len);
-	delete[] str;
+	return true;
+}
 
-	v_i_db_buf[id_db_alt].ReadText(str, len);
-	desc.alt = string(str, str + len);
-	delete[] str;
+// ************************************************************************************
+bool CCompressedFile::SetFilter(const CSiteFilter &_site_filter)
+{
+	if (open_mode != open_mode_t::reading || decoding_started)
+		return false;
 
-	v_i_db_buf[id_db_qual].ReadText(str, len);
-	desc.qual = string(str, str + len);
-	delete[] str;
+	site_filter = _site_filter;
+	v_key_filter = site_filter.GetKeys();
+	v_key_filter.resize(no_keys, false);
 
-	v_i_db_buf[id_db_pos].ReadInt64(pos);
-	pos += prev_pos;
-	prev_pos = pos;
-	desc.pos = pos;
+	for (uint32_t i = 0; i < no_keys; ++i)
+		if (v_key_filter[i] && !m_data_nodes[i])
+			v_key_filter[m_data_edges[i]] = true;
 
-    // Load and set fields
-    for(uint32_t i = 0; i < no_keys; i++)
-    {
-		int ii = v_data_nodes[i].first;		// Change of column ordering
+	set_keys_decoded();
 
-		if (v_i_buf[ii].IsEmpty())
-		{
-			unique_lock<mutex> lck(m_packages);
+	return true;
+}
 
-			cv_packages.wait(lck, [&, this] {return v_packages[ii] != nullptr; });
+// ************************************************************************************
+// Streams of keys to output and of keys of the site filter are read
+void CCompressedFile::set_keys_decoded()
+{
+	for (uint32_t i = 0; i < no_keys; ++i)
+		v_key_decoded[i] = v_key_output[i] || v_key_filter[i];
+}
 
-			if (v_packages[ii]->is_func)
-				v_i_buf[ii].SetFunction(v_packages[ii]->fun);
-			else
-				v_i_buf[ii].SetBuffer(v_packages[ii]->v_size, v_packages[ii]->v_data);
-			delete v_packages[ii];
-			v_packages[ii] = nullptr;
+// ************************************************************************************
+bool CCompressedFile::SetGTCountsOnly(bool _gt_counts_only)
+{
+	if (open_mode != open_mode_t::reading || decoding_started)
+		return false;
 
-			q_preparation_ids->Push(make_pair(ii, -1));
-		}
+	gt_counts_only = _gt_counts_only;
 
-		switch (keys[ii].type)
-		{
-		case BCF_HT_INT:
-			if(m_data_nodes[ii])
-				v_i_buf[ii].ReadInt(fields[ii].data, fields[ii].data_size);
-			else
-				v_i_buf[ii].FuncInt(fields[ii].data, fields[ii].data_size, fields[m_data_edges[ii]].data, fields[m_data_edges[ii]].data_size);
-			fields[ii].present = fields[ii].data != nullptr;
-			break;
-		case BCF_HT_REAL:
-			if (m_data_nodes[ii])
-				v_i_buf[ii].ReadReal(fields[ii].data, fields[ii].data_size);
-			else
-				v_i_buf[ii].FuncReal(fields[ii].data, fields[ii].data_size, fields[m_data_edges[ii]].data, fields[m_data_edges[ii]].data_size);
+	return true;
+}
 
-			fields[ii].present = fields[ii].data != nullptr;
-			break;
-		case BCF_HT_STR:
-			v_i_buf[ii].ReadText(fields[ii].data, fields[ii].data_size);
-			fields[ii].present = fields[ii].data != nullptr;
-			break;
-		case BCF_HT_FLAG:
-			uint8_t tmp;
-			v_i_buf[ii].ReadFlag(tmp);
-			fields[ii].present = (bool)tmp;
-			fields[ii].data_size = 1;
-			break;
+// ************************************************************************************
+bool CCompressedFile::SetSamplesToDecode(const vector<bool> &v_samples)
+{
+	if (open_mode != open_mode_t::reading || decoding_started)
+		return false;
+
+	for (auto& block : v_gt_blocks)
+	{
+		block->decoded = false;
+		for (uint32_t i = block->first_sample; i < block->first_sample + block->no_samples; ++i)
+			if (i < v_samples.size() && v_samples[i])
+				block->decoded = true;
+	}
+
+	return true;
+}
+
+// ************************************************************************************
+uint32_t CCompressedFile::GetNoChunks()
+{
+	return (uint32_t) v_checkpoints.size();
+}
+
+// ************************************************************************************
+// Range of chunks to decode (after region selection); false if there is nothing to decode
+bool CCompressedFile::GetChunkRange(uint32_t &_first_chunk, uint32_t &_last_chunk)
+{
+	_first_chunk = first_chunk;
+	_last_chunk = last_chunk;
+
+	return first_chunk <= last_chunk;
+}
+
+// ************************************************************************************
+// Restrict decoding to chunks [_first_chunk, _last_chunk]; can be called many times after OpenForReading
+bool CCompressedFile::SetChunkRange(uint32_t _first_chunk, uint32_t _last_chunk)
+{
+	if (open_mode != open_mode_t::reading || _first_chunk > _last_chunk || _last_chunk >= v_checkpoints.size())
+		return false;
+
+	stop_decoding();
+
+	first_chunk = _first_chunk;
+	last_chunk = _last_chunk;
+
+	set_chunk_bounds();
+
+	return true;
+}
+
+// ************************************************************************************
+bool CCompressedFile::Eof()
+{
+	if (open_mode == open_mode_t::reading)
+		return i_variant >= end_variant;
+
+	return false;
+}
+
+// ************************************************************************************
+// Describes all streams of the archive together with the coder used for them
+// Also valid after Close, so sizes of a written archive are complete
+bool CCompressedFile::GetStreamsInfo(vector<stream_desc_t> &v_desc)
+{
+	if (!archive)
+		return false;
+
+	vector<CArchive::stream_info_t> v_info;
+	archive->GetStreamsInfo(v_info);
+
+	v_desc.clear();
+
+	for (auto& info : v_info)
+	{
+		stream_desc_t desc;
+
+		desc.info = info;
+		desc.key_id = -1;
+		desc.db_id = -1;
+		desc.is_data = false;
+		desc.is_aux = false;
+		desc.coder = "meta";
+
+		for (uint32_t i = 0; i < no_keys; ++i)
+			if (v_buf_ids_size[i] == info.stream_id)
+			{
+				desc.key_id = i;
+				desc.coder = "BSC";
+			}
+			else if (v_buf_ids_data[i] == info.stream_id)
+			{
+				desc.key_id = i;
+				desc.is_data = true;
+
+				if ((int) i == gt_key_id)
+					desc.coder = "GT range coder";
+				else if ((keys[i].keys_type == key_type_t::fmt && keys[i].type != BCF_HT_STR) ||
+					(keys[i].keys_type == key_type_t::info && (keys[i].type == BCF_HT_INT || keys[i].type == BCF_HT_REAL)))
+					desc.coder = "CFormatCompress";
+				else if (keys[i].type == BCF_HT_STR)
+					desc.coder = "BSC + text pp";
+				else
+					desc.coder = "BSC";
+			}
+
+		for (size_t i = 1; i < v_gt_blocks.size(); ++i)
+			if (v_gt_blocks[i]->stream_id == info.stream_id)
+			{
+				desc.key_id = gt_key_id;
+				desc.is_aux = true;
+				desc.coder = "GT range coder";
+			}
+
+		if (gt_summary_stream_id >= 0 && gt_summary_stream_id == info.stream_id)
+		{
+			desc.key_id = gt_key_id;
+			desc.is_aux = true;
+			desc.coder = "BSC (GT summary)";
+		}
+
+		for (uint32_t i = 0; i < no_db_fields; ++i)
+			if (v_db_ids_size[i] == info.stream_id || v_db_ids_data[i] == info.stream_id)
+			{
+				desc.db_id = i;
+				desc.is_data = v_db_ids_data[i] == info.stream_id;
+				desc.coder = "BSC";
+			}
+
+		if (info.no_linked_parts && info.linked_size == info.packed_size)
+			desc.coder = "linked";
+
+		v_desc.emplace_back(desc);
+	}
+
+	return true;
+}
+
+// ************************************************************************************
+// Coding times are valid after Close (writing) or after all variants (of interest) are read
+bool CCompressedFile::GetCodingTimes(vector<double> &_v_key_times, vector<double> &_v_db_times)
+{
+	lock_guard<mutex> lck(m_packages);
+
+	_v_key_times = v_key_coding_time;
+	_v_db_times = v_db_coding_time;
+
+	return true;
+}
+
+// ************************************************************************************
+// Complete after Close
+bool CCompressedFile::GetWorkStats(work_stats_t &stats)
+{
+	{
+		lock_guard<mutex> lck(m_packages);
+
+		stats.v_thread_busy_time = v_coder_busy_time;
+		stats.queue_wait_time = coder_queue_wait_time;
+	}
+
+	lock_guard<mutex> lck(mtx_v_coder);
+	stats.lock_wait_time = coder_lock_wait_time;
+
+	return true;
+}
+
+// ************************************************************************************
+bool CCompressedFile::GetVariant(variant_desc_t &desc, vector<field_desc> &fields, CArena *arena)
+{
+	while (decode_variant(desc, fields, arena))
+	{
+		bool keep = (region_chrom.empty() || (desc.chrom == region_chrom && desc.pos >= region_from && desc.pos <= region_to)) &&
+			site_filter.Match(desc, [&](int key_no) -> const field_desc& {return fields[key_no]; });
+
+		// Variant outside the requested region or not matching the filter (and keys decoded for the filter only)
+		for (uint32_t i = 0; i < no_keys; ++i)
+		{
+			auto &f = fields[i];
+
+			if (keep && (v_key_output[i] || !v_key_filter[i]))
+				continue;
+			if (f.data && !arena)
+				delete[] f.data;
+			f = field_desc();
 		}
+
+		if (keep)
+			return true;
+	}
+
+	return false;
+}
+
+// ************************************************************************************
+bool CCompressedFile::decode_variant(variant_desc_t &desc, vector<field_desc> &fields, CArena *arena)
+{
+	if (!decode_desc(desc))
+		return false;
+
+    // Load and set fields
+    for(uint32_t i = 0; i < no_keys; i++)
+    {
+		int ii = v_data_nodes[i].first;		// Change of column ordering
+
+		if (v_key_decoded[ii])
+			decode_field(ii, fields[ii], m_data_nodes[ii] ? nullptr : &fields[m_data_edges[ii]], arena);
     }
-    
+
+	return true;
+}
+
+// ************************************************************************************
+bool CCompressedFile::decode_desc(variant_desc_t &desc)
+{
+	desc.chrom.clear();
+
+	if (!decoding_started)
+		start_decoding();
+
+	if (i_variant >= end_variant)
+		return false;
+
+	// Positions are delta coded within a chunk only
+	if (cur_checkpoint + 1 < v_checkpoints.size() && i_variant == v_checkpoints[cur_checkpoint + 1].first_variant)
+	{
+		++cur_checkpoint;
+		prev_pos = 0;
+	}
+
+	int64_t pos;
+
+	for (uint32_t i = 0; i < no_db_fields; ++i)
+	{
+		if (v_i_db_buf[i].IsEmpty())
+		{
+			unique_lock<mutex> lck(m_packages);
+
+			cv_packages.wait(lck, [&, this] {return v_db_packages[i] != nullptr; });
+
+			v_i_db_buf[i].SetBuffer(v_db_packages[i]->v_size, v_db_packages[i]->v_data);
+			delete v_db_packages[i];
+			v_db_packages[i] = nullptr;
+
+			q_preparation_ids->Push(make_pair(-1, i));
+		}
+	}
+
+	v_i_db_buf[id_db_chrom].ReadText(desc.chrom);
+	v_i_db_buf[id_db_id].ReadText(desc.id);
+	v_i_db_buf[id_db_ref].ReadText(desc.ref);
+	v_i_db_buf[id_db_alt].ReadText(desc.alt);
+	v_i_db_buf[id_db_qual].ReadText(desc.qual);
+
+	v_i_db_buf[id_db_pos].ReadInt64(pos);
+	pos += prev_pos;
+	prev_pos = pos;
+	desc.pos = pos;
+
 	++i_variant;
 
 	return true;
 }
 
 // ************************************************************************************
-bool CCompressedFile::SetVariant(variant_desc_t &desc, vector<field_desc> &fields)
+void CCompressedFile::prepare_key_buffer(int ii)
 {
-    // Store variant description
-	v_o_db_buf[id_db_chrom].WriteText((char*) desc.chrom.c_str(), (uint32_t) desc.chrom.size());
-	v_o_db_buf[id_db_pos].WriteInt64(desc.pos - prev_pos);
-	v_o_db_buf[id_db_id].WriteText((char*) desc.id.c_str(), (uint32_t) desc.id.size());
-	v_o_db_buf[id_db_ref].WriteText((char*) desc.ref.c_str(), (uint32_t) desc.ref.size());
-	v_o_db_buf[id_db_alt].WriteText((char*) desc.alt.c_str(), (uint32_t) desc.alt.size());
-	v_o_db_buf[id_db_qual].WriteText((char*) desc.qual.c_str(), (uint32_t) desc.qual.size());
+	if (!v_i_buf[ii].IsEmpty())
+		return;
 
-	for(uint32_t i = 0; i < no_db_fields; ++i)
-		if (v_o_db_buf[i].IsFull())
+	unique_lock<mutex> lck(m_packages);
+
+	cv_packages.wait(lck, [&, this] {return v_packages[ii] != nullptr; });
+
+	if (v_packages[ii]->is_func)
+		v_i_buf[ii].SetFunction(v_packages[ii]->fun);
+	else
+		v_i_buf[ii].SetBuffer(v_packages[ii]->v_size, v_packages[ii]->v_data);
+	delete v_packages[ii];
+	v_packages[ii] = nullptr;
+
+	q_preparation_ids->Push(make_pair(ii, -1));
+}
+
+// ************************************************************************************
+// src_field - field the data are a function of (for keys that are not data nodes)
+void CCompressedFile::decode_field(int ii, field_desc &field, field_desc *src_field, CArena *arena)
+{
+	prepare_key_buffer(ii);
+
+	switch (keys[ii].type)
+	{
+	case BCF_HT_INT:
+		if (!src_field)
+			v_i_buf[ii].ReadInt(field.data, field.data_size, arena);
+		else
+			v_i_buf[ii].FuncInt(field.data, field.data_size, src_field->data, src_field->data_size, arena);
+		field.present = field.data != nullptr;
+		break;
+	case BCF_HT_REAL:
+		if (!src_field)
+			v_i_buf[ii].ReadReal(field.data, field.data_size, arena);
+		else
+			v_i_buf[ii].FuncReal(field.data, field.data_size, src_field->data, src_field->data_size, arena);
+		field.present = field.data != nullptr;
+		break;
+	case BCF_HT_STR:
+		v_i_buf[ii].ReadText(field.data, field.data_size, arena);
+		field.present = field.data != nullptr;
+		break;
+	case BCF_HT_FLAG:
+		uint8_t tmp;
+		v_i_buf[ii].ReadFlag(tmp);
+		field.present = (bool)tmp;
+		field.data_size = 1;
+		break;
+	}
+}
+
+// ************************************************************************************
+void CCompressedFile::skip_field(int ii)
+{
+	// Function of other key, nothing stored
+	if (!m_data_nodes[ii])
+		return;
+
+	prepare_key_buffer(ii);
+
+	switch (keys[ii].type)
+	{
+	case BCF_HT_INT:
+	case BCF_HT_REAL:
+		v_i_buf[ii].Skip(4);
+		break;
+	case BCF_HT_STR:
+		v_i_buf[ii].Skip(1);
+		break;
+	case BCF_HT_FLAG:
+		v_i_buf[ii].Skip(0);
+		break;
+	}
+}
+
+// ************************************************************************************
+bool CCompressedFile::GetVariants(variant_columns_t &columns, size_t max_variants, CArena *arena, const vector<bool> *v_keys)
+{
+	if (columns.v_desc.size() < max_variants)
+		columns.v_desc.resize(max_variants);
+	columns.v_columns.resize(no_keys);
+
+	// Keys the requested keys are functions of must be decoded too
+	vector<bool> v_decode = v_key_output;
+	if (v_keys)
+	{
+		for (uint32_t i = 0; i < no_keys; ++i)
+			v_decode[i] = v_decode[i] && i < v_keys->size() && (*v_keys)[i];
+		for (uint32_t i = 0; i < no_keys; ++i)
+			if (v_decode[i] && !m_data_nodes[i])
+				v_decode[m_data_edges[i]] = true;
+	}
+
+	// Batches with no variant in the requested region are skipped
+	do
+	{
+		columns.no_variants = 0;
+
+		// Descriptions of all variants are decoded first, so each key is then decoded in one pass
+		while (columns.no_variants < max_variants && decode_desc(columns.v_desc[columns.no_variants]))
+			++columns.no_variants;
+
+		if (!columns.no_variants)
+			return false;
+
+		decode_columns(columns, v_decode, arena);
+	} while (!columns.no_variants);
+
+	return true;
+}
+
+// ************************************************************************************
+void CCompressedFile::decode_columns(variant_columns_t &columns, vector<bool> &v_decode, CArena *arena)
+{
+	bool filtered = !region_chrom.empty() || !site_filter.IsEmpty();
+	vector<bool> v_keep(columns.no_variants, true);
+
+	// Keys of the filter are decoded in the 1st pass, other keys (in the 2nd pass) only for variants in the region and matching the filter
+	for (int pass = filtered ? 0 : 1; pass < 2; ++pass)
+	{
+		for (uint32_t i = 0; i < no_keys; ++i)
 		{
-			auto part_id = archive->AddPartPrepare(v_db_ids_size[i]);
-			archive->AddPartPrepare(v_db_ids_data[i]);
+			int ii = v_data_nodes[i].first;		// Change of column ordering
+			auto &column = columns.v_columns[ii];
+
+			if (filtered && v_key_filter[ii] != (pass == 0))
+				continue;
 
-			vector<uint32_t> v_size;
-			vector<uint8_t> v_data;
-			vector<uint8_t> v_aux;
+			column.assign(columns.no_variants, field_desc());
+
+			if (!v_decode[ii] && !v_key_filter[ii])
+			{
+				if (v_key_decoded[ii])
+					for (size_t j = 0; j < columns.no_variants; ++j)
+						skip_field(ii);
+				continue;
+			}
 
-			v_o_db_buf[i].GetBuffer(v_size, v_data);
+			auto src_column = m_data_nodes[ii] ? nullptr : columns.v_columns[m_data_edges[ii]].data();
 
-			SPackage pck(SPackage::package_t::db, -1, i, v_db_ids_size[i], v_db_ids_data[i], part_id, v_size, v_data, v_aux);
+			for (size_t j = 0; j < columns.no_variants; ++j)
+				if (v_keep[j])
+					decode_field(ii, column[j], src_column ? src_column + j : nullptr, arena);
+				else
+					skip_field(ii);
+		}
 
+		if (pass == 0)
+			for (size_t j = 0; j < columns.no_variants; ++j)
 			{
-				unique_lock<mutex> lck(m_packages);
+				auto &desc = columns.v_desc[j];
 
-				cv_packages.wait(lck, [&, this] {return v_cnt_db_packages[i] < max_cnt_packages; });
-				++v_cnt_db_packages[i];
+				v_keep[j] = (region_chrom.empty() || (desc.chrom == region_chrom && desc.pos >= region_from && desc.pos <= region_to)) &&
+					site_filter.Match(desc, [&](int key_no) -> const field_desc& {return columns.v_columns[key_no][j]; });
 			}
+	}
+
+	if (!filtered)
+		return;
+
+	// Variants not kept are removed, as well as fields of keys decoded for the filter only
+	size_t no_kept = 0;
 
-			q_packages->Emplace(pck);
+	for (size_t j = 0; j < columns.no_variants; ++j)
+	{
+		for (uint32_t i = 0; i < no_keys; ++i)
+		{
+			auto &field = columns.v_columns[i][j];
+			bool keep_field = v_keep[j] && (v_decode[i] || !v_key_filter[i]);
+
+			if (!keep_field && !arena && field.data)
+				delete[] field.data;
+			if (v_keep[j])
+				columns.v_columns[i][no_kept] = keep_field ? field : field_desc();
 		}
 
+		if (v_keep[j])
+		{
+			if (no_kept != j)
+				swap(columns.v_desc[no_kept], columns.v_desc[j]);
+			++no_kept;
+		}
+	}
+
+	columns.no_variants = no_kept;
+
+	for (auto &column : columns.v_columns)
+		column.resize(no_kept);
+}
+
+// ************************************************************************************
+bool CCompressedFile::SetVariant(variant_desc_t &desc, vector<field_desc> &fields)
+{
+	if (checkpoint_interval && no_variants && no_variants % checkpoint_interval == 0)
+		add_checkpoint();
+
+	auto &v_ranges = v_checkpoints.back().v_ranges;
+
+	if (v_ranges.empty() || get<0>(v_ranges.back()) != desc.chrom)
+		v_ranges.emplace_back(desc.chrom, desc.pos, desc.pos);
+	else
+	{
+		get<1>(v_ranges.back()) = min(get<1>(v_ranges.back()), desc.pos);
+		get<2>(v_ranges.back()) = max(get<2>(v_ranges.back()), desc.pos);
+	}
+
+    // Store variant description
+	v_o_db_buf[id_db_chrom].WriteText((char*) desc.chrom.c_str(), (uint32_t) desc.chrom.size());
+	v_o_db_buf[id_db_pos].WriteInt64(desc.pos - prev_pos);
+	v_o_db_buf[id_db_id].WriteText((char*) desc.id.c_str(), (uint32_t) desc.id.size());
+	v_o_db_buf[id_db_ref].WriteText((char*) desc.ref.c_str(), (uint32_t) desc.ref.size());
+	v_o_db_buf[id_db_alt].WriteText((char*) desc.alt.c_str(), (uint32_t) desc.alt.size());
+	v_o_db_buf[id_db_qual].WriteText((char*) desc.qual.c_str(), (uint32_t) desc.qual.size());
+
+	for(uint32_t i = 0; i < no_db_fields; ++i)
+		if (v_o_db_buf[i].IsFull())
+			flush_db_buffer(i);
+
 	prev_pos = desc.pos;
 
     for(uint32_t i = 0; i < no_keys; i++)
@@ -889,47 +1583,207 @@ bool CCompressedFile::SetVariant(variant_desc_t &desc, vector<field_desc> &field
 		}
 
 		if (v_o_buf[i].IsFull())
-		{
-			auto part_id = archive->AddPartPrepare(v_buf_ids_size[i]);
-			archive->AddPartPrepare(v_buf_ids_data[i]);
+			flush_key_buffer(i);
+    }
 
-			vector<uint32_t> v_size;
-			vector<uint8_t> v_data;
-			vector<uint8_t> v_aux;
-			
-			v_o_buf[i].GetBuffer(v_size, v_data);
+	++no_variants;
 
-			SPackage pck((int) i != gt_key_id ? SPackage::package_t::fields : SPackage::package_t::gt, i, -1, v_buf_ids_size[i], v_buf_ids_data[i], part_id, v_size, v_data, v_aux);
+	return true;
+}
 
-			{
-				unique_lock<mutex> lck(m_packages);
+// ************************************************************************************
+void CCompressedFile::flush_key_buffer(uint32_t key_id)
+{
+	auto part_id = archive->AddPartPrepare(v_buf_ids_size[key_id]);
+	archive->AddPartPrepare(v_buf_ids_data[key_id]);
 
-				cv_packages.wait(lck, [&, this] {return v_cnt_packages[i] < max_cnt_packages; });
-				++v_cnt_packages[i];
-			}
+	if ((int) key_id == gt_key_id)
+	{
+		for (size_t i = 1; i < v_gt_blocks.size(); ++i)
+			archive->AddPartPrepare(v_gt_blocks[i]->stream_id);
 
-			q_packages->Emplace(pck);
-		}
-    }
+		if (gt_summary_stream_id >= 0)
+			archive->AddPartPrepare(gt_summary_stream_id);
+	}
 
-	++no_variants;
+	vector<uint32_t> v_size;
+	vector<uint8_t> v_data;
+	vector<uint8_t> v_aux;
 
-	return true;
+	v_o_buf[key_id].GetBuffer(v_size, v_data);
+	v_raw_size_size[key_id] += v_size.size() * 4;
+	v_raw_size_data[key_id] += v_data.size();
+
+	SPackage pck((int) key_id != gt_key_id ? SPackage::package_t::fields : SPackage::package_t::gt, key_id, -1, v_buf_ids_size[key_id], v_buf_ids_data[key_id], part_id, v_size, v_data, v_aux);
+	pck.is_chunk_start = v_chunk_start[key_id];
+
+	v_chunk_start[key_id] = false;
+	++v_no_parts[key_id];
+
+	{
+		unique_lock<mutex> lck(m_packages);
+
+		cv_packages.wait(lck, [&, this] {return v_cnt_packages[key_id] < max_cnt_packages; });
+		++v_cnt_packages[key_id];
+
+		wait_for_packages_memory(lck, pck.v_size.size() * 4 + pck.v_data.size());
+	}
+
+	q_packages->Emplace(pck);
 }
 
 // ************************************************************************************
-bool CCompressedFile::InitPBWT()
+// Backpressure: SetVariant waits while packages use the memory budget (m_packages must be locked)
+void CCompressedFile::wait_for_packages_memory(unique_lock<mutex> &lck, size_t pck_memory)
 {
-	if (open_mode == open_mode_t::reading)
+	if (!max_memory)
+		return;
+
+	// A single package is always let through, so large parts cannot block the compression
+	cv_packages.wait(lck, [&, this] {return packages_memory == 0 || packages_memory + pck_memory <= max_memory / 2; });
+	packages_memory += pck_memory;
+}
+
+// ************************************************************************************
+void CCompressedFile::flush_db_buffer(uint32_t db_id)
+{
+	auto part_id = archive->AddPartPrepare(v_db_ids_size[db_id]);
+	archive->AddPartPrepare(v_db_ids_data[db_id]);
+
+	vector<uint32_t> v_size;
+	vector<uint8_t> v_data;
+	vector<uint8_t> v_aux;
+
+	v_o_db_buf[db_id].GetBuffer(v_size, v_data);
+	v_raw_size_size[no_keys + db_id] += v_size.size() * 4;
+	v_raw_size_data[no_keys + db_id] += v_data.size();
+
+	SPackage pck(SPackage::package_t::db, -1, db_id, v_db_ids_size[db_id], v_db_ids_data[db_id], part_id, v_size, v_data, v_aux);
+	pck.is_chunk_start = v_chunk_start[no_keys + db_id];
+
+	v_chunk_start[no_keys + db_id] = false;
+	++v_no_parts[no_keys + db_id];
+
 	{
-		pbwt.StartReverse(no_samples * ploidy, neglect_limit);
+		unique_lock<mutex> lck(m_packages);
+
+		cv_packages.wait(lck, [&, this] {return v_cnt_db_packages[db_id] < max_cnt_packages; });
+		++v_cnt_db_packages[db_id];
+
+		wait_for_packages_memory(lck, pck.v_size.size() * 4 + pck.v_data.size());
 	}
-	else if(open_mode == open_mode_t::writing)
+
+	q_packages->Emplace(pck);
+}
+
+// ************************************************************************************
+// Flush all buffers and start a new chunk, so that none of the adaptive models is shared between chunks
+void CCompressedFile::add_checkpoint()
+{
+	for (uint32_t i = 0; i < no_db_fields; ++i)
+		if (v_o_db_buf[i].GetNoItems())
+			flush_db_buffer(i);
+
+	for (uint32_t i = 0; i < no_keys; ++i)
+		if (v_o_buf[i].GetNoItems())
+			flush_key_buffer(i);
+
+	v_checkpoints.emplace_back(checkpoint_t{no_variants, v_no_parts, {}});
+
+	fill(v_chunk_start.begin(), v_chunk_start.end(), true);
+	prev_pos = 0;
+}
+
+// ************************************************************************************
+bool CCompressedFile::is_chunk_start(uint32_t sid, uint32_t part_id)
+{
+	auto p = lower_bound(v_checkpoints.begin(), v_checkpoints.end(), part_id, [sid](const checkpoint_t &cp, uint32_t id) {
+		return cp.v_part_ids[sid] < id; 
+		});
+
+	return p != v_checkpoints.end() && p->v_part_ids[sid] == part_id;
+}
+
+// ************************************************************************************
+void CCompressedFile::reset_format_compress(int key_id)
+{
+	if (!v_format_compress[key_id])
+		return;
+
+	delete v_format_compress[key_id];
+
+	v_format_compress[key_id] = new CFormatCompress("key " + to_string(key_id), vcs_compression_level);
+	v_format_compress[key_id]->SetNoSamples(no_samples);
+}
+
+// ************************************************************************************
+void CCompressedFile::reset_gt_coders()
+{
+	InitPBWT();
+
+	for (auto& block : v_gt_blocks)
+		block->ResetCoders();
+}
+
+// ************************************************************************************
+// GT blocks are set when no. of samples and the GT stream are known
+void CCompressedFile::set_gt_blocks()
+{
+	v_gt_blocks.clear();
+	gt_summary_stream_id = -1;
+
+	if (gt_key_id < 0 || gt_key_id >= (int) no_keys)
+		return;
+
+	uint32_t block_size = (gt_block_size && gt_block_size < no_samples) ? gt_block_size : no_samples;
+
+	// The first block is stored in the stream of GT key, so a single block is the original format
+	for (uint32_t i = 0; ; i += block_size)
 	{
-		pbwt.StartForward(no_samples * ploidy, neglect_limit);
-		pbwt_initialised = true;
+		string stream_name = "key_" + to_string(gt_key_id) + "_data";
+		int stream_id;
+
+		if (i)
+			stream_name += "_b" + to_string(v_gt_blocks.size());
+
+		if (open_mode == open_mode_t::writing)
+			stream_id = i ? archive->RegisterStream(stream_name) : v_buf_ids_data[gt_key_id];
+		else
+			stream_id = archive->GetStreamId(stream_name);
+
+		v_gt_blocks.emplace_back(new gt_block_t(i, min(block_size, no_samples - i), stream_id));
+
+		if (i + block_size >= no_samples)
+			break;
 	}
 
+	if (v_gt_blocks.size() == 1)
+		gt_block_size = 0;
+
+	if (open_mode == open_mode_t::writing)
+	{
+		if (gt_summary)
+			gt_summary_stream_id = archive->RegisterStream("gt_summary");
+		gt_summary_raw_size = 0;
+	}
+	else
+	{
+		gt_summary_stream_id = archive->GetStreamId("gt_summary");
+		gt_summary = gt_summary_stream_id >= 0;
+	}
+}
+
+// ************************************************************************************
+bool CCompressedFile::InitPBWT()
+{
+	for (auto& block : v_gt_blocks)
+		if (open_mode == open_mode_t::reading)
+			block->pbwt.StartReverse(block->no_samples * ploidy, neglect_limit);
+		else if (open_mode == open_mode_t::writing)
+			block->pbwt.StartForward(block->no_samples * ploidy, neglect_limit);
+
+	pbwt_initialised = open_mode == open_mode_t::writing;
+
 	return pbwt_initialised;
 }
 
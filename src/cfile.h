@@ -15,6 +15,10 @@
 #include <queue>
 #include <condition_variable>
 #include <utility>
+#include <tuple>
+#include <memory>
+#include <functional>
+#include <atomic>
 
 #include "defs.h"
 #include "bsc.h"
@@ -31,19 +35,29 @@
 #include "queue.h"
 #include "text_pp.h"
 #include "format.h"
-#include "graph_opt.h"
+#include "filter.h"
 
 using namespace std;
 
 // ************************************************************************************
 class CCompressedFile
 {
-	CVectorIOStream *vios_i;
-	CVectorIOStream *vios_o;
+public:
+	// Batch of variants: descriptions and, for each key, fields of the consecutive variants
+	struct variant_columns_t {
+		size_t no_variants = 0;
+		vector<variant_desc_t> v_desc;
+		vector<vector<field_desc>> v_columns;		// [key][variant]
+	};
 
-	vector<uint8_t> v_vios_i;
-	vector<uint8_t> v_vios_o;
+	// Work of coder threads [s]
+	struct work_stats_t {
+		vector<double> v_thread_busy_time;
+		double queue_wait_time = 0;
+		double lock_wait_time = 0;
+	};
 
+private:
 	vector<CBuffer> v_o_buf;
 	vector<CBuffer> v_i_buf;
 	vector<int> v_buf_ids_size;
@@ -101,10 +115,15 @@ class CCompressedFile
 		vector<uint32_t> v_size;
 		vector<uint8_t> v_data;
 		vector<uint8_t> v_compressed;
+		const uint8_t* p_compressed;		// view into the archive (decompression only)
+		size_t compressed_size;
+		size_t part_offset;					// identifies the stored copy of the last read part
+		uint32_t part_refs;					// no. of part entries sharing the stored copy
 
 		function_data_item_t fun;
 		int stream_id_src;
 		bool is_func;
+		bool is_chunk_start;
 
 		SPackage()
 		{
@@ -116,6 +135,11 @@ class CCompressedFile
 			part_id = -1;
 			stream_id_src = -1;
 			is_func = false;
+			is_chunk_start = false;
+			p_compressed = nullptr;
+			compressed_size = 0;
+			part_offset = 0;
+			part_refs = 1;
 		}
 
 		SPackage(SPackage::package_t _type, int _key_id, int _db_id, uint32_t _stream_id_size, uint32_t _stream_id_data, int _part_id, vector<uint32_t>& _v_size, vector<uint8_t>& _v_data, vector<uint8_t>& _v_compressed)
@@ -131,6 +155,11 @@ class CCompressedFile
 			v_data = move(_v_data);
 			v_compressed = move(_v_compressed);
 			is_func = false;
+			is_chunk_start = false;
+			p_compressed = nullptr;
+			compressed_size = 0;
+			part_offset = 0;
+			part_refs = 1;
 
 			_v_size.clear();
 			_v_data.clear();
@@ -147,13 +176,17 @@ class CCompressedFile
 			stream_id_src = _stream_id_src;
 			part_id = _part_id;
 			is_func = true;
+			is_chunk_start = false;
+			p_compressed = nullptr;
+			compressed_size = 0;
+			part_offset = 0;
+			part_refs = 1;
 
 			fun = move(_fun);
 		}
 	};
 
 	CArchive *archive;
-	CArchive *tmp_archive;
 	string archive_name;
 
 	CRegisteringQueue<SPackage>* q_packages;
@@ -166,16 +199,40 @@ class CCompressedFile
 	mutex m_packages;
 	condition_variable cv_packages;
 
-	//const uint32_t max_buffer_size = 16 << 20;
-	const uint32_t max_buffer_size = 8 << 20;
+	// Compression: memory budget (0 - none) for buffers and packages waiting for (or under) compression
+	size_t max_memory;
+	size_t packages_memory;
+
+	// Decompression: parts stored once for many part entries (deduplicated) are decoded once
+	// and the decoded copy is kept until all entries consume it
+	struct shared_part_t {
+		shared_ptr<vector<uint8_t>> data;
+		uint32_t no_pending;
+	};
+
+	unordered_map<size_t, shared_part_t> m_shared_parts;
+	size_t shared_parts_size;
+	mutex mtx_shared_parts;
+	const size_t max_shared_parts_size = 64 << 20;
+
+	// Part sizes are set in OpenForWriting from no. of keys and samples
+	uint32_t max_buffer_size;
 	const uint32_t var_buffer_size = 1 << 20;		// Variability of buffer sizes
 
-	const uint32_t max_buffer_gt_size = 256 << 20;
+	uint32_t max_buffer_gt_size;
 	const uint32_t max_buffer_db_size = 8 << 20;
 /*	const uint32_t max_buffer_size = 2 << 20;
 	const uint32_t max_buffer_gt_size = 256 << 20;
 	const uint32_t max_buffer_db_size = 2 << 20;*/
 
+	const size_t key_buffers_memory = 256 << 20;		// Target memory of buffers of all keys (except GT)
+	const uint32_t min_buffer_size = 1 << 20;
+	const uint32_t min_budget_buffer_size = 64 << 10;		// if memory budget is set
+	const uint32_t max_buffer_size_limit = 32 << 20;
+	const uint32_t gt_part_variants = 1 << 16;		// Target no. of variants in a GT part
+	const uint32_t min_buffer_gt_size = 16 << 20;
+	const uint32_t max_buffer_gt_size_limit = 256 << 20;
+
 	const size_t pp_compress_flag = 1u << 30;
 	const int max_cnt_packages = 4;
 
@@ -198,10 +255,6 @@ class CCompressedFile
 	const uint32_t p_bsc_features = 1u;
 //	const uint32_t p_bsc_features = 0u;
 
-	CRangeEncoder<CVectorIOStream> *rce;
-	CRangeDecoder<CVectorIOStream> *rcd;
-
-    CPBWT pbwt;
 	bool pbwt_initialised;
 	uint32_t no_coder_threads;
 
@@ -238,19 +291,44 @@ class CCompressedFile
     
 	int64_t prev_pos;
 
-	const context_t context_symbol_flag = 1ull << 60;
-	const context_t context_symbol_mask = 0xffff;
+	// Checkpoints split the variants into chunks decodable independently of each other
+	struct checkpoint_t {
+		uint32_t first_variant;
+		vector<uint32_t> v_part_ids;						// first part of the chunk in each key and db stream
+		vector<tuple<string, int64_t, int64_t>> v_ranges;	// chrom, min pos, max pos
+	};
+
+	uint32_t checkpoint_interval;
+	bool direct_io;
+	vector<checkpoint_t> v_checkpoints;
+	vector<uint32_t> v_no_parts;
+	vector<size_t> v_raw_size_size;		// no. of bytes passed to size streams of keys and db fields
+	vector<size_t> v_raw_size_data;
+	vector<uint32_t> v_end_parts;
+	vector<bool> v_chunk_start;
+	uint32_t cur_checkpoint;
+	uint32_t end_variant;
+	uint32_t first_chunk;
+	uint32_t last_chunk;
+	bool decoding_started;
+
+	string region_chrom;
+	int64_t region_from;
+	int64_t region_to;
+
+	vector<bool> v_key_decoded;		// streams of other keys are not read at all
+	vector<bool> v_key_output;		// keys requested by SetKeysToDecode (and keys they are functions of)
+	vector<bool> v_key_filter;		// keys of the site filter (and keys they are functions of)
+
+	CSiteFilter site_filter;
+
+	// Time spent by coder threads on (de)compression of parts of each key and db field [s]
+	vector<double> v_key_coding_time;
+	vector<double> v_db_coding_time;
+	vector<double> v_coder_busy_time;
+	double coder_queue_wait_time;		// coder threads waiting for packages (parts to decode)
+	double coder_lock_wait_time;		// coder threads waiting for earlier parts of the same stream
 
-	const context_t context_prefix_mask = 0xfffff;
-	const context_t context_prefix_flag = 2ull << 60;
-	const context_t context_suffix_flag = 3ull << 60;
-	const context_t context_large_value1_flag = 4ull << 60;
-	const context_t context_large_value2_flag = 5ull << 60;
-	const context_t context_large_value3_flag = 6ull << 60;
-	
-	context_t ctx_prefix;
-	context_t ctx_symbol;
-	
 	using ModelType_11_10_1 = CSimpleModel<11, 10, 1>;
 	using ModelType_16_15_1 = CSimpleModel<16, 15, 1>;
 	using ModelType_256_15_1 = CAdjustableModel<256, 15, 1>;
@@ -288,114 +366,174 @@ class CCompressedFile
 	using ctx_map_256_11_e_t = CContextHM<CRangeCoderModel<ModelType_256_1_1, CVectorIOStream, 256, 11, 1>>;
 	using ctx_map_256_11_d_t = CContextHM<CRangeCoderModel<ModelType_256_1_1, CVectorIOStream, 256, 11, 1>>;
 
-	ctx_map_11_10_e_t rce_coders_rl_pref;
-	ctx_map_11_10_d_t rcd_coders_rl_pref;
-	ctx_map_16_15_e_t rce_coders_rl_sym;
-	ctx_map_16_15_d_t rcd_coders_rl_sym;
-	ctx_map_256_15_e_t rce_coders_large_val;
-	ctx_map_256_15_d_t rcd_coders_large_val;
-
-	ctx_map_2_11_e_t rce_coders_rl_suf2;
-	ctx_map_2_11_d_t rcd_coders_rl_suf2;
-	ctx_map_4_11_e_t rce_coders_rl_suf4;
-	ctx_map_4_11_d_t rcd_coders_rl_suf4;
-	ctx_map_8_11_e_t rce_coders_rl_suf8;
-	ctx_map_8_11_d_t rcd_coders_rl_suf8;
-	ctx_map_16_11_e_t rce_coders_rl_suf16;
-	ctx_map_16_11_d_t rcd_coders_rl_suf16;
-	ctx_map_32_11_e_t rce_coders_rl_suf32;
-	ctx_map_32_11_d_t rcd_coders_rl_suf32;
-	ctx_map_64_11_e_t rce_coders_rl_suf64;
-	ctx_map_64_11_d_t rcd_coders_rl_suf64;
-	ctx_map_128_11_e_t rce_coders_rl_suf128;
-	ctx_map_128_11_d_t rcd_coders_rl_suf128;
-	ctx_map_256_11_e_t rce_coders_rl_suf256;
-	ctx_map_256_11_d_t rcd_coders_rl_suf256;
-
-	function_data_graph_t function_data_graph;
-	function_size_graph_t function_size_graph;
+	// GT coding state of a block of samples. Haplotypes of each block are coded by own PBWT and range coder
+	// into own stream, so blocks are (de)compressed in parallel and decoded only if any of their samples is needed.
+	struct gt_block_t {
+		uint32_t first_sample;
+		uint32_t no_samples;
+		int stream_id;
+		bool decoded;
+		size_t raw_size;			// compression: raw size of genotypes of the block (as in GT key data)
+
+		CPBWT pbwt;
+
+		vector<uint8_t> v_vios_i;
+		vector<uint8_t> v_vios_o;
+		CVectorIOStream vios_i;
+		CVectorIOStream vios_o;
+
+		CRangeEncoder<CVectorIOStream> rce;
+		CRangeDecoder<CVectorIOStream> rcd;
+
+		const context_t context_symbol_flag = 1ull << 60;
+		const context_t context_symbol_mask = 0xffff;
+
+		const context_t context_prefix_mask = 0xfffff;
+		const context_t context_prefix_flag = 2ull << 60;
+		const context_t context_suffix_flag = 3ull << 60;
+		const context_t context_large_value1_flag = 4ull << 60;
+		const context_t context_large_value2_flag = 5ull << 60;
+		const context_t context_large_value3_flag = 6ull << 60;
+
+		context_t ctx_prefix;
+		context_t ctx_symbol;
+
+		ctx_map_11_10_e_t rce_coders_rl_pref;
+		ctx_map_11_10_d_t rcd_coders_rl_pref;
+		ctx_map_16_15_e_t rce_coders_rl_sym;
+		ctx_map_16_15_d_t rcd_coders_rl_sym;
+		ctx_map_256_15_e_t rce_coders_large_val;
+		ctx_map_256_15_d_t rcd_coders_large_val;
+
+		ctx_map_2_11_e_t rce_coders_rl_suf2;
+		ctx_map_2_11_d_t rcd_coders_rl_suf2;
+		ctx_map_4_11_e_t rce_coders_rl_suf4;
+		ctx_map_4_11_d_t rcd_coders_rl_suf4;
+		ctx_map_8_11_e_t rce_coders_rl_suf8;
+		ctx_map_8_11_d_t rcd_coders_rl_suf8;
+		ctx_map_16_11_e_t rce_coders_rl_suf16;
+		ctx_map_16_11_d_t rcd_coders_rl_suf16;
+		ctx_map_32_11_e_t rce_coders_rl_suf32;
+		ctx_map_32_11_d_t rcd_coders_rl_suf32;
+		ctx_map_64_11_e_t rce_coders_rl_suf64;
+		ctx_map_64_11_d_t rcd_coders_rl_suf64;
+		ctx_map_128_11_e_t rce_coders_rl_suf128;
+		ctx_map_128_11_d_t rcd_coders_rl_suf128;
+		ctx_map_256_11_e_t rce_coders_rl_suf256;
+		ctx_map_256_11_d_t rcd_coders_rl_suf256;
+
+		template<unsigned NO_SYMBOLS, unsigned MAX_LOG_COUNTER, unsigned ADDER>
+		CRangeCoderModel<CSimpleModel<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>*
+			find_rce_coder(CContextHM<CRangeCoderModel<CSimpleModel<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>> &map, context_t ctx)
+		{
+			auto p = map.find(ctx);
 
-	vector<pair<int, bool>> v_size_nodes;
-	vector<pair<int, int>> v_size_edges;
-	vector<pair<int, bool>> v_data_nodes;
-	vector<pair<int, int>> v_data_edges;
-	vector<bool> m_data_nodes;
-	vector<int> m_data_edges;
+			if (p == nullptr)
+				map.insert(ctx, p = new CRangeCoderModel<CSimpleModel<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>(&rce, nullptr, true));
 
-	template<unsigned NO_SYMBOLS, unsigned MAX_LOG_COUNTER, unsigned ADDER>
-	CRangeCoderModel<CSimpleModel<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>*
-		find_rce_coder(CContextHM<CRangeCoderModel<CSimpleModel<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>> &map, context_t ctx)
-	{
-		auto p = map.find(ctx);
+			return p;
+		}
 
-		if (p == nullptr)
-			map.insert(ctx, p = new CRangeCoderModel<CSimpleModel<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>(rce, nullptr, true));
+		template<unsigned NO_SYMBOLS, unsigned MAX_LOG_COUNTER, unsigned ADDER>
+		CRangeCoderModel<CAdjustableModel<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>*
+			find_rce_coder(CContextHM<CRangeCoderModel<CAdjustableModel<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>> &map, context_t ctx)
+		{
+			auto p = map.find(ctx);
 
-		return p;
-	}
+			if (p == nullptr)
+				map.insert(ctx, p = new CRangeCoderModel<CAdjustableModel<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>(&rce, nullptr, true));
 
-	template<unsigned NO_SYMBOLS, unsigned MAX_LOG_COUNTER, unsigned ADDER>
-	CRangeCoderModel<CAdjustableModel<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>*
-		find_rce_coder(CContextHM<CRangeCoderModel<CAdjustableModel<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>> &map, context_t ctx)
-	{
-		auto p = map.find(ctx);
+			return p;
+		}
 
-		if (p == nullptr)
-			map.insert(ctx, p = new CRangeCoderModel<CAdjustableModel<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>(rce, nullptr, true));
+		template<unsigned NO_SYMBOLS, unsigned MAX_LOG_COUNTER, unsigned ADDER>
+		CRangeCoderModel<CAdjustableModelEmb<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>*
+			find_rce_coder(CContextHM<CRangeCoderModel<CAdjustableModelEmb<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>> &map, context_t ctx)
+		{
+			auto p = map.find(ctx);
 
-		return p;
-	}
+			if (p == nullptr)
+				map.insert(ctx, p = new CRangeCoderModel<CAdjustableModelEmb<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>(&rce, nullptr, true));
 
-	template<unsigned NO_SYMBOLS, unsigned MAX_LOG_COUNTER, unsigned ADDER>
-	CRangeCoderModel<CAdjustableModelEmb<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>*
-		find_rce_coder(CContextHM<CRangeCoderModel<CAdjustableModelEmb<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>> &map, context_t ctx)
-	{
-		auto p = map.find(ctx);
+			return p;
+		}
 
-		if (p == nullptr)
-			map.insert(ctx, p = new CRangeCoderModel<CAdjustableModelEmb<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>(rce, nullptr, true));
+		template<unsigned NO_SYMBOLS, unsigned MAX_LOG_COUNTER, unsigned ADDER>
+		CRangeCoderModel<CSimpleModel<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>*
+			find_rcd_coder(CContextHM<CRangeCoderModel<CSimpleModel<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>>& map, context_t ctx)
+		{
+			auto p = map.find(ctx);
 
-		return p;
-	}
+			if (p == nullptr)
+				map.insert(ctx, p = new CRangeCoderModel<CSimpleModel<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>(&rcd, nullptr, false));
 
-	template<unsigned NO_SYMBOLS, unsigned MAX_LOG_COUNTER, unsigned ADDER>
-	CRangeCoderModel<CSimpleModel<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>*
-		find_rcd_coder(CContextHM<CRangeCoderModel<CSimpleModel<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>>& map, context_t ctx)
-	{
-		auto p = map.find(ctx);
+			return p;
+		}
 
-		if (p == nullptr)
-			map.insert(ctx, p = new CRangeCoderModel<CSimpleModel<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>(rcd, nullptr, false));
+		template<unsigned NO_SYMBOLS, unsigned MAX_LOG_COUNTER, unsigned ADDER>
+		CRangeCoderModel<CAdjustableModel<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>*
+			find_rcd_coder(CContextHM<CRangeCoderModel<CAdjustableModel<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>>& map, context_t ctx)
+		{
+			auto p = map.find(ctx);
 
-		return p;
-	}
+			if (p == nullptr)
+				map.insert(ctx, p = new CRangeCoderModel<CAdjustableModel<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>(&rcd, nullptr, false));
 
-	template<unsigned NO_SYMBOLS, unsigned MAX_LOG_COUNTER, unsigned ADDER>
-	CRangeCoderModel<CAdjustableModel<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>*
-		find_rcd_coder(CContextHM<CRangeCoderModel<CAdjustableModel<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>>& map, context_t ctx)
-	{
-		auto p = map.find(ctx);
+			return p;
+		}
 
-		if (p == nullptr)
-			map.insert(ctx, p = new CRangeCoderModel<CAdjustableModel<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>(rcd, nullptr, false));
+		template<unsigned NO_SYMBOLS, unsigned MAX_LOG_COUNTER, unsigned ADDER>
+		CRangeCoderModel<CAdjustableModelEmb<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>*
+			find_rcd_coder(CContextHM<CRangeCoderModel<CAdjustableModelEmb<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>>& map, context_t ctx)
+		{
+			auto p = map.find(ctx);
 
-		return p;
-	}
+			if (p == nullptr)
+				map.insert(ctx, p = new CRangeCoderModel<CAdjustableModelEmb<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>(&rcd, nullptr, false));
 
-	template<unsigned NO_SYMBOLS, unsigned MAX_LOG_COUNTER, unsigned ADDER>
-	CRangeCoderModel<CAdjustableModelEmb<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>*
-		find_rcd_coder(CContextHM<CRangeCoderModel<CAdjustableModelEmb<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>>& map, context_t ctx)
-	{
-		auto p = map.find(ctx);
+			return p;
+		}
 
-		if (p == nullptr)
-			map.insert(ctx, p = new CRangeCoderModel<CAdjustableModelEmb<NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>, CVectorIOStream, NO_SYMBOLS, MAX_LOG_COUNTER, ADDER>(rcd, nullptr, false));
+		gt_block_t(uint32_t _first_sample, uint32_t _no_samples, int _stream_id) :
+			first_sample(_first_sample), no_samples(_no_samples), stream_id(_stream_id), decoded(true), raw_size(0),
+			vios_i(v_vios_i), vios_o(v_vios_o), rce(vios_o), rcd(vios_i), ctx_prefix(0), ctx_symbol(0)
+		{}
 
-		return p;
-	}
+		void ResetCoders();
+		void EncodeRuns(const vector<uint32_t> &v_res);
+		void DecodeRuns(const uint8_t *p_data, size_t size, size_t raw_size, const vector<uint32_t> &v_no_haplotypes, vector<pair<uint32_t, uint32_t>> &v_full_rle);
+
+		inline void encode_run_len(uint32_t symbol, uint32_t len);
+		inline void decode_run_len(uint32_t &symbol, uint32_t &len);
+	};
+
+	uint32_t gt_block_size;				// no. of samples in a GT block, 0 - single block of all samples
+	bool gt_counts_only;				// decompression: GT field contains allele counts (see SetGTCountsOnly)
+	bool gt_summary;					// per-variant genotype summary stored in own stream (see SetGTSummary)
+	int gt_summary_stream_id;
+	size_t gt_summary_raw_size;
+	vector<unique_ptr<gt_block_t>> v_gt_blocks;
+
+	// Blocks of a GT part, processed by the calling coder thread and helped by workers of the GT block pool
+	struct gt_block_job_t {
+		vector<gt_block_t*> v_blocks;
+		const function<void(gt_block_t&)>* fun;
+		atomic<size_t> next_block;
+		size_t no_done;
+		mutex mtx;
+		condition_variable cv;
+	};
 
-	inline void encode_run_len(uint32_t symbol, uint32_t len);
-	inline void decode_run_len(uint32_t &symbol, uint32_t &len);
+	// Pool of GT block workers is started at opening (if there are many blocks), so no threads are made per part
+	CRegisteringQueue<shared_ptr<gt_block_job_t>>* q_gt_block_jobs;
+	vector<thread> v_gt_block_threads;
+
+	vector<pair<int, bool>> v_size_nodes;
+	vector<pair<int, int>> v_size_edges;
+	vector<pair<int, bool>> v_data_nodes;
+	vector<pair<int, int>> v_data_edges;
+	vector<bool> m_data_nodes;
+	vector<int> m_data_edges;
 
 	void append(vector<uint8_t>& v_comp, string x)
 	{
@@ -501,6 +639,28 @@ class CCompressedFile
 
 	bool load_descriptions();
 	bool save_descriptions();
+	bool load_index();
+	bool save_index();
+	void select_region();
+	void set_chunk_bounds();
+	void start_decoding();
+	void stop_decoding();
+
+	void flush_key_buffer(uint32_t key_id);
+	void flush_db_buffer(uint32_t db_id);
+	void add_checkpoint();
+	bool is_chunk_start(uint32_t sid, uint32_t part_id);
+	void reset_format_compress(int key_id);
+	void reset_gt_coders();
+	bool decode_variant(variant_desc_t &desc, vector<field_desc> &fields, CArena *arena);
+	bool decode_desc(variant_desc_t &desc);
+	void prepare_key_buffer(int ii);
+	void decode_field(int ii, field_desc &field, field_desc *src_field, CArena *arena);
+	void skip_field(int ii);
+	void decode_columns(variant_columns_t &columns, vector<bool> &v_decode, CArena *arena);
+	void set_keys_decoded();
+	void set_part_sizes();
+	void wait_for_packages_memory(unique_lock<mutex> &lck, size_t pck_memory);
 
 	void lock_coder_compressor(SPackage& pck);
 	bool check_coder_compressor(SPackage& pck);
@@ -510,6 +670,7 @@ class CCompressedFile
 	void skip_text_compressor(SPackage& pck);
 
 	void compress_field(SPackage& pck, vector<uint8_t> &v_compressed, vector<uint8_t> &v_tmp);
+	void decompress_part(CBSCWrapper* bsc, SPackage* pck, vector<uint8_t>& v_decompressed);
 	void decompress_field(SPackage* pck, size_t raw_size, vector<uint8_t>& v_tmp);
 
 	void compress_format(SPackage& pck, vector<uint8_t> &v_compressed, vector<uint8_t> &v_tmp);
@@ -519,33 +680,49 @@ class CCompressedFile
 
 	void compress_gt(SPackage& pck);
 	void decompress_gt(SPackage* pck, size_t raw_size);
+	void set_gt_blocks();
+	void process_gt_blocks(const function<void(gt_block_t&)> &fun);
+	void run_gt_block_job(gt_block_job_t &job);
+	void start_gt_block_workers();
+	void stop_gt_block_workers();
+	void compress_gt_block(gt_block_t &block, SPackage& pck);
+	void decompress_gt_block(gt_block_t &block, SPackage* pck, const vector<uint32_t> &v_no_haplotypes, const vector<size_t> &v_offsets);
+	bool read_gt_block_runs(gt_block_t &block, SPackage* pck, const vector<uint32_t> &v_no_haplotypes, vector<pair<uint32_t, uint32_t>> &v_full_rle);
+	void count_gt_block(gt_block_t &block, SPackage* pck, const vector<uint32_t> &v_no_haplotypes, vector<vector<uint32_t>> &v_counts);
+	void store_gt_summary(SPackage& pck);
+	bool load_gt_summary(SPackage* pck, const vector<uint32_t> &v_no_haplotypes);
+	void count_gt(SPackage* pck, const vector<uint32_t> &v_no_haplotypes);
 
 	void compress_db(SPackage& pck, vector<uint8_t>& v_compressed, vector<uint8_t>& v_tmp);
 	void decompress_db(SPackage* pck, size_t raw_size, vector<uint8_t>& v_tmp);
 
-	bool process_function_size(int no_keys, vector<pair<int, bool>>& v_out_nodes, vector<pair<int, int>>& v_out_edges);
-	bool process_function_data(int no_keys, vector<pair<int, bool>>& v_out_nodes, vector<pair<int, int>>& v_out_edges);
-	bool process_function_data_eq_only(int no_keys, vector<pair<int, bool>>& v_out_nodes, vector<pair<int, int>>& v_out_edges);
+	void find_links(vector<int>& v_stream_ids, vector<pair<int, bool>>& v_out_nodes, vector<pair<int, int>>& v_out_edges);
 
 	void store_nodes(string stream_name, vector<pair<int, bool>>& v_nodes);
 	void store_edges(string stream_name, vector<pair<int, int>>& v_edges, int no_keys);
 	void load_nodes(string stream_name, vector<pair<int, bool>>& v_nodes);
 	void load_edges(string stream_name, vector<pair<int, int>>& v_edges, int no_keys);
 
-	void copy_stream(string stream_name);
-	void link_stream(string stream_name, string target_name);
 	void store_function(string stream_name, int src_id, function_size_item_t& func);
 	void store_function(string stream_name, int src_id, function_data_item_t& func);
 	void load_function(string stream_name, int &src_id, function_size_item_t& func);
 	void load_function(string stream_name, int &src_id, function_data_item_t& func);
 
 public:
+	struct stream_desc_t {
+		CArchive::stream_info_t info;
+		int key_id;			// -1 for streams not related to any key
+		int db_id;			// -1 for streams not related to any db field
+		bool is_data;		// data (not size) stream of a key or db field
+		bool is_aux;		// additional data stream of a key (GT blocks except the 1st, GT summary); coding time is charged to is_data stream
+		string coder;
+	};
+
 	CCompressedFile();
 	~CCompressedFile();
 
 	bool OpenForReading(string file_name);
 	bool OpenForWriting(string file_name, uint32_t _no_keys);
-	bool OptimizeDB(function_size_graph_t&_function_size_graph, function_data_graph_t& _function_data_graph);
 	bool Close();
 
     int GetNoSamples();
@@ -578,9 +755,46 @@ public:
 	int GetNeglectLimit();
 	void SetNeglectLimit(uint32_t _neglect_limit);
 
+	void SetCheckpointInterval(uint32_t _checkpoint_interval);
+	// Before OpenForWriting; 0 - haplotypes of all samples are coded together
+	void SetGTBlockSize(uint32_t _gt_block_size);
+	uint32_t GetGTBlockSize();
+	// Before OpenForWriting; counts of alleles, heterozygous samples and missing haplotypes of each variant are stored
+	// in a small side stream, so SetGTCountsOnly does not need the GT streams
+	void SetGTSummary(bool _gt_summary);
+	bool GetGTSummary();
+	void SetDirectIO(bool _direct_io);
+	void SetMaxMemory(size_t _max_memory);
+	void GetPartSizes(uint32_t &_max_key_part, uint32_t &_max_gt_part);
+	void SetRegion(string _chrom, int64_t _from, int64_t _to);
+	// After OpenForReading and before the first variant is read; fields of other keys are empty
+	bool SetKeysToDecode(const vector<bool> &v_keys);
+	// As above; genotypes are decoded only in GT blocks containing any of the selected samples (other samples are missing)
+	bool SetSamplesToDecode(const vector<bool> &v_samples);
+	// As above; GT field contains no. of heterozygous samples (-1 if unknown) and no. of haplotypes: missing, with allele 0, 1, ...
+	// (up to the largest allele present). Counts are read from the GT summary (if stored and all samples are decoded)
+	// or summed over runs of PBWT symbols, so genotypes are not reconstructed.
+	bool SetGTCountsOnly(bool _gt_counts_only);
+	// As above; only variants matching the filter are returned. Keys of the filter are decoded first, so fields of other keys
+	// are decoded only for matching variants (keys of the filter not requested by SetKeysToDecode are returned empty).
+	bool SetFilter(const CSiteFilter &_site_filter);
+
+	uint32_t GetNoChunks();
+	bool GetChunkRange(uint32_t &_first_chunk, uint32_t &_last_chunk);
+	bool SetChunkRange(uint32_t _first_chunk, uint32_t _last_chunk);
+
 	bool Eof();
 
-	bool GetVariant(variant_desc_t &desc, vector<field_desc> &fields);
+	bool GetStreamsInfo(vector<stream_desc_t> &v_desc);
+	bool GetCodingTimes(vector<double> &_v_key_times, vector<double> &_v_db_times);
+	bool GetWorkStats(work_stats_t &stats);
+
+	// If arena is given, field data are allocated in it (and must not be deleted)
+	bool GetVariant(variant_desc_t &desc, vector<field_desc> &fields, CArena *arena = nullptr);
+
+	// Decode up to max_variants next variants column by column (faster than GetVariant for many variants).
+	// Columns of keys with false in v_keys (if given) are skipped, i.e., contain empty fields.
+	bool GetVariants(variant_columns_t &columns, size_t max_variants, CArena *arena = nullptr, const vector<bool> *v_keys = nullptr);
 	bool SetVariant(variant_desc_t &desc, vector<field_desc> &fields);
     
     bool InitPBWT();
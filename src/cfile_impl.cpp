@@ -11,10 +11,12 @@
 #include <iostream>
 #include <set>
 #include <future>
+#include <atomic>
 using namespace std;
 
 #include "cfile.h"
 #include "utils.h"
+#include "trace.h"
 
 // ************************************************************************************
 bool CCompressedFile::load_descriptions()
@@ -60,6 +62,17 @@ bool CCompressedFile::load_descriptions()
 		keys[i].type = (int8_t) tmp;
 	}
 
+	// Archives without GT blocks store haplotypes of all samples together
+	gt_block_size = 0;
+	stream_id = archive->GetStreamId("gt_blocks");
+	if (stream_id >= 0)
+	{
+		v_desc.clear();
+		p_desc = 0;
+		archive->GetPart(stream_id, v_desc, aux);
+		read(v_desc, p_desc, gt_block_size);
+	}
+
 	// Load variant descriptions
 	for (auto d : {
 		make_tuple(ref(v_rd_meta), ref(v_cd_meta), ref(p_meta), 4, "meta"),
@@ -123,6 +136,16 @@ bool CCompressedFile::save_descriptions()
 	archive->AddPart(stream_id, v_desc);
 	archive->SetRawSize(stream_id, v_desc.size());
 
+	if (v_gt_blocks.size() > 1)
+	{
+		vector<uint8_t> v_blocks;
+		append(v_blocks, gt_block_size);
+
+		stream_id = archive->RegisterStream("gt_blocks");
+		archive->AddPart(stream_id, v_blocks);
+		archive->SetRawSize(stream_id, v_blocks.size());
+	}
+
 	append(v_rd_meta, v_meta);
 	append(v_rd_header, v_header);
 
@@ -151,17 +174,157 @@ bool CCompressedFile::save_descriptions()
 	return true;
 }
 
+// ************************************************************************************
+bool CCompressedFile::save_index()
+{
+	vector<uint8_t> v_index;
+	vector<uint8_t> v_compressed;
+
+	append(v_index, (int64_t) v_checkpoints.size());
+
+	for (size_t i = 0; i < v_checkpoints.size(); ++i)
+	{
+		auto& cp = v_checkpoints[i];
+
+		append(v_index, (int64_t) cp.first_variant);
+
+		// Part ids are stored as deltas to the previous checkpoint
+		for (uint32_t j = 0; j < no_keys + no_db_fields; ++j)
+			append(v_index, (int64_t) (cp.v_part_ids[j] - (i ? v_checkpoints[i - 1].v_part_ids[j] : 0)));
+
+		append(v_index, (int64_t) cp.v_ranges.size());
+		for (auto& x : cp.v_ranges)
+		{
+			append(v_index, get<0>(x));
+			append(v_index, get<1>(x));
+			append(v_index, get<2>(x) - get<1>(x));
+		}
+	}
+
+	CBSCWrapper bsc;
+
+	bsc.InitCompress(p_bsc_meta);
+	bsc.Compress(v_index, v_compressed);
+
+	auto stream_id = archive->RegisterStream("db_index");
+	archive->AddPart(stream_id, v_compressed, v_index.size());
+	archive->SetRawSize(stream_id, v_index.size());
+
+	return true;
+}
+
+// ************************************************************************************
+// Returns false for archives without index (the whole archive is a single chunk then)
+bool CCompressedFile::load_index()
+{
+	v_checkpoints.clear();
+
+	auto stream_id = archive->GetStreamId("db_index");
+	if (stream_id < 0)
+	{
+		v_checkpoints.emplace_back(checkpoint_t{0, vector<uint32_t>(no_keys + no_db_fields, 0), {}});
+
+		return false;
+	}
+
+	vector<uint8_t> v_compressed;
+	vector<uint8_t> v_index;
+	size_t raw_size;
+	CBSCWrapper bsc;
+
+	archive->GetPart(stream_id, v_compressed, raw_size);
+
+	bsc.InitDecompress();
+	bsc.Decompress(v_compressed, v_index);
+
+	size_t pos = 0;
+	int64_t no_checkpoints;
+	int64_t tmp;
+
+	read(v_index, pos, no_checkpoints);
+	v_checkpoints.resize(no_checkpoints);
+
+	for (int64_t i = 0; i < no_checkpoints; ++i)
+	{
+		auto& cp = v_checkpoints[i];
+
+		read(v_index, pos, cp.first_variant);
+
+		cp.v_part_ids.resize(no_keys + no_db_fields);
+		for (uint32_t j = 0; j < no_keys + no_db_fields; ++j)
+		{
+			read(v_index, pos, tmp);
+			cp.v_part_ids[j] = (uint32_t) tmp + (i ? v_checkpoints[i - 1].v_part_ids[j] : 0);
+		}
+
+		int64_t no_ranges;
+		string chrom;
+		int64_t min_pos, len;
+
+		read(v_index, pos, no_ranges);
+		for (int64_t j = 0; j < no_ranges; ++j)
+		{
+			read(v_index, pos, chrom);
+			read(v_index, pos, min_pos);
+			read(v_index, pos, len);
+
+			cp.v_ranges.emplace_back(chrom, min_pos, min_pos + len);
+		}
+	}
+
+	return true;
+}
+
+// ************************************************************************************
+// Restrict decoding to the chunks overlapping the region
+void CCompressedFile::select_region()
+{
+	int first = -1;
+	int last = -1;
+
+	for (size_t i = 0; i < v_checkpoints.size(); ++i)
+		for (auto& x : v_checkpoints[i].v_ranges)
+			if (get<0>(x) == region_chrom && get<1>(x) <= region_to && get<2>(x) >= region_from)
+			{
+				if (first < 0)
+					first = (int) i;
+				last = (int) i;
+				break;
+			}
+
+	if (first < 0)
+	{
+		// Empty range
+		first_chunk = 1;
+		last_chunk = 0;
+	}
+	else
+	{
+		first_chunk = (uint32_t) first;
+		last_chunk = (uint32_t) last;
+	}
+}
+
 // ************************************************************************************
 void CCompressedFile::lock_coder_compressor(SPackage& pck)
 {
 	unique_lock<mutex> lck(mtx_v_coder);
-	cv_v_coder.wait(lck, [&, this] {
-		int sid = pck.key_id;
-		if (pck.type == SPackage::package_t::db)
-			sid = no_keys + pck.db_id;
+	int sid = pck.key_id;
+	if (pck.type == SPackage::package_t::db)
+		sid = no_keys + pck.db_id;
+
+	if ((int) v_coder_part_ids[sid] == pck.part_id)
+		return;
 
+	auto t_start = chrono::steady_clock::now();
+	int64_t trace_start = CTracer::IsEnabled() ? CTracer::Now() : -1;
+	cv_v_coder.wait(lck, [&, this] {
 		return (int) v_coder_part_ids[sid] == pck.part_id;
 		});
+	coder_lock_wait_time += chrono::duration<double>(chrono::steady_clock::now() - t_start).count();
+
+	if (trace_start >= 0)
+		CTracer::Record("wait for stream", trace_start, CTracer::Now() - trace_start, "stream", sid);
 }
 
 // ************************************************************************************
@@ -198,6 +361,9 @@ void CCompressedFile::lock_text_compressor(SPackage& pck)
 
 		return (int) v_text_part_ids[sid] == pck.part_id;
 		});
+
+	if (pck.is_chunk_start && pck.key_id >= 0)
+		v_text_pp[pck.key_id].Reset();
 }
 
 // ************************************************************************************
@@ -224,6 +390,9 @@ void CCompressedFile::skip_text_compressor(SPackage& pck)
 		return (int) v_text_part_ids[sid] == pck.part_id;
 		});
 
+	if (pck.is_chunk_start && pck.key_id >= 0)
+		v_text_pp[pck.key_id].Reset();
+
 	++v_text_part_ids[sid];
 	cv_v_text.notify_all();
 }
@@ -265,6 +434,7 @@ void CCompressedFile::compress_field(SPackage& pck, vector<uint8_t>& v_compresse
 	{
 		v_compressed.clear();
 		skip_text_compressor(pck);
+		lock_coder_compressor(pck);
 		archive->AddPartComplete(pck.stream_id_data, pck.part_id, v_compressed, pck.v_data.size());
 	}
 
@@ -277,6 +447,45 @@ void CCompressedFile::compress_field(SPackage& pck, vector<uint8_t>& v_compresse
 	unlock_coder_compressor(pck);
 }
 
+// ************************************************************************************
+// BSC-decodes the last read part of the package; parts shared by many entries are decoded once
+void CCompressedFile::decompress_part(CBSCWrapper* bsc, SPackage* pck, vector<uint8_t>& v_decompressed)
+{
+	if (pck->part_refs <= 1)
+	{
+		bsc->Decompress(pck->p_compressed, pck->compressed_size, v_decompressed);
+		return;
+	}
+
+	{
+		lock_guard<mutex> lck(mtx_shared_parts);
+
+		auto p = m_shared_parts.find(pck->part_offset);
+		if (p != m_shared_parts.end())
+		{
+			v_decompressed = *p->second.data;
+
+			if (--p->second.no_pending == 0)
+			{
+				shared_parts_size -= p->second.data->size();
+				m_shared_parts.erase(p);
+			}
+
+			return;
+		}
+	}
+
+	bsc->Decompress(pck->p_compressed, pck->compressed_size, v_decompressed);
+
+	lock_guard<mutex> lck(mtx_shared_parts);
+
+	if (shared_parts_size + v_decompressed.size() <= max_shared_parts_size && !m_shared_parts.count(pck->part_offset))
+	{
+		m_shared_parts[pck->part_offset] = shared_part_t{ make_shared<vector<uint8_t>>(v_decompressed), pck->part_refs - 1 };
+		shared_parts_size += v_decompressed.size();
+	}
+}
+
 // ************************************************************************************
 void CCompressedFile::decompress_field(SPackage* pck, size_t raw_size, vector<uint8_t>& v_tmp)
 {
@@ -288,17 +497,17 @@ void CCompressedFile::decompress_field(SPackage* pck, size_t raw_size, vector<ui
 		return;
 	}
 
-	pck->stream_id_data = archive->GetStreamId("key_" + to_string(pck->key_id) + "_data");
+	pck->stream_id_data = v_buf_ids_data[pck->key_id];
 
 	CBSCWrapper* bsc_size = v_bsc_size[pck->key_id];
 	CBSCWrapper* bsc_data = v_bsc_data[pck->key_id];
 
-	bsc_size->Decompress(pck->v_compressed, v_tmp);
+	decompress_part(bsc_size, pck, v_tmp);
 
 	pck->v_size.resize(raw_size);
 	copy_n(v_tmp.data(), raw_size * 4, (uint8_t*)pck->v_size.data());
 
-	archive->GetPart(pck->stream_id_data, pck->v_compressed, raw_size);
+	archive->GetPart(pck->stream_id_data, pck->p_compressed, pck->compressed_size, raw_size, pck->part_offset, pck->part_refs);
 
 	bool is_pp_compressed = false;
 
@@ -312,7 +521,7 @@ void CCompressedFile::decompress_field(SPackage* pck, size_t raw_size, vector<ui
 
 	if (raw_size)
 	{
-		bsc_data->Decompress(pck->v_compressed, pck->v_data);
+		decompress_part(bsc_data, pck, pck->v_data);
 
 		if (is_pp_compressed)
 		{
@@ -330,10 +539,15 @@ void CCompressedFile::compress_format(SPackage& pck, vector<uint8_t>& v_compress
 	CFormatCompress* format_compress = v_format_compress[pck.key_id];
 //	size_t raw_size;
 
+	skip_text_compressor(pck);
+	lock_coder_compressor(pck);
+
+	if (pck.is_chunk_start)
+		reset_format_compress(pck.key_id);
+
 	if (pck.v_data.size())
 	{
-		skip_text_compressor(pck);
-		lock_coder_compressor(pck);
+		format_compress = v_format_compress[pck.key_id];
 		format_compress->EncodeFormat(pck.v_size, pck.v_data, v_compressed);
 
 		archive->AddPartComplete(pck.stream_id_data, pck.part_id, v_compressed, pck.v_data.size());
@@ -341,7 +555,6 @@ void CCompressedFile::compress_format(SPackage& pck, vector<uint8_t>& v_compress
 	else
 	{
 		v_compressed.clear();
-		skip_text_compressor(pck);
 		archive->AddPartComplete(pck.stream_id_data, pck.part_id, v_compressed, pck.v_data.size());
 	}
 
@@ -365,12 +578,12 @@ void CCompressedFile::decompress_format(SPackage* pck, size_t raw_size, vector<u
 		return;
 	}
 
-	pck->stream_id_data = archive->GetStreamId("key_" + to_string(pck->key_id) + "_data");
+	pck->stream_id_data = v_buf_ids_data[pck->key_id];
 
 	CBSCWrapper* bsc_size = v_bsc_size[pck->key_id];
 	CFormatCompress* format_compress = v_format_compress[pck->key_id];
 
-	bsc_size->Decompress(pck->v_compressed, v_tmp);
+	decompress_part(bsc_size, pck, v_tmp);
 
 	pck->v_size.resize(raw_size);
 	copy_n(v_tmp.data(), raw_size * 4, (uint8_t*)pck->v_size.data());
@@ -398,10 +611,15 @@ void CCompressedFile::compress_info(SPackage& pck, vector<uint8_t>& v_compressed
 	CFormatCompress* format_compress = v_format_compress[pck.key_id];
 //	size_t raw_size;
 
+	skip_text_compressor(pck);
+	lock_coder_compressor(pck);
+
+	if (pck.is_chunk_start)
+		reset_format_compress(pck.key_id);
+
 	if (pck.v_data.size())
 	{
-		skip_text_compressor(pck);
-		lock_coder_compressor(pck);
+		format_compress = v_format_compress[pck.key_id];
 		format_compress->EncodeInfo(pck.v_size, pck.v_data, v_compressed);
 
 		archive->AddPartComplete(pck.stream_id_data, pck.part_id, v_compressed, pck.v_data.size());
@@ -409,7 +627,6 @@ void CCompressedFile::compress_info(SPackage& pck, vector<uint8_t>& v_compressed
 	else
 	{
 		v_compressed.clear();
-		skip_text_compressor(pck);
 		archive->AddPartComplete(pck.stream_id_data, pck.part_id, v_compressed, pck.v_data.size());
 	}
 
@@ -433,12 +650,12 @@ void CCompressedFile::decompress_info(SPackage* pck, size_t raw_size, vector<uin
 		return;
 	}
 
-	pck->stream_id_data = archive->GetStreamId("key_" + to_string(pck->key_id) + "_data");
+	pck->stream_id_data = v_buf_ids_data[pck->key_id];
 
 	CBSCWrapper* bsc_size = v_bsc_size[pck->key_id];
 	CFormatCompress* format_compress = v_format_compress[pck->key_id];
 
-	bsc_size->Decompress(pck->v_compressed, v_tmp);
+	decompress_part(bsc_size, pck, v_tmp);
 
 	pck->v_size.resize(raw_size);
 	copy_n(v_tmp.data(), raw_size * 4, (uint8_t*)pck->v_size.data());
@@ -488,17 +705,17 @@ void CCompressedFile::decompress_db(SPackage* pck, size_t raw_size, vector<uint8
 	CBSCWrapper* bsc_size = v_bsc_db_size[pck->db_id];
 	CBSCWrapper* bsc_data = v_bsc_db_data[pck->db_id];
 
-	bsc_size->Decompress(pck->v_compressed, v_tmp);
+	decompress_part(bsc_size, pck, v_tmp);
 
 	pck->v_size.resize(raw_size);
 	copy_n(v_tmp.data(), raw_size * 4, (uint8_t*)pck->v_size.data());
 
-	archive->GetPart(pck->stream_id_data, pck->v_compressed, raw_size);
+	archive->GetPart(pck->stream_id_data, pck->p_compressed, pck->compressed_size, raw_size, pck->part_offset, pck->part_refs);
 
 	pck->v_data.resize(raw_size);
 
 	if (raw_size)
-		bsc_data->Decompress(pck->v_compressed, pck->v_data);
+		decompress_part(bsc_data, pck, pck->v_data);
 }
 
 #if 1
@@ -506,62 +723,33 @@ void CCompressedFile::decompress_db(SPackage* pck, size_t raw_size, vector<uint8
 void CCompressedFile::compress_gt(SPackage& pck)
 {
 	int i_vec = 0;
-	vector<uint32_t> v_tmp_reo;
-	vector<pair<uint32_t, uint32_t>> v_rle;
-
-	vector<uint32_t> v_res;
 
 	lock_coder_compressor(pck);
 
-	// *** Reorganization of haplotypes
+	if (pck.is_chunk_start)
+		reset_gt_coders();
+
+	if (gt_summary_stream_id >= 0)
+		store_gt_summary(pck);
+
+	// Change of status of the 1st haplotype
 	for (size_t i = 0; i < pck.v_data.size(); i += pck.v_size[i_vec++] * 4)
 	{
 		uint32_t* vec = (uint32_t*)(pck.v_data.data() + i);
 		uint32_t no_haplotypes = pck.v_size[i_vec] / no_samples;
-		uint32_t max_gt_val = 0;
-
-		v_tmp_reo.resize(pck.v_size[i_vec]);
 
-		// Change of status of the 1st haplotype
 		if (no_haplotypes > 1)
 			for (uint32_t k = 0; k < no_samples; ++k)
 				if (vec[k * no_haplotypes + 1] & 1)
 					vec[k * no_haplotypes] += 1;
-
-		for (uint32_t j = 0; j < no_haplotypes; ++j)
-			for (uint32_t k = 0; k < no_samples; ++k)
-			{
-				uint32_t gt_val = vec[k * no_haplotypes + j];
-				if (gt_val == 0x80000001u)
-					gt_val = 0;
-				else
-					++gt_val;
-
-				v_tmp_reo[j * no_samples + k] = gt_val;
-
-				if (gt_val > max_gt_val)
-				{
-					max_gt_val = gt_val;
-#ifdef LOG_INFO
-					if (max_gt_val > 64)
-						cout << "***\n";
-#endif
-				}
-			}
-
-		pbwt.EncodeFlexible(max_gt_val, v_tmp_reo, v_rle);
-
-		v_rle.back().second = 0;
-
-		for (auto x : v_rle)
-		{
-			v_res.emplace_back(x.first);
-			v_res.emplace_back(x.second);
-		}
 	}
 
 	if (pck.v_data.size())
 	{
+		process_gt_blocks([&](gt_block_t& block) {
+			compress_gt_block(block, pck);
+		});
+
 		for (auto& x : pck.v_size)
 			x /= no_samples;
 
@@ -570,83 +758,149 @@ void CCompressedFile::compress_gt(SPackage& pck)
 
 		vector<uint8_t> v_tmp;
 		vector<uint8_t> v_compressed;
-		size_t raw_size;
 
 		v_tmp.resize(pck.v_size.size() * 4);
 		copy_n((uint8_t*)pck.v_size.data(), v_tmp.size(), v_tmp.data());
 
 		bsc_size->Compress(v_tmp, v_compressed);
 		archive->AddPartComplete(pck.stream_id_size, pck.part_id, v_compressed, pck.v_size.size());
+	}
+	else
+	{
+		vector<uint8_t> v_compressed;
+
+		// Part of variants without genotypes (sizes are needed to keep the part ids in sync)
+		if (pck.v_size.size())
+		{
+			vector<uint8_t> v_tmp;
 
-		// RC compression
-		v_vios_o.clear();
-		rce->Start();
-		ctx_prefix = context_prefix_mask;
-		ctx_symbol = context_symbol_mask;
+			for (auto& x : pck.v_size)
+				x /= no_samples;
 
-		for (size_t i = 0; i < v_res.size(); i += 2)
+			v_tmp.resize(pck.v_size.size() * 4);
+			copy_n((uint8_t*)pck.v_size.data(), v_tmp.size(), v_tmp.data());
+
+			v_bsc_size[pck.key_id]->Compress(v_tmp, v_compressed);
+			archive->AddPartComplete(pck.stream_id_size, pck.part_id, v_compressed, pck.v_size.size());
+		}
+
+		for (auto& block : v_gt_blocks)
 		{
-			encode_run_len(v_res[i], v_res[i + 1]);
-			if (v_res[i + 1] == 0)
-			{
-				ctx_prefix = context_prefix_mask;
-				ctx_symbol = context_symbol_mask;
-			}
+			v_compressed.clear();
+			archive->AddPartComplete(block->stream_id, pck.part_id, v_compressed, 0);
 		}
+	}
+
+	unlock_coder_compressor(pck);
+}
 
-		rce->End();
+// ************************************************************************************
+// Blocks (to decode) are processed by the calling thread and up to no. of coder threads - 1 workers of the pool
+void CCompressedFile::process_gt_blocks(const function<void(gt_block_t&)> &fun)
+{
+	auto job = make_shared<gt_block_job_t>();
 
-		raw_size = v_res.size();
+	for (auto& block : v_gt_blocks)
+		if (open_mode == open_mode_t::writing || block->decoded)
+			job->v_blocks.emplace_back(block.get());
 
-		archive->AddPartComplete(pck.stream_id_data, pck.part_id, v_vios_o, raw_size);
-	}
-	else
+	job->fun = &fun;
+	job->next_block = 0;
+	job->no_done = 0;
+
+	if (q_gt_block_jobs)
+		for (size_t i = 1; i < min(job->v_blocks.size(), v_gt_block_threads.size() + 1); ++i)
+			q_gt_block_jobs->Push(job);
+
+	run_gt_block_job(*job);
+
+	// Workers taking the job later find no blocks left, so only blocks in progress are waited for
+	unique_lock<mutex> lck(job->mtx);
+	job->cv.wait(lck, [&] {return job->no_done == job->v_blocks.size(); });
+}
+
+// ************************************************************************************
+void CCompressedFile::run_gt_block_job(gt_block_job_t &job)
+{
+	size_t no_done = 0;
+
+	for (size_t i = job.next_block++; i < job.v_blocks.size(); i = job.next_block++)
 	{
-		vector<uint8_t> v_compressed;
-		archive->AddPartComplete(pck.stream_id_data, pck.part_id, v_compressed, 0);
+		(*job.fun)(*job.v_blocks[i]);
+		++no_done;
 	}
 
-	unlock_coder_compressor(pck);
+	if (!no_done)
+		return;
+
+	lock_guard<mutex> lck(job.mtx);
+	job.no_done += no_done;
+	if (job.no_done == job.v_blocks.size())
+		job.cv.notify_all();
 }
-#endif
 
-#if 0
 // ************************************************************************************
-void CCompressedFile::compress_gt(SPackage& pck)
+void CCompressedFile::start_gt_block_workers()
 {
-	int i_vec = 0;
-	vector<uint32_t> v_tmp_reo;
-	vector<pair<uint32_t, uint32_t>> v_rle;
+	stop_gt_block_workers();
 
-	vector<uint32_t> v_res;
+	if (v_gt_blocks.size() < 2 || no_coder_threads < 2)
+		return;
 
-	if (pck.v_data.empty())
-	{
-		vector<uint8_t> v_compressed;
-		archive->AddPartComplete(pck.stream_id_data, pck.part_id, v_compressed, 0);
+	q_gt_block_jobs = new CRegisteringQueue<shared_ptr<gt_block_job_t>>(1);
+
+	for (uint32_t i = 0; i + 1 < min<size_t>(no_coder_threads, v_gt_blocks.size()); ++i)
+		v_gt_block_threads.emplace_back([this] {
+			shared_ptr<gt_block_job_t> job;
+
+			CTracer::SetThreadName("GT block");
 
+			while (q_gt_block_jobs->Pop(job))
+			{
+				run_gt_block_job(*job);
+				job.reset();
+			}
+		});
+}
+
+// ************************************************************************************
+void CCompressedFile::stop_gt_block_workers()
+{
+	if (!q_gt_block_jobs)
 		return;
-	}
 
-	lock_coder_compressor(pck);
+	q_gt_block_jobs->MarkCompleted();
+
+	for (auto& t : v_gt_block_threads)
+		t.join();
+	v_gt_block_threads.clear();
+
+	delete q_gt_block_jobs;
+	q_gt_block_jobs = nullptr;
+}
+
+// ************************************************************************************
+void CCompressedFile::compress_gt_block(gt_block_t &block, SPackage& pck)
+{
+	CTraceScope trace("compress GT block", "first_sample", block.first_sample);
+	int i_vec = 0;
+	vector<uint32_t> v_tmp_reo;
+	vector<pair<uint32_t, uint32_t>> v_rle;
+
+	vector<uint32_t> v_res;
 
 	// *** Reorganization of haplotypes
-	for (int i = 0; i < pck.v_data.size(); i += pck.v_size[i_vec++] * 4)
+	for (size_t i = 0; i < pck.v_data.size(); i += pck.v_size[i_vec++] * 4)
 	{
-		uint32_t* vec = (uint32_t*)(pck.v_data.data() + i);
-		int no_haplotypes = pck.v_size[i_vec] / no_samples;
+		const uint32_t* vec = (const uint32_t*)(pck.v_data.data() + i) + (size_t) block.first_sample * (pck.v_size[i_vec] / no_samples);
+		uint32_t no_haplotypes = pck.v_size[i_vec] / no_samples;
 		uint32_t max_gt_val = 0;
 
-		v_tmp_reo.resize(pck.v_size[i_vec]);
-
-		// Change of status of the 1st haplotype
-		if (no_haplotypes > 1)
-			for (int k = 0; k < no_samples; ++k)
-				if (vec[k * no_haplotypes + 1] & 1)
-					vec[k * no_haplotypes] += 1;
+		v_tmp_reo.resize(no_haplotypes * block.no_samples);
+		block.raw_size += v_tmp_reo.size() * 4;
 
-		for (int j = 0; j < no_haplotypes; ++j)
-			for (int k = 0; k < no_samples; ++k)
+		for (uint32_t j = 0; j < no_haplotypes; ++j)
+			for (uint32_t k = 0; k < block.no_samples; ++k)
 			{
 				uint32_t gt_val = vec[k * no_haplotypes + j];
 				if (gt_val == 0x80000001u)
@@ -654,7 +908,7 @@ void CCompressedFile::compress_gt(SPackage& pck)
 				else
 					++gt_val;
 
-				v_tmp_reo[j * no_samples + k] = gt_val;
+				v_tmp_reo[j * block.no_samples + k] = gt_val;
 
 				if (gt_val > max_gt_val)
 				{
@@ -666,7 +920,7 @@ void CCompressedFile::compress_gt(SPackage& pck)
 				}
 			}
 
-		pbwt.EncodeFlexible(max_gt_val, v_tmp_reo, v_rle);
+		block.pbwt.EncodeFlexible(max_gt_val, v_tmp_reo, v_rle);
 
 		v_rle.back().second = 0;
 
@@ -677,16 +931,90 @@ void CCompressedFile::compress_gt(SPackage& pck)
 		}
 	}
 
-	for (auto& x : pck.v_size)
-		x /= no_samples;
-
-	size_t raw_size;
+	// RC compression
+	block.EncodeRuns(v_res);
 
-	//  BSC compression
-	auto bsc_async = async([&] {
-		CBSCWrapper* bsc_size = v_bsc_size[pck.key_id];
+	archive->AddPartComplete(block.stream_id, pck.part_id, block.v_vios_o, v_res.size());
+}
+#endif
 
-		vector<uint8_t> v_tmp;
+#if 0
+// ************************************************************************************
+void CCompressedFile::compress_gt(SPackage& pck)
+{
+	int i_vec = 0;
+	vector<uint32_t> v_tmp_reo;
+	vector<pair<uint32_t, uint32_t>> v_rle;
+
+	vector<uint32_t> v_res;
+
+	if (pck.v_data.empty())
+	{
+		vector<uint8_t> v_compressed;
+		archive->AddPartComplete(pck.stream_id_data, pck.part_id, v_compressed, 0);
+
+		return;
+	}
+
+	lock_coder_compressor(pck);
+
+	// *** Reorganization of haplotypes
+	for (int i = 0; i < pck.v_data.size(); i += pck.v_size[i_vec++] * 4)
+	{
+		uint32_t* vec = (uint32_t*)(pck.v_data.data() + i);
+		int no_haplotypes = pck.v_size[i_vec] / no_samples;
+		uint32_t max_gt_val = 0;
+
+		v_tmp_reo.resize(pck.v_size[i_vec]);
+
+		// Change of status of the 1st haplotype
+		if (no_haplotypes > 1)
+			for (int k = 0; k < no_samples; ++k)
+				if (vec[k * no_haplotypes + 1] & 1)
+					vec[k * no_haplotypes] += 1;
+
+		for (int j = 0; j < no_haplotypes; ++j)
+			for (int k = 0; k < no_samples; ++k)
+			{
+				uint32_t gt_val = vec[k * no_haplotypes + j];
+				if (gt_val == 0x80000001u)
+					gt_val = 0;
+				else
+					++gt_val;
+
+				v_tmp_reo[j * no_samples + k] = gt_val;
+
+				if (gt_val > max_gt_val)
+				{
+					max_gt_val = gt_val;
+#ifdef LOG_INFO
+					if (max_gt_val > 64)
+						cout << "***\n";
+#endif
+				}
+			}
+
+		pbwt.EncodeFlexible(max_gt_val, v_tmp_reo, v_rle);
+
+		v_rle.back().second = 0;
+
+		for (auto x : v_rle)
+		{
+			v_res.emplace_back(x.first);
+			v_res.emplace_back(x.second);
+		}
+	}
+
+	for (auto& x : pck.v_size)
+		x /= no_samples;
+
+	size_t raw_size;
+
+	//  BSC compression
+	auto bsc_async = async([&] {
+		CBSCWrapper* bsc_size = v_bsc_size[pck.key_id];
+
+		vector<uint8_t> v_tmp;
 		vector<uint8_t> v_compressed;
 
 		v_tmp.resize(pck.v_size.size() * 4);
@@ -728,7 +1056,6 @@ void CCompressedFile::compress_gt(SPackage& pck)
 void CCompressedFile::decompress_gt(SPackage* pck, size_t raw_size)
 {
 	CBSCWrapper* bsc_size = v_bsc_size[pck->key_id];
-//	CBSCWrapper* bsc_data = v_bsc_data[pck->key_id];
 
 	if (raw_size == 0)
 	{
@@ -739,76 +1066,66 @@ void CCompressedFile::decompress_gt(SPackage* pck, size_t raw_size)
 	}
 
 	vector<uint8_t> v_tmp;
-	bsc_size->Decompress(pck->v_compressed, v_tmp);
+	decompress_part(bsc_size, pck, v_tmp);
 
 	pck->v_size.resize(raw_size);
 	copy_n(v_tmp.data(), raw_size * 4, (uint8_t*)pck->v_size.data());
 
-	pck->stream_id_data = archive->GetStreamId("key_" + to_string(pck->key_id) + "_data");
-
-	archive->GetPart(pck->stream_id_data, pck->v_compressed, raw_size);
-	pck->v_data.resize(raw_size);
+	pck->stream_id_data = v_buf_ids_data[pck->key_id];
 
-	vector<pair<uint32_t, uint32_t>> v_full_rle;
+	// Sizes are stored as no. of haplotypes of each variant
+	vector<uint32_t> v_no_haplotypes = pck->v_size;
+	vector<size_t> v_offsets;
 
-	if (raw_size)
+	if (gt_counts_only)
 	{
-		v_vios_i = pck->v_compressed;
-		vios_i->RestartRead();
-
-		rcd->Start();
-		ctx_prefix = context_prefix_mask;
-		ctx_symbol = context_symbol_mask;
-
-		size_t cur_size = 0;
-		int i_variant = 0;
-
-		uint32_t symbol;
-		uint32_t len;
-		uint32_t cur_variant_size = 0;
-
-		for (size_t i = 0; i < raw_size; i += 2)
-		{
-			decode_run_len(symbol, len);
-			if (len == 0)
-			{
-				ctx_prefix = context_prefix_mask;
-				ctx_symbol = context_symbol_mask;
-				len = pck->v_size[i_variant++] * no_samples - cur_variant_size;
-				cur_variant_size = 0;
-			}
-			else
-				cur_variant_size += len;
+		bool all_samples = all_of(v_gt_blocks.begin(), v_gt_blocks.end(), [](const unique_ptr<gt_block_t>& block) {return block->decoded; });
 
-			cur_size += len;
+		if (!(gt_summary_stream_id >= 0 && all_samples && load_gt_summary(pck, v_no_haplotypes)))
+			count_gt(pck, v_no_haplotypes);
 
-			v_full_rle.emplace_back(symbol, len);
-		}
-
-		rcd->End();
+		return;
 	}
 
-	// PBWT decoding
 	size_t total_data_size = 0;
 	for (auto& x : pck->v_size)
 	{
 		x *= no_samples;
 
+		v_offsets.emplace_back(total_data_size);
 		total_data_size += x;
 	}
 
-	pck->v_data.resize(total_data_size * 4);
+	// Samples of blocks not decoded are missing
+	pck->v_data.assign(total_data_size * 4, 0);
 
-	size_t i_data = 0;
+	process_gt_blocks([&](gt_block_t& block) {
+		decompress_gt_block(block, pck, v_no_haplotypes, v_offsets);
+	});
+}
+
+// ************************************************************************************
+void CCompressedFile::decompress_gt_block(gt_block_t &block, SPackage* pck, const vector<uint32_t> &v_no_haplotypes, const vector<size_t> &v_offsets)
+{
+	CTraceScope trace("decode GT block", "first_sample", block.first_sample);
+	vector<pair<uint32_t, uint32_t>> v_full_rle;
+
+	if (!read_gt_block_runs(block, pck, v_no_haplotypes, v_full_rle))
+		return;
+
+	// PBWT decoding
+	uint32_t* data = (uint32_t*)pck->v_data.data();
 
-	int i_variant = 0;
 	vector<pair<uint32_t, uint32_t>> v_rle;
-	vector<uint32_t> v_output, vec;
+	vector<uint32_t> v_output;
+
+	size_t i_variant = 0;
 
-	for (size_t i = 0; i < v_full_rle.size();)
+	for (size_t i = 0; i < v_full_rle.size(); ++i_variant)
 	{
 		uint32_t c_variant_len = 0;
-		uint32_t variant_size = pck->v_size[i_variant++];
+		uint32_t no_haplotypes = v_no_haplotypes[i_variant];
+		uint32_t variant_size = no_haplotypes * block.no_samples;
 
 		v_rle.clear();
 
@@ -823,16 +1140,14 @@ void CCompressedFile::decompress_gt(SPackage* pck, size_t raw_size)
 				max_val = v_full_rle[i].first;
 		}
 
-		pbwt.DecodeFlexible(max_val, v_rle, v_output);
+		block.pbwt.DecodeFlexible(max_val, v_rle, v_output);
 
-		vec.resize(v_output.size());
-
-		uint32_t no_haplotypes = (uint32_t) (v_output.size() / no_samples);
+		uint32_t* vec = data + v_offsets[i_variant] + (size_t) block.first_sample * no_haplotypes;
 
 		for (uint32_t j = 0; j < no_haplotypes; ++j)
-			for (uint32_t k = 0; k < no_samples; ++k)
+			for (uint32_t k = 0; k < block.no_samples; ++k)
 			{
-				uint32_t gt_val = v_output[j * no_samples + k];
+				uint32_t gt_val = v_output[j * block.no_samples + k];
 
 				if (gt_val == 0)
 					gt_val = 0x80000001u;
@@ -844,18 +1159,337 @@ void CCompressedFile::decompress_gt(SPackage* pck, size_t raw_size)
 
 		// Recovery of the 1st haplotype status
 		if (no_haplotypes > 1)
-			for (uint32_t k = 0; k < no_samples; ++k)
+			for (uint32_t k = 0; k < block.no_samples; ++k)
 				if (vec[k * no_haplotypes] & 1)
 					vec[k * no_haplotypes] -= 1;
+	}
+}
 
+// ************************************************************************************
+// Block parts are read by part id, as parts of blocks not decoded are not read at all
+bool CCompressedFile::read_gt_block_runs(gt_block_t &block, SPackage* pck, const vector<uint32_t> &v_no_haplotypes, vector<pair<uint32_t, uint32_t>> &v_full_rle)
+{
+	const uint8_t* p_data;
+	size_t size;
+	size_t raw_size;
 
-		copy_n((uint8_t*)vec.data(), vec.size() * 4, pck->v_data.data() + i_data);
-		i_data += v_output.size() * 4;
+	archive->SetStreamPartIterator(block.stream_id, pck->part_id);
+	if (!archive->GetPart(block.stream_id, p_data, size, raw_size) || !raw_size)
+		return false;
+
+	block.DecodeRuns(p_data, size, raw_size, v_no_haplotypes, v_full_rle);
+
+	return true;
+}
+
+// ************************************************************************************
+// PBWT permutes haplotypes only, so the runs of a variant contain the same symbols as its genotypes
+void CCompressedFile::count_gt_block(gt_block_t &block, SPackage* pck, const vector<uint32_t> &v_no_haplotypes, vector<vector<uint32_t>> &v_counts)
+{
+	CTraceScope trace("count GT block", "first_sample", block.first_sample);
+	vector<pair<uint32_t, uint32_t>> v_full_rle;
+
+	v_counts.assign(v_no_haplotypes.size(), vector<uint32_t>());
+
+	if (!read_gt_block_runs(block, pck, v_no_haplotypes, v_full_rle))
+		return;
+
+	size_t i_variant = 0;
+
+	for (size_t i = 0; i < v_full_rle.size(); ++i_variant)
+	{
+		uint32_t variant_size = v_no_haplotypes[i_variant] * block.no_samples;
+		auto& counts = v_counts[i_variant];
+
+		for (uint32_t c_variant_len = 0; c_variant_len < variant_size; ++i)
+		{
+			auto& run = v_full_rle[i];
+
+			if (run.first >= counts.size())
+				counts.resize(run.first + 1, 0);
+			counts[run.first] += run.second;
+			c_variant_len += run.second;
+		}
 	}
 }
 
 // ************************************************************************************
-void CCompressedFile::encode_run_len(uint32_t symbol, uint32_t len)
+// Symbol 0 is the end of a vector (lower ploidy), symbol s > 0 is BCF genotype s - 1, i.e., allele ((s - 1) >> 1) - 1
+// (-1 for missing) with the phase bit
+void CCompressedFile::count_gt(SPackage* pck, const vector<uint32_t> &v_no_haplotypes)
+{
+	vector<vector<vector<uint32_t>>> v_block_counts(v_gt_blocks.size());
+
+	process_gt_blocks([&](gt_block_t& block) {
+		count_gt_block(block, pck, v_no_haplotypes, v_block_counts[gt_block_size ? block.first_sample / gt_block_size : 0]);
+	});
+
+	vector<uint32_t> v_all;
+	vector<uint32_t> v_counts;
+
+	pck->v_size.clear();
+
+	for (size_t i = 0; i < v_no_haplotypes.size(); ++i)
+	{
+		v_counts.clear();
+
+		for (auto& block_counts : v_block_counts)
+			if (i < block_counts.size())
+				for (size_t s = 1; s < block_counts[i].size(); ++s)
+				{
+					size_t id = (s - 1) >> 1;
+
+					if (id >= v_counts.size())
+						v_counts.resize(id + 1, 0);
+					v_counts[id] += block_counts[i][s];
+				}
+
+		// Variants without genotypes have no counts
+		if (!v_no_haplotypes[i])
+		{
+			pck->v_size.emplace_back(0);
+			continue;
+		}
+
+		if (v_counts.empty())
+			v_counts.emplace_back(0);
+
+		// Heterozygous samples cannot be told from runs of PBWT symbols
+		v_all.emplace_back(~0u);
+		v_all.insert(v_all.end(), v_counts.begin(), v_counts.end());
+		pck->v_size.emplace_back((uint32_t) v_counts.size() + 1);
+	}
+
+	pck->v_data.resize(v_all.size() * 4);
+	copy_n((uint8_t*)v_all.data(), pck->v_data.size(), pck->v_data.data());
+}
+
+// ************************************************************************************
+// Per variant: no. of counts (0 for variants without genotypes), no. of heterozygous samples,
+// no. of haplotypes: missing, with allele 0, 1, ...
+void CCompressedFile::store_gt_summary(SPackage& pck)
+{
+	vector<uint32_t> v_summary;
+	vector<uint32_t> v_counts;
+	const uint32_t* vec = (const uint32_t*)pck.v_data.data();
+
+	for (auto size : pck.v_size)
+	{
+		uint32_t no_haplotypes = size / no_samples;
+		uint32_t no_het = 0;
+
+		if (!no_haplotypes)
+		{
+			v_summary.emplace_back(0);
+			continue;
+		}
+
+		v_counts.clear();
+
+		for (uint32_t k = 0; k < no_samples; ++k, vec += no_haplotypes)
+		{
+			uint32_t first_id = 0;
+			bool het = false;
+
+			for (uint32_t j = 0; j < no_haplotypes && vec[j] != 0x80000001u; ++j)
+			{
+				// BCF genotype without the phase bit: 0 - missing, 1 - allele 0, ...
+				uint32_t id = vec[j] >> 1;
+
+				if (id >= v_counts.size())
+					v_counts.resize(id + 1, 0);
+				++v_counts[id];
+
+				if (!id)
+					continue;
+				if (!first_id)
+					first_id = id;
+				else if (id != first_id)
+					het = true;
+			}
+
+			no_het += het;
+		}
+
+		if (v_counts.empty())
+			v_counts.emplace_back(0);
+
+		v_summary.emplace_back((uint32_t) v_counts.size());
+		v_summary.emplace_back(no_het);
+		v_summary.insert(v_summary.end(), v_counts.begin(), v_counts.end());
+	}
+
+	vector<uint8_t> v_tmp(v_summary.size() * 4);
+	vector<uint8_t> v_compressed;
+
+	copy_n((uint8_t*)v_summary.data(), v_tmp.size(), v_tmp.data());
+
+	if (!v_tmp.empty())
+	{
+		CBSCWrapper bsc;
+
+		bsc.InitCompress(p_bsc_size);
+		bsc.Compress(v_tmp, v_compressed);
+	}
+
+	// Parts of GT key are coded one at a time
+	gt_summary_raw_size += v_tmp.size();
+
+	archive->AddPartComplete(gt_summary_stream_id, pck.part_id, v_compressed, v_summary.size());
+}
+
+// ************************************************************************************
+// GT counts of a part from the summary stream; false if the part is not consistent with GT sizes
+bool CCompressedFile::load_gt_summary(SPackage* pck, const vector<uint32_t> &v_no_haplotypes)
+{
+	CTraceScope trace("load GT summary");
+	vector<uint8_t> v_compressed;
+	vector<uint8_t> v_tmp;
+	size_t raw_size;
+
+	archive->SetStreamPartIterator(gt_summary_stream_id, pck->part_id);
+	if (!archive->GetPart(gt_summary_stream_id, v_compressed, raw_size))
+		return false;
+
+	if (raw_size)
+	{
+		CBSCWrapper bsc;
+
+		bsc.InitDecompress();
+		bsc.Decompress(v_compressed, v_tmp);
+	}
+
+	if (v_tmp.size() != raw_size * 4)
+		return false;
+
+	const uint32_t* p = (const uint32_t*)v_tmp.data();
+	vector<uint32_t> v_size;
+
+	for (size_t i = 0; i < raw_size; )
+	{
+		uint32_t no_counts = p[i++];
+
+		if (v_size.size() >= v_no_haplotypes.size() || (no_counts == 0) != (v_no_haplotypes[v_size.size()] == 0) || i + no_counts + 1 > raw_size)
+			return false;
+
+		if (no_counts)
+		{
+			v_size.emplace_back(no_counts + 1);
+			i += no_counts + 1;
+		}
+		else
+			v_size.emplace_back(0);
+	}
+
+	if (v_size.size() != v_no_haplotypes.size())
+		return false;
+
+	// Summary is stored in the layout of GT counts, except for no. of counts
+	pck->v_size = move(v_size);
+	pck->v_data.clear();
+
+	for (size_t i = 0; i < raw_size; )
+	{
+		uint32_t no_counts = p[i++];
+
+		if (no_counts)
+		{
+			pck->v_data.insert(pck->v_data.end(), (const uint8_t*)(p + i), (const uint8_t*)(p + i + no_counts + 1));
+			i += no_counts + 1;
+		}
+	}
+
+	return true;
+}
+
+// ************************************************************************************
+void CCompressedFile::gt_block_t::ResetCoders()
+{
+	rce_coders_rl_pref.clear();
+	rcd_coders_rl_pref.clear();
+	rce_coders_rl_sym.clear();
+	rcd_coders_rl_sym.clear();
+	rce_coders_large_val.clear();
+	rcd_coders_large_val.clear();
+
+	rce_coders_rl_suf2.clear();
+	rcd_coders_rl_suf2.clear();
+	rce_coders_rl_suf4.clear();
+	rcd_coders_rl_suf4.clear();
+	rce_coders_rl_suf8.clear();
+	rcd_coders_rl_suf8.clear();
+	rce_coders_rl_suf16.clear();
+	rcd_coders_rl_suf16.clear();
+	rce_coders_rl_suf32.clear();
+	rcd_coders_rl_suf32.clear();
+	rce_coders_rl_suf64.clear();
+	rcd_coders_rl_suf64.clear();
+	rce_coders_rl_suf128.clear();
+	rcd_coders_rl_suf128.clear();
+	rce_coders_rl_suf256.clear();
+	rcd_coders_rl_suf256.clear();
+}
+
+// ************************************************************************************
+// Pairs (symbol, run length) to v_vios_o; 0 length ends a variant
+void CCompressedFile::gt_block_t::EncodeRuns(const vector<uint32_t> &v_res)
+{
+	v_vios_o.clear();
+	rce.Start();
+	ctx_prefix = context_prefix_mask;
+	ctx_symbol = context_symbol_mask;
+
+	for (size_t i = 0; i < v_res.size(); i += 2)
+	{
+		encode_run_len(v_res[i], v_res[i + 1]);
+		if (v_res[i + 1] == 0)
+		{
+			ctx_prefix = context_prefix_mask;
+			ctx_symbol = context_symbol_mask;
+		}
+	}
+
+	rce.End();
+}
+
+// ************************************************************************************
+// Length of the last run of a variant is restored from the variant size
+void CCompressedFile::gt_block_t::DecodeRuns(const uint8_t *p_data, size_t size, size_t raw_size, const vector<uint32_t> &v_no_haplotypes, vector<pair<uint32_t, uint32_t>> &v_full_rle)
+{
+	v_vios_i.assign(p_data, p_data + size);
+	vios_i.RestartRead();
+
+	rcd.Start();
+	ctx_prefix = context_prefix_mask;
+	ctx_symbol = context_symbol_mask;
+
+	int i_variant = 0;
+
+	uint32_t symbol;
+	uint32_t len;
+	uint32_t cur_variant_size = 0;
+
+	for (size_t i = 0; i < raw_size; i += 2)
+	{
+		decode_run_len(symbol, len);
+		if (len == 0)
+		{
+			ctx_prefix = context_prefix_mask;
+			ctx_symbol = context_symbol_mask;
+			len = v_no_haplotypes[i_variant++] * no_samples - cur_variant_size;
+			cur_variant_size = 0;
+		}
+		else
+			cur_variant_size += len;
+
+		v_full_rle.emplace_back(symbol, len);
+	}
+
+	rcd.End();
+}
+
+// ************************************************************************************
+void CCompressedFile::gt_block_t::encode_run_len(uint32_t symbol, uint32_t len)
 {
 	// Encode symbol
 	auto rc_sym = find_rce_coder(rcd_coders_rl_sym, ctx_symbol + context_symbol_flag);
@@ -968,7 +1602,7 @@ void CCompressedFile::encode_run_len(uint32_t symbol, uint32_t len)
 }
 
 // ************************************************************************************
-void CCompressedFile::decode_run_len(uint32_t& symbol, uint32_t& len)
+void CCompressedFile::gt_block_t::decode_run_len(uint32_t& symbol, uint32_t& len)
 {
 	// Decode symbol
 	auto rc_sym = find_rcd_coder(rcd_coders_rl_sym, ctx_symbol + context_symbol_flag);
@@ -1074,232 +1708,25 @@ void CCompressedFile::decode_run_len(uint32_t& symbol, uint32_t& len)
 }
 
 // ******************************************************************************
-bool CCompressedFile::OptimizeDB(function_size_graph_t& _function_size_graph, function_data_graph_t& _function_data_graph)
+// Stream of a key is a link if the archive stored all its parts as copies of the parts of an earlier key
+void CCompressedFile::find_links(vector<int>& v_stream_ids, vector<pair<int, bool>>& v_out_nodes, vector<pair<int, int>>& v_out_edges)
 {
-	cout << "Archive optimization\n";
-
-	function_size_graph = _function_size_graph;
-	function_data_graph = _function_data_graph;
-
-	if (tmp_archive)
-		delete tmp_archive;
+	v_out_nodes.clear();
+	v_out_edges.clear();
 
-	tmp_archive = new CArchive(true);
-
-	string tmp_name = archive_name + "_vcfshark_tmp";
-	rename(archive_name.c_str(), tmp_name.c_str());
-
-	if (!tmp_archive->Open(tmp_name) || !archive->Open(archive_name))
+	for (int i = 0; i < (int) no_keys; ++i)
 	{
-		std::cerr << "Cannot open archive\n";
-		exit(1);
-	}
-
-	const vector<string> meta_stream_names = {
-		"db_chrom_size", "db_pos_size", "db_id_size", "db_ref_size", "db_alt_size", "db_qual_size",
-		"idb_chrom_data", "idb_pos_data", "idb_id_data", "idb_ref_data", "idb_alt_data", "idb_qual_data",
-		"db_params", "db_meta", "db_header", "db_samples"
-	};
-
-	//int no_keys = (tmp_archive->GetNoStreams() - meta_stream_names.size()) / 2;
-	vector<uint8_t> vec;
-//	size_t meta;
+		bool is_node = true;
 
-	process_function_size(no_keys, v_size_nodes, v_size_edges);
-//	process_function_data(no_keys, v_data_nodes, v_data_edges);
-	process_function_data_eq_only(no_keys, v_data_nodes, v_data_edges);
-
-	// Store description of size and data
-	store_nodes("size_nodes", v_size_nodes);
-	store_edges("size_edges", v_size_edges, (int) v_size_nodes.size());
-	store_nodes("data_nodes", v_data_nodes);
-	store_edges("data_edges", v_data_edges, (int) v_data_nodes.size());
-
-	// Process key fields
-	for (uint32_t i = 0; i < no_keys; ++i)
-		if (v_size_nodes[i].second)
-			copy_stream("key_" + to_string(v_size_nodes[i].first) + "_size");
-		else
-		{
-			pair<int, int> pid;
-
-			for (auto& x : v_size_edges)
-				if (x.second == v_size_nodes[i].first)
-					pid = x;
-
-			link_stream("key_" + to_string(v_size_nodes[i].first) + "_size", "key_" + to_string(pid.first) + "_size");
-		}
-
-	for (uint32_t i = 0; i < no_keys; ++i)
-		if (v_data_nodes[i].second)
-			copy_stream("key_" + to_string(v_data_nodes[i].first) + "_data");
-		else
-		{
-			pair<int, int> pid;
-
-			for (auto& x : v_data_edges)
-				if (x.second == v_data_nodes[i].first)
-					pid = x;
-
-			link_stream("key_" + to_string(v_data_nodes[i].first) + "_data", "key_" + to_string(pid.first) + "_data");
-//			store_function("func_" + to_string(v_data_nodes[i].first) + "_data", pid.first, function_data_graph[pid]);
-		}
-
-	for (auto sn : meta_stream_names)
-		copy_stream(sn);
-
-	tmp_archive->Close();
-	archive->Close();
-	remove(tmp_name.c_str());
-	cout << endl;
-
-	return true;
-}
-
-// ******************************************************************************
-bool CCompressedFile::process_function_size(int no_keys,
-	vector<pair<int, bool>>& v_out_nodes, vector<pair<int, int>>& v_out_edges)
-{
-	vector<CGraphOptimizer::node_t> v_in_nodes;
-	vector<CGraphOptimizer::edge_t> v_in_edges;
-
-	unordered_map<uint64_t, pair<int, uint64_t>> node_hashes;
-	vector<uint8_t> v_data;
-	vector<uint8_t> v_data_src;
-	size_t metadata, metadata_src;
-
-	for (int i = 0; i < no_keys; ++i)
-	{
-		string ks = "key_" + to_string(i) + "_size";
-		auto iks = tmp_archive->GetStreamId(ks);
-
-		uint64_t h = 0;
-		uint64_t s_size = 0;
-
-		while (tmp_archive->GetPart(iks, v_data, metadata))
-		{
-			for (auto c : v_data)
-				h += ((uint64_t)c) * 127ull;
-			s_size += v_data.size();
-		}
-
-		auto p = node_hashes.find(h);
-		
-		if (p != node_hashes.end() && p->second.second == s_size)
-		{
-			auto iks_src = tmp_archive->GetStreamId("key_" + to_string(p->second.first) + "_size");
-			bool same = true;
-
-			tmp_archive->ResetStreamPartIterator(iks);
-			tmp_archive->ResetStreamPartIterator(iks_src);
-
-			while (tmp_archive->GetPart(iks, v_data, metadata) && tmp_archive->GetPart(iks_src, v_data_src, metadata_src) && same)
-				same = v_data == v_data_src && metadata == metadata_src;
-
-			if (same)
-			{
-				v_out_edges.emplace_back(p->second.first, i);
-				v_out_nodes.emplace_back(i, false);
-				continue;
-			}
-		}
-
-		node_hashes[h] = make_pair(i, s_size);
-		v_out_nodes.emplace_back(i, true);
-	}
-	
-	return true;
-}
-
-// ******************************************************************************
-bool CCompressedFile::process_function_data(int no_keys,
-	vector<pair<int, bool>>& v_out_nodes, vector<pair<int, int>>& v_out_edges)
-{
-	vector<CGraphOptimizer::node_t> v_in_nodes;
-	vector<CGraphOptimizer::edge_t> v_in_edges;
-
-	for (int i = 0; i < no_keys; ++i)
-	{
-		string ks = "key_" + to_string(i) + "_data";
-		auto iks = tmp_archive->GetStreamId(ks);
-
-		v_in_nodes.emplace_back(i, tmp_archive->GetCompressedSize(iks));
-	}
-
-	for (auto& edge : function_data_graph)
-	{
-		uint64_t cost = 0;
-		bool equality = true;
-
-		for (auto e : edge.second)
-		{
-			cost += e.first.size() + 1 + e.second.size() + 1;
-			equality &= e.first == e.second;
-		}
-
-		v_in_edges.emplace_back(edge.first.first, edge.first.second, equality, cost);
-	}
-
-	CGraphOptimizer graph_optimizer;
-
-	graph_optimizer.Optimize(v_in_nodes, v_in_edges, v_out_nodes, v_out_edges);
-
-	return true;
-}
-
-// ******************************************************************************
-bool CCompressedFile::process_function_data_eq_only(int no_keys,
-	vector<pair<int, bool>>& v_out_nodes, vector<pair<int, int>>& v_out_edges)
-{
-	vector<CGraphOptimizer::node_t> v_in_nodes;
-	vector<CGraphOptimizer::edge_t> v_in_edges;
-
-	unordered_map<uint64_t, pair<int, uint64_t>> node_hashes;
-	vector<uint8_t> v_data;
-	vector<uint8_t> v_data_src;
-	size_t metadata, metadata_src;
-
-	for (int i = 0; i < no_keys; ++i)
-	{
-		string ks = "key_" + to_string(i) + "_data";
-		auto iks = tmp_archive->GetStreamId(ks);
-
-		uint64_t h = 0;
-		uint64_t s_size = 0;
-
-		while (tmp_archive->GetPart(iks, v_data, metadata))
-		{
-			for (auto c : v_data)
-				h += ((uint64_t)c) * 127ull;
-			s_size += v_data.size();
-		}
-
-		auto p = node_hashes.find(h);
-
-		if (p != node_hashes.end() && p->second.second == s_size)
-		{
-			auto iks_src = tmp_archive->GetStreamId("key_" + to_string(p->second.first) + "_data");
-			bool same = true;
-
-			tmp_archive->ResetStreamPartIterator(iks);
-			tmp_archive->ResetStreamPartIterator(iks_src);
-
-			while (tmp_archive->GetPart(iks, v_data, metadata) && tmp_archive->GetPart(iks_src, v_data_src, metadata_src) && same)
-				same = v_data == v_data_src && metadata == metadata_src;
-
-			if (same)
+		for (int j = 0; j < i && is_node; ++j)
+			if (v_out_nodes[j].second && archive->IsLinked(v_stream_ids[i], v_stream_ids[j]))
 			{
-				v_out_edges.emplace_back(p->second.first, i);
-				v_out_nodes.emplace_back(i, false);
-				continue;
+				v_out_edges.emplace_back(j, i);
+				is_node = false;
 			}
-		}
 
-		node_hashes[h] = make_pair(i, s_size);
-		v_out_nodes.emplace_back(i, true);
+		v_out_nodes.emplace_back(i, is_node);
 	}
-
-	return true;
 }
 
 // ******************************************************************************
@@ -1391,30 +1818,6 @@ void CCompressedFile::load_edges(string stream_name, vector<pair<int, int>>& v_e
 	}
 }
 
-// ******************************************************************************
-void CCompressedFile::copy_stream(string stream_name)
-{
-	auto in_iks = tmp_archive->GetStreamId(stream_name);
-	auto out_iks = archive->RegisterStream(stream_name);
-	vector<uint8_t> vec;
-	size_t meta;
-
-	tmp_archive->ResetStreamPartIterator(in_iks);
-	while (tmp_archive->GetPart(in_iks, vec, meta))
-		archive->AddPart(out_iks, vec, meta);
-
-	archive->SetRawSize(out_iks, tmp_archive->GetRawSize(in_iks));
-}
-
-// ******************************************************************************
-void CCompressedFile::link_stream(string stream_name, string target_name)
-{
-	auto out_iks = archive->RegisterStream(stream_name);
-	auto target_iks = archive->GetStreamId(target_name);
-
-	archive->LinkStream(out_iks, stream_name, target_iks);
-}
-
 // ******************************************************************************
 void CCompressedFile::store_function(string stream_name, int src_id, function_data_item_t& func)
 {
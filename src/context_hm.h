@@ -128,6 +128,19 @@ public:
 		return ht_memory;
 	}
 
+	// Remove all models (table keeps its current allocation)
+	void clear()
+	{
+		for (size_t i = 0; i < allocated; ++i)
+			if (data[i].rcm)
+			{
+				delete data[i].rcm;
+				data[i].rcm = nullptr;
+			}
+
+		size = 0;
+	}
+
 	void debug_list(vector<CContextHM<MODEL>::item_t> &v_ctx)
 	{
 		v_ctx.clear();
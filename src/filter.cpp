@@ -0,0 +1,332 @@
+// *******************************************************************************************
+// This file is a part of VCFShark software distributed under GNU GPL 3 licence.
+// The homepage of the VCFShark project is https://github.com/refresh-bio/VCFShark
+//
+// Authors: Sebastian Deorowicz, Agnieszka Danek, Marek Kokot
+// Version: 1.1
+// Date   : 2021-02-18
+// *******************************************************************************************
+
+#include "filter.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+// ************************************************************************************
+// Removes white spaces from both ends
+static string strip(const string &s)
+{
+	size_t p = s.find_first_not_of(" \t\r\n");
+	if (p == string::npos)
+		return "";
+
+	return s.substr(p, s.find_last_not_of(" \t\r\n") - p + 1);
+}
+
+// ************************************************************************************
+bool CSiteFilter::Parse(const string &expr, const vector<key_desc> &_keys, const vector<string> &v_key_names)
+{
+	keys = _keys;
+	v_terms.clear();
+
+	size_t p = 0;
+
+	while (p <= expr.size())
+	{
+		size_t q = expr.find("||", p);
+		if (q == string::npos)
+			q = expr.size();
+
+		string term = expr.substr(p, q - p);
+		p = q + 2;
+
+		v_terms.emplace_back();
+
+		for (size_t r = 0; r <= term.size(); )
+		{
+			size_t s = term.find("&&", r);
+			if (s == string::npos)
+				s = term.size();
+
+			cond_t cond;
+
+			if (!parse_cond(strip(term.substr(r, s - r)), v_key_names, cond))
+			{
+				v_terms.clear();
+				return false;
+			}
+
+			v_terms.back().emplace_back(cond);
+			r = s + 2;
+		}
+	}
+
+	return true;
+}
+
+// ************************************************************************************
+bool CSiteFilter::parse_cond(string str, const vector<string> &v_key_names, cond_t &cond)
+{
+	size_t p_op = str.find_first_of("=!<>");
+	string name = strip(str.substr(0, p_op));
+	string value;
+
+	cond.key_no = -1;
+	cond.number = 0;
+
+	if (p_op == string::npos)
+		cond.op = op_t::present;
+	else
+	{
+		string op = str.substr(p_op, (p_op + 1 < str.size() && str[p_op + 1] == '=') ? 2 : 1);
+
+		if (op == "=" || op == "==")
+			cond.op = op_t::eq;
+		else if (op == "!=")
+			cond.op = op_t::ne;
+		else if (op == "<")
+			cond.op = op_t::lt;
+		else if (op == "<=")
+			cond.op = op_t::le;
+		else if (op == ">")
+			cond.op = op_t::gt;
+		else if (op == ">=")
+			cond.op = op_t::ge;
+		else
+		{
+			cerr << "Unknown operator in filter: " << str << endl;
+			return false;
+		}
+
+		value = strip(str.substr(p_op + op.size()));
+
+		if (value.size() >= 2 && (value.front() == '"' || value.front() == '\'') && value.back() == value.front())
+			value = value.substr(1, value.size() - 2);
+
+		if (value.empty())
+		{
+			cerr << "No value in filter: " << str << endl;
+			return false;
+		}
+	}
+
+	bool is_number = false;
+
+	if (!value.empty())
+	{
+		char *end;
+		cond.number = strtod(value.c_str(), &end);
+		is_number = *end == 0;
+	}
+	cond.text = value;
+
+	bool is_ordering = cond.op == op_t::lt || cond.op == op_t::le || cond.op == op_t::gt || cond.op == op_t::ge;
+
+	if (name == "CHROM")
+	{
+		cond.field = field_t::chrom;
+		if (cond.op != op_t::eq && cond.op != op_t::ne)
+		{
+			cerr << "CHROM can be compared by = and != only: " << str << endl;
+			return false;
+		}
+
+		return true;
+	}
+
+	if (name == "POS" || name == "QUAL")
+	{
+		cond.field = name == "POS" ? field_t::pos : field_t::qual;
+		if (cond.op == op_t::present || !is_number)
+		{
+			cerr << name << " must be compared to a number: " << str << endl;
+			return false;
+		}
+
+		return true;
+	}
+
+	key_type_t key_type;
+
+	if (name == "FILTER")
+	{
+		cond.field = field_t::filter;
+		key_type = key_type_t::flt;
+		if (cond.op != op_t::eq && cond.op != op_t::ne)
+		{
+			cerr << "FILTER can be compared by = and != only: " << str << endl;
+			return false;
+		}
+		name = value;
+	}
+	else if (name.compare(0, 5, "INFO/") == 0)
+	{
+		cond.field = field_t::info;
+		key_type = key_type_t::info;
+		name = name.substr(5);
+	}
+	else
+	{
+		cerr << "Unknown field in filter: " << str << endl;
+		return false;
+	}
+
+	for (size_t i = 0; i < keys.size() && cond.key_no < 0; ++i)
+		if (keys[i].keys_type == key_type && i < v_key_names.size() && v_key_names[i] == name)
+			cond.key_no = (int) i;
+
+	if (cond.key_no < 0)
+	{
+		cerr << "Unknown " << (key_type == key_type_t::flt ? "FILTER" : "INFO") << " key in filter: " << name << endl;
+		return false;
+	}
+
+	if (cond.field == field_t::info)
+	{
+		auto type = keys[cond.key_no].type;
+
+		if ((type == BCF_HT_FLAG && cond.op != op_t::present) ||
+			((type == BCF_HT_INT || type == BCF_HT_REAL) && cond.op != op_t::present && !is_number) ||
+			(type == BCF_HT_STR && is_ordering))
+		{
+			cerr << "Comparison does not match the type of INFO/" << name << ": " << str << endl;
+			return false;
+		}
+
+		// Values of Float keys are compared in float precision, so e.g. INFO/AF=0.1 matches 0.1
+		if (type == BCF_HT_REAL)
+			cond.number = (float) cond.number;
+	}
+
+	return true;
+}
+
+// ************************************************************************************
+vector<bool> CSiteFilter::GetKeys() const
+{
+	vector<bool> v_keys(keys.size(), false);
+
+	for (auto &term : v_terms)
+		for (auto &cond : term)
+			if (cond.key_no >= 0)
+				v_keys[cond.key_no] = true;
+
+	return v_keys;
+}
+
+// ************************************************************************************
+bool CSiteFilter::compare(double x, op_t op, double y) const
+{
+	switch (op)
+	{
+	case op_t::eq:
+		return x == y;
+	case op_t::ne:
+		return x != y;
+	case op_t::lt:
+		return x < y;
+	case op_t::le:
+		return x <= y;
+	case op_t::gt:
+		return x > y;
+	case op_t::ge:
+		return x >= y;
+	default:
+		return false;
+	}
+}
+
+// ************************************************************************************
+// Any of comma-separated values equal to the text
+bool CSiteFilter::match_text(const char *p, uint32_t size, const cond_t &cond) const
+{
+	for (uint32_t i = 0; i <= size; )
+	{
+		uint32_t j = i;
+		while (j < size && p[j] != ',' && p[j] != 0)
+			++j;
+
+		if (j - i == cond.text.size() && equal(p + i, p + j, cond.text.begin()))
+			return true;
+
+		if (j < size && p[j] == 0)
+			break;
+		i = j + 1;
+	}
+
+	return false;
+}
+
+// ************************************************************************************
+// Any value matches (eq); for ne the result is negated later
+bool CSiteFilter::match_info(const field_desc &field, const cond_t &cond) const
+{
+	op_t op = cond.op == op_t::ne ? op_t::eq : cond.op;
+
+	switch (keys[cond.key_no].type)
+	{
+	case BCF_HT_INT:
+		for (uint32_t i = 0; i < field.data_size; ++i)
+		{
+			int32_t x = ((const int32_t*) field.data)[i];
+
+			if (x == bcf_int32_vector_end)
+				break;
+			if (x != bcf_int32_missing && compare(x, op, cond.number))
+				return true;
+		}
+		return false;
+	case BCF_HT_REAL:
+		for (uint32_t i = 0; i < field.data_size; ++i)
+		{
+			float x = ((const float*) field.data)[i];
+
+			if (bcf_float_is_vector_end(x))
+				break;
+			if (!bcf_float_is_missing(x) && compare(x, op, cond.number))
+				return true;
+		}
+		return false;
+	case BCF_HT_STR:
+		return match_text(field.data, field.data_size, cond);
+	default:
+		return false;
+	}
+}
+
+// ************************************************************************************
+bool CSiteFilter::match_cond(const cond_t &cond, const variant_desc_t &desc, const field_desc &field) const
+{
+	switch (cond.field)
+	{
+	case field_t::chrom:
+		return (desc.chrom == cond.text) == (cond.op == op_t::eq);
+	case field_t::pos:
+		return compare((double) desc.pos, cond.op, cond.number);
+	case field_t::qual:
+	{
+		// Missing QUAL (.) does not match
+		char *end;
+		double qual = strtod(desc.qual.c_str(), &end);
+
+		if (desc.qual.empty() || *end != 0)
+			return cond.op == op_t::ne;
+
+		return compare(qual, cond.op, cond.number);
+	}
+	case field_t::filter:
+		return field.present == (cond.op == op_t::eq);
+	case field_t::info:
+		if (cond.op == op_t::present)
+			return field.present;
+		if (!field.present || !field.data)
+			return cond.op == op_t::ne;
+		return match_info(field, cond) != (cond.op == op_t::ne);
+	}
+
+	return false;
+}
+
+// EOF
@@ -0,0 +1,85 @@
+#pragma once
+// *******************************************************************************************
+// This file is a part of VCFShark software distributed under GNU GPL 3 licence.
+// The homepage of the VCFShark project is https://github.com/refresh-bio/VCFShark
+//
+// Authors: Sebastian Deorowicz, Agnieszka Danek, Marek Kokot
+// Version: 1.1
+// Date   : 2021-02-18
+// *******************************************************************************************
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "vcf.h"
+
+using namespace std;
+
+// ************************************************************************************
+// Site-level filter, e.g., QUAL>30 && INFO/AF>0.01 && FILTER=PASS
+// Conditions: CHROM, POS, QUAL, FILTER, INFO/<key> with =, ==, !=, <, <=, >, >= or INFO/<key> alone (key present);
+// && binds tighter than || (no parentheses). Values of INFO keys match if any of them does; missing values do not match
+// (except for !=, which is a negation of =).
+class CSiteFilter
+{
+	enum class field_t { chrom, pos, qual, filter, info };
+	enum class op_t { present, eq, ne, lt, le, gt, ge };
+
+	struct cond_t {
+		field_t field;
+		op_t op;
+		int key_no;			// position in keys (FILTER, INFO)
+		double number;
+		string text;
+	};
+
+	vector<vector<cond_t>> v_terms;		// alternative of conjunctions
+	vector<key_desc> keys;
+
+	bool parse_cond(string str, const vector<string> &v_key_names, cond_t &cond);
+	bool compare(double x, op_t op, double y) const;
+	bool match_text(const char *p, uint32_t size, const cond_t &cond) const;
+	bool match_info(const field_desc &field, const cond_t &cond) const;
+	bool match_cond(const cond_t &cond, const variant_desc_t &desc, const field_desc &field) const;
+
+public:
+	// v_key_names - names of keys (e.g., AF, PASS)
+	bool Parse(const string &expr, const vector<key_desc> &_keys, const vector<string> &v_key_names);
+
+	bool IsEmpty() const
+	{
+		return v_terms.empty();
+	}
+
+	// Keys (positions in keys) the filter needs
+	vector<bool> GetKeys() const;
+
+	// get_field(key_no) returns the field of a key of the variant
+	template<typename F> bool Match(const variant_desc_t &desc, F get_field) const
+	{
+		if (v_terms.empty())
+			return true;
+
+		static const field_desc no_field;
+
+		for (auto &term : v_terms)
+		{
+			bool ok = true;
+
+			for (auto &cond : term)
+				if (!match_cond(cond, desc, cond.key_no >= 0 ? get_field(cond.key_no) : no_field))
+				{
+					ok = false;
+					break;
+				}
+
+			if (ok)
+				return true;
+		}
+
+		return false;
+	}
+};
+
+// EOF
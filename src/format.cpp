@@ -95,7 +95,7 @@ pair<CFormatCompress::info_t, uint32_t> CFormatCompress::determine_info_type(vec
 // *****************************************************************************************
 template <unsigned SIZE> double CFormatCompress::entropy(vector<array<uint32_t, SIZE>> &vec)
 {
-	if (vec.size() == 1)
+	if (vec.size() <= 1)
 		return 0.0;
 
 	double r = 0;
@@ -16,6 +16,7 @@
 #include <unordered_map>
 #include <nmmintrin.h>
 #include <chrono>
+#include <limits>
 
 #include "params.h"
 #include "application.h"
@@ -24,6 +25,7 @@
 #include "sub_rc.h"
 #include "io.h"
 #include "utils.h"
+#include "trace.h"
 
 using namespace std;
 using namespace std::chrono;
@@ -32,9 +34,12 @@ CParams params;
 CApplication *app;
 
 bool parse_params(int argc, char **argv);
+bool parse_region(string region);
 void usage_main();
 void usage_compress();
 void usage_decompress();
+void usage_info();
+void usage_stats();
 
 // ******************************************************************************
 void usage_main()
@@ -46,6 +51,8 @@ void usage_main()
 	cerr << "  mode - one of:\n";
 	cerr << "    compress   - compress VCF file\n";
 	cerr << "    decompress - decompress VCF file\n";
+	cerr << "    info       - show sizes and coders of archive streams\n";
+	cerr << "    stats      - compute allele counts and frequencies of variants\n";
 }
 
 // ******************************************************************************
@@ -55,12 +62,22 @@ void usage_compress()
 	cerr << "Usage:\n";
 	cerr << "  vcfshark compress [options] <input_vcf> <archive>\n";
 	cerr << "Parameters:\n";
-	cerr << "  input_vcf - path to input VCF (or VCF.GZ or BCF) file\n";
-	cerr << "  archive - path to output compressed VCF file\n";
+	cerr << "  input_vcf - path to input VCF (or VCF.GZ or BCF) file (- for stdin)\n";
+	cerr << "  archive - path to output compressed VCF file (- for stdout)\n";
 	cerr << "Options:\n";
     cerr << "  -nl <value> - ignore rare variants; value is a limit of alternative alleles (default: " << params.neglect_limit << ")\n";
     cerr << "  -t <value>  - max. no. of compressing threads (default: " << params.no_threads << ")\n";
     cerr << "  -c <value>  - compression level [1, 2, 3] (default: " << params.vcs_compression_level << ")\n";
+    cerr << "  -ci <value> - checkpoint interval in variants for random access (default: " << params.checkpoint_interval << " = no checkpoints)\n";
+    cerr << "  -dio        - write archive with direct I/O, bypassing the page cache (Linux only)\n";
+    cerr << "  -gb <value> - code genotypes in blocks of given no. of samples, so they can be decoded separately (default: " << params.gt_block_size << " = single block)\n";
+    cerr << "  -gs         - store per-variant genotype summary (allele counts, heterozygotes, missing) for fast stats\n";
+    cerr << "  -qd <value> - no. of batches of variants queued between processing stages (default: " << params.queue_depth << ")\n";
+    cerr << "  -io <value> - no. of threads decompressing VCF.GZ/BCF input (default: " << params.no_io_threads << " = 1/4 of -t)\n";
+    cerr << "  -mm <value> - approx. memory limit in MB for buffers and queues (default: " << params.max_memory << " = no limit)\n";
+    cerr << "  -v          - verbose mode (show batch and part sizes, times of processing stages)\n";
+    cerr << "  -stats <file> - store timing statistics (stages, coder threads, streams) in JSON file\n";
+    cerr << "  -trace <file> - store activity of threads over time in Chrome trace-event JSON file\n";
 }
 
 // ******************************************************************************
@@ -70,12 +87,85 @@ void usage_decompress()
 	cerr << "Usage:\n";
 	cerr << "  vcfshark decompress [options] <archive> <output_vcf>\n";
 	cerr << "Parameters:\n";
-	cerr << "  archive   - path to input file with compressed VCF file\n";
-	cerr << "  output_vcf - path to output VCF file\n";
+	cerr << "  archive   - path to input file with compressed VCF file (- for stdin)\n";
+	cerr << "  output_vcf - path to output VCF file (- for stdout)\n";
     cerr << "Options:\n";
     cerr << "  -b - output BCF file (VCF file by default)\n";
     cerr << "  -c [0-9]   set level of compression of the output bcf (number from 0 to 9; 1 by default; 0 means no compression)\n";
 	cerr << "  -t <value>  - max. no. of compressing threads (default: " << params.no_threads << ")\n";
+	cerr << "  -r <region> - decompress only variants from region chrom[:from[-to]]\n";
+	cerr << "  -fields <list> - decompress only given keys, e.g., INFO/AF,FORMAT/GT (without FORMAT keys no samples are output)\n";
+	cerr << "  -drop-fields <list> - decompress all keys except given ones\n";
+	cerr << "  -s <list>   - output only given samples (comma-separated); only GT blocks containing them are decoded\n";
+	cerr << "  -S <file>   - as -s, sample names are read from file (one per line)\n";
+	cerr << "  -i <expr>   - output only variants matching expression, e.g., 'QUAL>30 && INFO/AF>0.01 && FILTER=PASS'\n";
+	cerr << "  -gt-matrix <format> - output genotypes as variant x haplotype matrix: 2bit, u8 or npy (sites and samples in <output>.sites, <output>.samples)\n";
+	cerr << "  -qd <value> - no. of batches of variants queued between processing stages (default: " << params.queue_depth << ")\n";
+	cerr << "  -io <value> - no. of threads compressing BCF output (default: " << params.no_io_threads << " = 1/4 of -t)\n";
+	cerr << "  -v          - verbose mode (show batch size, times of processing stages)\n";
+	cerr << "  -stats <file> - store timing statistics (stages, coder threads, streams) in JSON file\n";
+	cerr << "  -trace <file> - store activity of threads over time in Chrome trace-event JSON file\n";
+}
+
+// ******************************************************************************
+void usage_info()
+{
+	cerr << "VCFShark v. 1.1 (2021-02-18)\n";
+	cerr << "Usage:\n";
+	cerr << "  vcfshark info [options] <archive>\n";
+	cerr << "Parameters:\n";
+	cerr << "  archive - path to input file with compressed VCF file (- for stdin)\n";
+	cerr << "Options:\n";
+	cerr << "  -dt         - decode the archive and report decoding time of each key\n";
+	cerr << "  -t <value>  - max. no. of decompressing threads (default: " << params.no_threads << ")\n";
+}
+
+// ******************************************************************************
+void usage_stats()
+{
+	cerr << "VCFShark v. 1.1 (2021-02-18)\n";
+	cerr << "Usage:\n";
+	cerr << "  vcfshark stats [options] <archive> <output_tsv>\n";
+	cerr << "Parameters:\n";
+	cerr << "  archive - path to input file with compressed VCF file (- for stdin)\n";
+	cerr << "  output_tsv - path to output file with AN, AC, AF, missing rate and no. of heterozygotes (if stored, see -gs) of each variant (- for stdout)\n";
+	cerr << "Options:\n";
+	cerr << "  -t <value>  - max. no. of decompressing threads (default: " << params.no_threads << ")\n";
+	cerr << "  -r <region> - only variants from region chrom[:from[-to]]\n";
+}
+
+// ******************************************************************************
+bool parse_region(string region)
+{
+	auto p_colon = region.find_last_of(':');
+
+	params.region_from = 1;
+	params.region_to = numeric_limits<int64_t>::max();
+
+	if (p_colon == string::npos)
+	{
+		params.region_chrom = region;
+
+		return !region.empty();
+	}
+
+	params.region_chrom = region.substr(0, p_colon);
+
+	string range = region.substr(p_colon + 1);
+	range.erase(remove(range.begin(), range.end(), ','), range.end());
+
+	auto p_dash = range.find('-');
+
+	if (p_dash == string::npos)
+		params.region_from = atoll(range.c_str());
+	else
+	{
+		params.region_from = atoll(range.substr(0, p_dash).c_str());
+		if (p_dash + 1 < range.size())
+			params.region_to = atoll(range.substr(p_dash + 1).c_str());
+	}
+
+	return !params.region_chrom.empty() && params.region_from <= params.region_to;
 }
 
 // ******************************************************************************
@@ -92,6 +182,10 @@ bool parse_params(int argc, char **argv)
 		params.work_mode = work_mode_t::compress;
 	else if (string(argv[1]) == "decompress")
 		params.work_mode = work_mode_t::decompress;
+	else if (string(argv[1]) == "info")
+		params.work_mode = work_mode_t::info;
+	else if (string(argv[1]) == "stats")
+		params.work_mode = work_mode_t::stats;
 
 	// Compress
 	if (params.work_mode == work_mode_t::compress)
@@ -122,6 +216,56 @@ bool parse_params(int argc, char **argv)
 					params.vcs_compression_level = 3;
 				i += 2;
 			}
+			else if (string(argv[i]) == "-ci" && i + 1 < argc - 2)
+			{
+				params.checkpoint_interval = atoi(argv[i + 1]);
+				i += 2;
+			}
+			else if (string(argv[i]) == "-dio")
+			{
+				params.direct_io = true;
+				i++;
+			}
+			else if (string(argv[i]) == "-gb" && i + 1 < argc - 2)
+			{
+				params.gt_block_size = atoi(argv[i + 1]);
+				i += 2;
+			}
+			else if (string(argv[i]) == "-gs")
+			{
+				params.gt_summary = true;
+				i++;
+			}
+			else if (string(argv[i]) == "-qd" && i + 1 < argc - 2)
+			{
+				params.queue_depth = atoi(argv[i + 1]);
+				i += 2;
+			}
+			else if (string(argv[i]) == "-io" && i + 1 < argc - 2)
+			{
+				params.no_io_threads = atoi(argv[i + 1]);
+				i += 2;
+			}
+			else if (string(argv[i]) == "-v")
+			{
+				params.verbose = true;
+				i++;
+			}
+			else if (string(argv[i]) == "-mm" && i + 1 < argc - 2)
+			{
+				params.max_memory = atoi(argv[i + 1]);
+				i += 2;
+			}
+			else if (string(argv[i]) == "-stats" && i + 1 < argc - 2)
+			{
+				params.stats_file_name = argv[i + 1];
+				i += 2;
+			}
+			else if (string(argv[i]) == "-trace" && i + 1 < argc - 2)
+			{
+				params.trace_file_name = argv[i + 1];
+				i += 2;
+			}
         }
 
 		params.vcf_file_name = string(argv[i]);
@@ -148,6 +292,67 @@ bool parse_params(int argc, char **argv)
 				params.no_threads = atoi(argv[i + 1]);
 				i += 2;
 			}
+			else if (string(argv[i]) == "-r" && i + 1 < argc - 2)
+			{
+				if (!parse_region(argv[i + 1]))
+				{
+					cerr << "Incorrect region : " << argv[i + 1] << endl;
+					usage_decompress();
+					return false;
+				}
+				i += 2;
+			}
+			else if ((string(argv[i]) == "-fields" || string(argv[i]) == "-drop-fields") && i + 1 < argc - 2)
+			{
+				params.drop_fields = string(argv[i]) == "-drop-fields";
+				params.fields = argv[i + 1];
+				i += 2;
+			}
+			else if (string(argv[i]) == "-s" && i + 1 < argc - 2)
+			{
+				params.samples = argv[i + 1];
+				i += 2;
+			}
+			else if (string(argv[i]) == "-S" && i + 1 < argc - 2)
+			{
+				params.sample_file_name = argv[i + 1];
+				i += 2;
+			}
+			else if (string(argv[i]) == "-i" && i + 1 < argc - 2)
+			{
+				params.include = argv[i + 1];
+				i += 2;
+			}
+			else if (string(argv[i]) == "-gt-matrix" && i + 1 < argc - 2)
+			{
+				params.gt_matrix = argv[i + 1];
+				i += 2;
+			}
+			else if (string(argv[i]) == "-qd" && i + 1 < argc - 2)
+			{
+				params.queue_depth = atoi(argv[i + 1]);
+				i += 2;
+			}
+			else if (string(argv[i]) == "-io" && i + 1 < argc - 2)
+			{
+				params.no_io_threads = atoi(argv[i + 1]);
+				i += 2;
+			}
+			else if (string(argv[i]) == "-v")
+			{
+				params.verbose = true;
+				i++;
+			}
+			else if (string(argv[i]) == "-stats" && i + 1 < argc - 2)
+			{
+				params.stats_file_name = argv[i + 1];
+				i += 2;
+			}
+			else if (string(argv[i]) == "-trace" && i + 1 < argc - 2)
+			{
+				params.trace_file_name = argv[i + 1];
+				i += 2;
+			}
 			else if (string(argv[i]) == "-c")
             {
                 i++;
@@ -182,6 +387,74 @@ bool parse_params(int argc, char **argv)
 		params.db_file_name = string(argv[i]);
 		params.vcf_file_name = string(argv[i+1]);
 	}
+	else if (params.work_mode == work_mode_t::info)
+	{
+		if (argc < 3)
+		{
+			usage_info();
+			return false;
+		}
+
+		int i = 2;
+		while (i < argc - 1)
+		{
+			if (string(argv[i]) == "-dt")
+			{
+				params.info_decode_time = true;
+				i++;
+			}
+			else if (string(argv[i]) == "-t" && i + 1 < argc - 1)
+			{
+				params.no_threads = atoi(argv[i + 1]);
+				i += 2;
+			}
+			else
+			{
+				cerr << "Unknown option : " << argv[i] << endl;
+				usage_info();
+				return false;
+			}
+		}
+
+		params.db_file_name = string(argv[i]);
+	}
+	else if (params.work_mode == work_mode_t::stats)
+	{
+		if (argc < 4)
+		{
+			usage_stats();
+			return false;
+		}
+
+		int i = 2;
+		while (i < argc - 2)
+		{
+			if (string(argv[i]) == "-t" && i + 1 < argc - 2)
+			{
+				params.no_threads = atoi(argv[i + 1]);
+				i += 2;
+			}
+			else if (string(argv[i]) == "-r" && i + 1 < argc - 2)
+			{
+				if (!parse_region(argv[i + 1]))
+				{
+					cerr << "Incorrect region : " << argv[i + 1] << endl;
+					usage_stats();
+					return false;
+				}
+				i += 2;
+			}
+			else
+			{
+				cerr << "Unknown option : " << argv[i] << endl;
+				usage_stats();
+				return false;
+			}
+		}
+
+		params.db_file_name = string(argv[i]);
+		params.vcf_file_name = string(argv[i + 1]);
+	}
 	else
 	{
 		cerr << "Unknown mode : " << argv[2] << endl;
@@ -199,8 +472,16 @@ int main(int argc, char **argv)
 	if (!parse_params(argc, argv))
 		return 0;
 
+	// Output is written to stdout, so messages go to stderr
+	if ((params.work_mode == work_mode_t::compress && params.db_file_name == "-") ||
+		((params.work_mode == work_mode_t::decompress || params.work_mode == work_mode_t::stats) && params.vcf_file_name == "-"))
+		cout.rdbuf(cerr.rdbuf());
+
 	high_resolution_clock::time_point t1 = high_resolution_clock::now();
 
+	if (!params.trace_file_name.empty())
+		CTracer::Enable();
+
 	app = new CApplication(params);
 
 	bool result = true;
@@ -208,10 +489,19 @@ int main(int argc, char **argv)
 	if (params.work_mode == work_mode_t::compress)
 		result = app->CompressDB();
 	else if (params.work_mode == work_mode_t::decompress)
-		result = app->DecompressDB();
+		result = params.gt_matrix.empty() ? app->DecompressDB() : app->GTMatrixDB();
+	else if (params.work_mode == work_mode_t::info)
+		result = app->InfoDB();
+	else if (params.work_mode == work_mode_t::stats)
+		result = app->StatsDB();
+
+	auto v_stage_stats = app->GetStageStats();
 
 	delete app;
 
+	if (!params.trace_file_name.empty())
+		CTracer::Store(params.trace_file_name);
+
 	high_resolution_clock::time_point t2 = high_resolution_clock::now();
 
 	duration<double> time_span = duration_cast<duration<double>>(t2 - t1);
@@ -219,6 +509,10 @@ int main(int argc, char **argv)
 	if (!result)
 		std::cout << "Critical error!\n";
 
+	if (params.verbose)
+		for (auto& x : v_stage_stats)
+			std::cout << "Stage " << x.name << " ran " << x.time << " s and waited " << x.input_wait << " s for input and " << x.output_wait << " s for output\n";
+
 	std::cout << "Processing time: " << time_span.count() << " seconds.\n";
 
 	fflush(stdout);
@@ -13,7 +13,7 @@
 
 using namespace std;
 
-enum class work_mode_t {none, compress, decompress};
+enum class work_mode_t {none, compress, decompress, info, stats};
 enum class file_type {VCF, BCF};
 
 // ************************************************************************************
@@ -31,10 +31,30 @@ struct CParams
     char bcf_compression_level;
 	bool extra_variants;
 	uint32_t vcs_compression_level;
+	uint32_t checkpoint_interval;
+	bool direct_io;
+	bool info_decode_time;
+	uint32_t queue_depth;
+	bool verbose;
+	uint32_t max_memory;		// [MB], 0 - no limit
+	string stats_file_name;		// JSON with timing statistics, empty - none
+	string trace_file_name;		// Chrome trace-event JSON, empty - no tracing
+	string fields;				// comma-separated keys (e.g., INFO/AF,FORMAT/GT) to decompress, empty - all
+	bool drop_fields;			// decompress all keys except fields
+	string samples;				// comma-separated samples to decompress, empty - all (or from sample_file_name)
+	string include;				// site filter expression (e.g., QUAL>30 && INFO/AF>0.01), empty - all variants
+	string gt_matrix;			// format of GT matrix output (2bit, u8, npy), empty - VCF/BCF output
+	uint32_t gt_block_size;		// no. of samples in a GT block, 0 - single block
+	bool gt_summary;			// store per-variant genotype summary (allele counts, heterozygotes, missing)
+
+	string region_chrom;
+	int64_t region_from;
+	int64_t region_to;
 
 	// internal params
 	uint32_t neglect_limit;
 	uint32_t no_threads;
+	uint32_t no_io_threads;		// 0 - derived from no_threads
 
 	CParams()
 	{
@@ -46,8 +66,21 @@ struct CParams
         bcf_compression_level = '1';
 		extra_variants = false;
 		no_threads = 8;
+		no_io_threads = 0;
 
 		vcs_compression_level = 3;
+		checkpoint_interval = 0;
+		direct_io = false;
+		info_decode_time = false;
+		queue_depth = 4;
+		verbose = false;
+		max_memory = 0;
+		drop_fields = false;
+		gt_block_size = 0;
+		gt_summary = false;
+
+		region_from = 1;
+		region_to = 0;
 
 		// internal params
 		neglect_limit = 10;
@@ -73,6 +73,7 @@ bool CPBWT::StartForward(const size_t _no_items, const size_t _neglect_limit)
 
 	iota(v_perm_cur.begin(), v_perm_cur.end(), 0);
 	v_perm_prev = v_perm_cur;
+	v_removed_ids.clear();
 	
 	return true;
 }
@@ -87,6 +88,7 @@ bool CPBWT::StartReverse(const size_t _no_items, const size_t _neglect_limit)
 
 	iota(v_perm_cur.begin(), v_perm_cur.end(), 0);
 	v_perm_prev = v_perm_cur;
+	v_removed_ids.clear();
 	
 	v_tmp.clear();
 	v_tmp.resize(no_items, 0u);
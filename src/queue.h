@@ -19,6 +19,7 @@
 #include <vector>
 #include <map>
 #include <functional>
+#include <chrono>
 
 using namespace std;
 
@@ -106,16 +107,29 @@ template<typename T> class CRegisteringQueue
 	bool is_completed;
 	int n_producers;
 	uint32_t n_elements;
+	double pop_wait_time;
 
 	mutable mutex mtx;								// The mutex to synchronise on
 	condition_variable cv_queue_empty;
 
+	// *****************************************************************************************
+	//
+	void wait_for_data(unique_lock<mutex> &lck)
+	{
+		if (!q.empty() || !n_producers)
+			return;
+
+		auto t_start = chrono::steady_clock::now();
+		cv_queue_empty.wait(lck, [this]{return !this->q.empty() || !this->n_producers;}); 
+		pop_wait_time += chrono::duration<double>(chrono::steady_clock::now() - t_start).count();
+	}
+
 public:
 	typename queue_t::iterator q_it;
 
 	// *****************************************************************************************
 	//
-	CRegisteringQueue(int _n_producers)
+	CRegisteringQueue(int _n_producers) : pop_wait_time(0)
 	{
 		Restart(_n_producers);
 	};
@@ -213,7 +227,7 @@ public:
 	bool Pop(T &data)
 	{
 		unique_lock<mutex> lck(mtx);
-		cv_queue_empty.wait(lck, [this]{return !this->q.empty() || !this->n_producers;}); 
+		wait_for_data(lck);
 
 		if(n_elements == 0)
 			return false;
@@ -234,7 +248,7 @@ public:
 	bool PopWithHint(T &data, const std::function<bool(S &item)> fo)
 	{
 		unique_lock<mutex> lck(mtx);
-		cv_queue_empty.wait(lck, [this]{return !this->q.empty() || !this->n_producers;}); 
+		wait_for_data(lck);
 
 		if(n_elements == 0)
 			return false;
@@ -265,6 +279,112 @@ public:
 	{
 		return n_elements;
 	}
+
+	// *****************************************************************************************
+	// Total time [s] consumers waited for data
+	double GetPopWaitTime()
+	{
+		lock_guard<mutex> lck(mtx);
+
+		return pop_wait_time;
+	}
+};
+
+// ************************************************************************************
+// Multithreading queue of limited capacity:
+//   * Push waits while the queue is full and Pop waits while it is empty (until MarkCompleted)
+//   * Time spent on waiting is accumulated, so stalls of pipeline stages can be reported
+template<typename T> class CBoundedQueue
+{
+	queue<T> q;
+	size_t capacity;
+	bool is_completed;
+
+	double push_wait_time;
+	double pop_wait_time;
+
+	mutable mutex mtx;
+	condition_variable cv_not_empty;
+	condition_variable cv_not_full;
+
+public:
+	// *****************************************************************************************
+	//
+	CBoundedQueue(size_t _capacity) : capacity(_capacity ? _capacity : 1), is_completed(false), push_wait_time(0), pop_wait_time(0)
+	{};
+
+	// *****************************************************************************************
+	//
+	~CBoundedQueue()
+	{};
+
+	// *****************************************************************************************
+	//
+	void MarkCompleted()
+	{
+		lock_guard<mutex> lck(mtx);
+		is_completed = true;
+
+		cv_not_empty.notify_all();
+	}
+
+	// *****************************************************************************************
+	//
+	void Push(T data)
+	{
+		unique_lock<mutex> lck(mtx);
+
+		if (q.size() >= capacity)
+		{
+			auto t1 = chrono::steady_clock::now();
+			cv_not_full.wait(lck, [this] {return q.size() < capacity; });
+			push_wait_time += chrono::duration<double>(chrono::steady_clock::now() - t1).count();
+		}
+
+		q.push(move(data));
+
+		cv_not_empty.notify_one();
+	}
+
+	// *****************************************************************************************
+	//
+	bool Pop(T &data)
+	{
+		unique_lock<mutex> lck(mtx);
+
+		if (q.empty() && !is_completed)
+		{
+			auto t1 = chrono::steady_clock::now();
+			cv_not_empty.wait(lck, [this] {return !q.empty() || is_completed; });
+			pop_wait_time += chrono::duration<double>(chrono::steady_clock::now() - t1).count();
+		}
+
+		if (q.empty())
+			return false;
+
+		data = move(q.front());
+		q.pop();
+
+		cv_not_full.notify_one();
+
+		return true;
+	}
+
+	// *****************************************************************************************
+	// Total time [s] spent by producers on waiting for a free slot
+	double GetPushWaitTime()
+	{
+		lock_guard<mutex> lck(mtx);
+		return push_wait_time;
+	}
+
+	// *****************************************************************************************
+	// Total time [s] spent by consumers on waiting for data
+	double GetPopWaitTime()
+	{
+		lock_guard<mutex> lck(mtx);
+		return pop_wait_time;
+	}
 };
 
 // EOF
@@ -32,6 +32,19 @@ CTextPreprocessing::CTextPreprocessing()
 	word_symbol['/'] = true;
 }
 
+// ************************************************************************************
+// Forget the dictionary built so far
+void CTextPreprocessing::Reset()
+{
+	m_dict.clear();
+	t_dict.clear();
+	v_new_words.clear();
+	v_dict.clear();
+	v_tokens.clear();
+
+	dict_id = 0;
+}
+
 // ************************************************************************************
 CTextPreprocessing::~CTextPreprocessing()
 {
@@ -313,6 +313,7 @@ public:
 	CTextPreprocessing();
 	~CTextPreprocessing();
 
+	void Reset();
 	void EncodeText(vector<uint8_t>& v_input, vector<uint8_t>& v_output);
 	void DecodeText(vector<uint8_t>& v_input, vector<uint8_t>& v_output);
 };
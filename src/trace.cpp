@@ -0,0 +1,126 @@
+// *******************************************************************************************
+// This file is a part of VCFShark software distributed under GNU GPL 3 licence.
+// The homepage of the VCFShark project is https://github.com/refresh-bio/VCFShark
+//
+// Authors: Sebastian Deorowicz, Agnieszka Danek, Marek Kokot
+// Version: 1.1
+// Date   : 2021-02-18
+// *******************************************************************************************
+
+#include "trace.h"
+
+#include <cstdio>
+#include <iostream>
+
+atomic<bool> CTracer::enabled(false);
+chrono::steady_clock::time_point CTracer::t_origin;
+mutex CTracer::mtx;
+vector<unique_ptr<CTracer::thread_buffer_t>> CTracer::v_buffers;
+thread_local CTracer::thread_buffer_t* CTracer::p_buffer = nullptr;
+
+// ******************************************************************************
+void CTracer::Enable()
+{
+	lock_guard<mutex> lck(mtx);
+
+	t_origin = chrono::steady_clock::now();
+	enabled = true;
+}
+
+// ******************************************************************************
+// Buffer of the current thread is registered at its first event
+CTracer::thread_buffer_t* CTracer::get_buffer()
+{
+	if (p_buffer)
+		return p_buffer;
+
+	lock_guard<mutex> lck(mtx);
+
+	v_buffers.emplace_back(new thread_buffer_t);
+	p_buffer = v_buffers.back().get();
+	p_buffer->tid = (uint32_t) v_buffers.size();
+	p_buffer->no_events = 0;
+
+	return p_buffer;
+}
+
+// ******************************************************************************
+void CTracer::SetThreadName(const string& name)
+{
+	if (!IsEnabled())
+		return;
+
+	get_buffer()->thread_name = name;
+}
+
+// ******************************************************************************
+// Only the owning thread writes to its buffer, which grows up to ring_size events
+void CTracer::Record(const char* name, int64_t start, int64_t duration, const char* arg_name, int64_t arg)
+{
+	auto buffer = get_buffer();
+	uint64_t n = buffer->no_events.load(memory_order_relaxed);
+	event_t event{ name, arg_name, arg, start, duration };
+
+	if (n < ring_size)
+		buffer->v_events.emplace_back(event);
+	else
+		buffer->v_events[n % ring_size] = event;
+
+	buffer->no_events.store(n + 1, memory_order_release);
+}
+
+// ******************************************************************************
+bool CTracer::Store(const string& file_name)
+{
+	lock_guard<mutex> lck(mtx);
+
+	FILE* f = fopen(file_name.c_str(), "w");
+
+	if (!f)
+	{
+		cerr << "Cannot open: " << file_name << endl;
+		return false;
+	}
+
+	bool first = true;
+	uint64_t no_lost = 0;
+
+	fprintf(f, "{\"traceEvents\": [\n");
+
+	for (auto& buffer : v_buffers)
+	{
+		if (!buffer->thread_name.empty())
+		{
+			fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": \"%s\"}}",
+				first ? "" : ",\n", buffer->tid, buffer->thread_name.c_str());
+			first = false;
+		}
+
+		uint64_t n = buffer->no_events.load(memory_order_acquire);
+		uint64_t from = n > ring_size ? n - ring_size : 0;
+		no_lost += from;
+
+		// Oldest events first
+		for (uint64_t i = from; i < n; ++i)
+		{
+			auto& e = buffer->v_events[i % ring_size];
+
+			fprintf(f, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f",
+				first ? "" : ",\n", e.name, buffer->tid, e.start / 1000.0, e.duration / 1000.0);
+			if (e.arg_name)
+				fprintf(f, ", \"args\": {\"%s\": %lld}", e.arg_name, (long long) e.arg);
+			fprintf(f, "}");
+			first = false;
+		}
+	}
+
+	fprintf(f, "\n], \"displayTimeUnit\": \"ms\"}\n");
+	fclose(f);
+
+	if (no_lost)
+		cerr << "Trace: " << no_lost << " oldest events were overwritten\n";
+
+	return true;
+}
+
+// EOF
@@ -0,0 +1,105 @@
+#pragma once
+// *******************************************************************************************
+// This file is a part of VCFShark software distributed under GNU GPL 3 licence.
+// The homepage of the VCFShark project is https://github.com/refresh-bio/VCFShark
+//
+// Authors: Sebastian Deorowicz, Agnieszka Danek, Marek Kokot
+// Version: 1.1
+// Date   : 2021-02-18
+// *******************************************************************************************
+
+// Event tracer producing Chrome trace-event JSON (chrome://tracing, Perfetto).
+// Each thread records events to own ring buffer without locking (the oldest events are overwritten
+// when the buffer is full). When the tracer is not enabled, an event costs a single atomic load.
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// *****************************************************************************************
+//
+class CTracer
+{
+	struct event_t {
+		const char* name;
+		const char* arg_name;		// nullptr if no argument
+		int64_t arg;
+		int64_t start;				// [ns] since Enable
+		int64_t duration;			// [ns]
+	};
+
+	struct thread_buffer_t {
+		uint32_t tid;
+		string thread_name;
+		vector<event_t> v_events;
+		atomic<uint64_t> no_events;		// no. of events recorded (also overwritten ones)
+	};
+
+	static const size_t ring_size = 1u << 16;
+
+	static atomic<bool> enabled;
+	static chrono::steady_clock::time_point t_origin;
+	static mutex mtx;
+	static vector<unique_ptr<thread_buffer_t>> v_buffers;
+	static thread_local thread_buffer_t* p_buffer;
+
+	static thread_buffer_t* get_buffer();
+
+public:
+	static void Enable();
+
+	static bool IsEnabled()
+	{
+		return enabled.load(memory_order_relaxed);
+	}
+
+	// [ns] since Enable
+	static int64_t Now()
+	{
+		return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - t_origin).count();
+	}
+
+	static void SetThreadName(const string& name);
+
+	// Names must be string literals (only pointers are kept)
+	static void Record(const char* name, int64_t start, int64_t duration, const char* arg_name = nullptr, int64_t arg = 0);
+
+	// Must be called when no events are recorded, i.e., when traced threads are finished
+	static bool Store(const string& file_name);
+};
+
+// *****************************************************************************************
+// Records an event lasting as long as the object (or until Stop)
+class CTraceScope
+{
+	const char* name;
+	const char* arg_name;
+	int64_t arg;
+	int64_t start;
+
+public:
+	CTraceScope(const char* _name, const char* _arg_name = nullptr, int64_t _arg = 0) :
+		name(_name), arg_name(_arg_name), arg(_arg), start(CTracer::IsEnabled() ? CTracer::Now() : -1)
+	{}
+
+	~CTraceScope()
+	{
+		Stop();
+	}
+
+	// End the event before the end of the scope
+	void Stop()
+	{
+		if (start >= 0)
+			CTracer::Record(name, start, CTracer::Now() - start, arg_name, arg);
+		start = -1;
+	}
+};
+
+// EOF
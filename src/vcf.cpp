@@ -11,6 +11,36 @@
 #include <iostream>
 #include <cassert>
 
+// ************************************************************************************
+void CParseBuffers::Release()
+{
+    if (dst_int)
+    {
+        free(dst_int);
+        dst_int = nullptr;
+    }
+
+    if (dst_real)
+    {
+        free(dst_real);
+        dst_real = nullptr;
+    }
+
+    if (dst_str)
+    {
+        free(dst_str);
+        dst_str = nullptr;
+    }
+
+    if (dst_flag)
+    {
+        free(dst_flag);
+        dst_flag = nullptr;
+    }
+
+    ndst_int = ndst_real = ndst_str = ndst_flag = 0;
+}
+
 // ************************************************************************************
 CVCF::CVCF()
 {
@@ -20,6 +50,8 @@ CVCF::CVCF()
     curr_alt_number = 1;
     ploidy = 0; //default
     first_variant = true;
+    no_io_threads = 0;
+    io_pool = {nullptr, 0};
 }
 
 // ************************************************************************************
@@ -38,6 +70,7 @@ bool CVCF::OpenForReading(string & file_name)
         return false;
     hts_set_opt(vcf_file, HTS_OPT_CACHE_SIZE, 32 << 20);
     hts_set_opt(vcf_file, HTS_OPT_BLOCK_SIZE, 32 << 20);
+    attach_io_pool();
     if(vcf_hdr)
         bcf_hdr_destroy(vcf_hdr);
     vcf_hdr = bcf_hdr_read(vcf_file);
@@ -61,10 +94,37 @@ bool CVCF::OpenForWriting(string & file_name, file_type type, char bcf_compressi
         return false;
     hts_set_opt(vcf_file, HTS_OPT_CACHE_SIZE, 32 << 20);
     hts_set_opt(vcf_file, HTS_OPT_BLOCK_SIZE, 32 << 20);
+    attach_io_pool();
     rec = bcf_init();
     return true;
 }
 
+// ************************************************************************************
+void CVCF::SetNoIOThreads(int _no_io_threads)
+{
+    no_io_threads = _no_io_threads;
+}
+
+// ************************************************************************************
+void CVCF::attach_io_pool()
+{
+    if(no_io_threads <= 0)
+        return;
+
+    if(!io_pool.pool)
+    {
+        io_pool.pool = hts_tpool_init(no_io_threads);
+        if(!io_pool.pool)
+        {
+            cerr << "Cannot create thread pool for VCF file I/O\n";
+            return;
+        }
+    }
+
+    if(hts_set_thread_pool(vcf_file, &io_pool) < 0)
+        cerr << "Cannot attach thread pool to VCF file\n";
+}
+
 // ************************************************************************************
 bool CVCF::Close()
 {
@@ -78,6 +138,13 @@ bool CVCF::Close()
         vcf_file = nullptr;
     }
 
+    // Pool may be destroyed only when no file uses it
+    if(io_pool.pool)
+    {
+        hts_tpool_destroy(io_pool.pool);
+        io_pool.pool = nullptr;
+    }
+
     if(vcf_hdr)
     {
         bcf_hdr_destroy(vcf_hdr);
@@ -91,29 +158,7 @@ bool CVCF::Close()
         rec = nullptr;
     }
 
-    if (dst_int)
-    {
-        free(dst_int);
-        dst_int = nullptr;
-    }
-
-    if (dst_real)
-    {
-        free(dst_real);
-        dst_real = nullptr;
-    }
-
-    if (dst_str)
-    {
-        free(dst_str);
-        dst_str = nullptr;
-    }
-
-    if (dst_flag)
-    {
-        free(dst_flag);
-        dst_flag = nullptr;
-    }
+    parse_buffers.Release();
 
     return true;
 }
@@ -267,10 +312,51 @@ bool CVCF::GetFilterInfoFormatKeys(int &no_flt_keys, int &no_info_keys, int &no_
     return true;
 }
 
+// ************************************************************************************
+string CVCF::GetKeyName(key_desc &key)
+{
+    if(!vcf_hdr || (int) key.key_id >= vcf_hdr->n[BCF_DT_ID])
+        return "";
+
+    return string(vcf_hdr->id[BCF_DT_ID][key.key_id].key);
+}
+
+// ************************************************************************************
+bool CVCF::RemoveKey(key_desc &key)
+{
+    string name = GetKeyName(key);
+
+    if (name.empty())
+        return false;
+
+    int type = key.keys_type == key_type_t::flt ? BCF_HL_FLT : key.keys_type == key_type_t::info ? BCF_HL_INFO : BCF_HL_FMT;
+
+    bcf_hdr_remove(vcf_hdr, type, name.c_str());
+
+    return bcf_hdr_sync(vcf_hdr) == 0;
+}
+
 // ************************************************************************************
 bool CVCF::GetVariantFromRec(bcf1_t* rec, variant_desc_t& desc, vector<field_desc>& fields,
     std::vector<int>& FilterIdToFieldId, std::vector<int>& InfoIdToFieldId, std::vector<int>& FormatIdToFieldId)
 {
+    if (!GetVariantFromRec(rec, desc, fields, FilterIdToFieldId, InfoIdToFieldId, FormatIdToFieldId, parse_buffers))
+        return false;
+
+    if (first_variant)
+        first_variant = false;
+
+    return true;
+}
+
+// ************************************************************************************
+bool CVCF::GetVariantFromRec(bcf1_t* rec, variant_desc_t& desc, vector<field_desc>& fields,
+    std::vector<int>& FilterIdToFieldId, std::vector<int>& InfoIdToFieldId, std::vector<int>& FormatIdToFieldId, CParseBuffers& buffers, CArena* arena)
+{
+    auto alloc = [arena](size_t size) {
+        return arena ? arena->Allocate(size) : new char[size];
+    };
+
     desc.chrom.clear();
 
     if (!vcf_file || !vcf_hdr)
@@ -344,16 +430,16 @@ bool CVCF::GetVariantFromRec(bcf1_t* rec, variant_desc_t& desc, vector<field_des
             switch (type)
             {
             case BCF_HT_INT:
-                curr_size = bcf_get_info_values(vcf_hdr, rec, vcf_hdr->id[BCF_DT_ID][z->key].key, &dst_int, &ndst_int, type);
+                curr_size = bcf_get_info_values(vcf_hdr, rec, vcf_hdr->id[BCF_DT_ID][z->key].key, &buffers.dst_int, &buffers.ndst_int, type);
                 break;
             case BCF_HT_REAL:
-                curr_size = bcf_get_info_values(vcf_hdr, rec, vcf_hdr->id[BCF_DT_ID][z->key].key, &dst_real, &ndst_real, type);
+                curr_size = bcf_get_info_values(vcf_hdr, rec, vcf_hdr->id[BCF_DT_ID][z->key].key, &buffers.dst_real, &buffers.ndst_real, type);
                 break;
             case BCF_HT_STR:
-                curr_size = bcf_get_info_values(vcf_hdr, rec, vcf_hdr->id[BCF_DT_ID][z->key].key, &dst_str, &ndst_str, type);
+                curr_size = bcf_get_info_values(vcf_hdr, rec, vcf_hdr->id[BCF_DT_ID][z->key].key, &buffers.dst_str, &buffers.ndst_str, type);
                 break;
             case BCF_HT_FLAG:
-                curr_size = bcf_get_info_values(vcf_hdr, rec, vcf_hdr->id[BCF_DT_ID][z->key].key, &dst_flag, &ndst_flag, type);
+                curr_size = bcf_get_info_values(vcf_hdr, rec, vcf_hdr->id[BCF_DT_ID][z->key].key, &buffers.dst_flag, &buffers.ndst_flag, type);
                 break;
             }
 
@@ -362,18 +448,18 @@ bool CVCF::GetVariantFromRec(bcf1_t* rec, variant_desc_t& desc, vector<field_des
                 switch (type)
                 {
                 case BCF_HT_INT:
-                    cur_field.data = new char[curr_size * 4];
-                    memcpy(cur_field.data, (char*)dst_int, curr_size * 4);
+                    cur_field.data = alloc(curr_size * 4);
+                    memcpy(cur_field.data, (char*)buffers.dst_int, curr_size * 4);
                     cur_field.data_size = (uint32_t)curr_size;
                     break;
                 case BCF_HT_REAL:
-                    cur_field.data = new char[curr_size * 4];
-                    memcpy(cur_field.data, (char*)dst_real, curr_size * 4);
+                    cur_field.data = alloc(curr_size * 4);
+                    memcpy(cur_field.data, (char*)buffers.dst_real, curr_size * 4);
                     cur_field.data_size = curr_size;
                     break;
                 case BCF_HT_STR:
-                    cur_field.data = new char[curr_size];
-                    memcpy(cur_field.data, (char*)dst_str, curr_size);
+                    cur_field.data = alloc(curr_size);
+                    memcpy(cur_field.data, (char*)buffers.dst_str, curr_size);
                     cur_field.data_size = curr_size;
                     break;
                 case BCF_HT_FLAG:
@@ -413,23 +499,23 @@ bool CVCF::GetVariantFromRec(bcf1_t* rec, variant_desc_t& desc, vector<field_des
                 auto vcf_hdr_key = vcf_hdr->id[BCF_DT_ID][fmt[i].id].key;
                 if (strcmp(vcf_hdr_key, "GT") == 0)
                 {
-                    curr_size = bcf_get_format_values(vcf_hdr, rec, "GT", &dst_int, &ndst_int, BCF_HT_INT);
+                    curr_size = bcf_get_format_values(vcf_hdr, rec, "GT", &buffers.dst_int, &buffers.ndst_int, BCF_HT_INT);
                 }
                 else
                 {
                     switch (bcf_ht_type)
                     {
                     case BCF_HT_INT:
-                        curr_size = bcf_get_format_values(vcf_hdr, rec, vcf_hdr_key, &dst_int, &ndst_int, bcf_ht_type);
+                        curr_size = bcf_get_format_values(vcf_hdr, rec, vcf_hdr_key, &buffers.dst_int, &buffers.ndst_int, bcf_ht_type);
                         break;
                     case BCF_HT_REAL:
-                        curr_size = bcf_get_format_values(vcf_hdr, rec, vcf_hdr_key, &dst_real, &ndst_real, bcf_ht_type);
+                        curr_size = bcf_get_format_values(vcf_hdr, rec, vcf_hdr_key, &buffers.dst_real, &buffers.ndst_real, bcf_ht_type);
                         break;
                     case BCF_HT_STR:
-                        curr_size = bcf_get_format_values(vcf_hdr, rec, vcf_hdr_key, &dst_str, &ndst_str, bcf_ht_type);
+                        curr_size = bcf_get_format_values(vcf_hdr, rec, vcf_hdr_key, &buffers.dst_str, &buffers.ndst_str, bcf_ht_type);
                         break;
                     case BCF_HT_FLAG:
-                        curr_size = bcf_get_format_values(vcf_hdr, rec, vcf_hdr_key, &dst_flag, &ndst_flag, bcf_ht_type);
+                        curr_size = bcf_get_format_values(vcf_hdr, rec, vcf_hdr_key, &buffers.dst_flag, &buffers.ndst_flag, bcf_ht_type);
                         break;
                     }
                 }
@@ -440,19 +526,19 @@ bool CVCF::GetVariantFromRec(bcf1_t* rec, variant_desc_t& desc, vector<field_des
 
                     if (bcf_ht_type == BCF_HT_INT || bcf_ht_type == BCF_HT_REAL || strcmp(vcf_hdr_key, "GT") == 0)
                     {
-                        cur_field.data = new char[curr_size * 4];
+                        cur_field.data = alloc(curr_size * 4);
 
                         if (bcf_ht_type == BCF_HT_INT)
-                            memcpy(cur_field.data, dst_int, curr_size * 4);
+                            memcpy(cur_field.data, buffers.dst_int, curr_size * 4);
                         else if (bcf_ht_type == BCF_HT_REAL)
-                            memcpy(cur_field.data, dst_real, curr_size * 4);
+                            memcpy(cur_field.data, buffers.dst_real, curr_size * 4);
                         else if (bcf_ht_type == BCF_HT_STR)
-                            memcpy(cur_field.data, dst_int, curr_size * 4);  // GTs are ints!
+                            memcpy(cur_field.data, buffers.dst_int, curr_size * 4);  // GTs are ints!
                     }
                     else if (bcf_ht_type == BCF_HT_STR)
                     {
-                        cur_field.data = new char[curr_size];
-                        memcpy(cur_field.data, dst_str, curr_size);
+                        cur_field.data = alloc(curr_size);
+                        memcpy(cur_field.data, buffers.dst_str, curr_size);
                     }
                     else
                         assert(0);
@@ -461,9 +547,6 @@ bool CVCF::GetVariantFromRec(bcf1_t* rec, variant_desc_t& desc, vector<field_des
         }
     }
 
-    if (first_variant)
-        first_variant = false;
-
     return true;
 }
 
@@ -540,6 +623,21 @@ bool CVCF::SetVariantToRec(bcf1_t* rec, variant_desc_t& desc, vector<field_desc>
     return true;
 }
 
+// ************************************************************************************
+bool CVCF::AddContig(const string &chrom)
+{
+    if (!vcf_hdr)
+        return false;
+
+    if (bcf_hdr_name2id(vcf_hdr, chrom.c_str()) >= 0)
+        return true;
+
+    if (bcf_hdr_printf(vcf_hdr, "##contig=<ID=%s>", chrom.c_str()) < 0)
+        return false;
+
+    return bcf_hdr_sync(vcf_hdr) == 0;
+}
+
 // ************************************************************************************
 bool CVCF::SetVariant(variant_desc_t &desc, vector<field_desc> &fields, vector<key_desc> &keys)
 {
@@ -9,11 +9,13 @@
 // *******************************************************************************************
 
 #include "params.h"
+#include "arena.h"
 #include <vector>
 #include <string>
 #include <unordered_map>
 #include <htslib/hts.h>
 #include <htslib/vcf.h>
+#include <htslib/thread_pool.h>
 #include <iostream>
 
 using namespace std;
@@ -75,6 +77,34 @@ typedef struct variant_desc_tag {
 	}
 } variant_desc_t;
 
+// ************************************************************************************
+// Buffers for values extracted by htslib from a record; each parsing thread needs own buffers
+class CParseBuffers
+{
+	friend class CVCF;
+
+    void *dst_int = nullptr;
+    void *dst_real = nullptr;
+    void *dst_str = nullptr;
+    void *dst_flag = nullptr;
+    int  ndst_int = 0;
+    int  ndst_real = 0;
+    int  ndst_str = 0;
+    int  ndst_flag = 0;
+
+public:
+	CParseBuffers() = default;
+	CParseBuffers(const CParseBuffers&) = delete;
+	CParseBuffers& operator=(const CParseBuffers&) = delete;
+
+	~CParseBuffers()
+	{
+		Release();
+	}
+
+	void Release();
+};
+
 // ************************************************************************************
 class CVCF
 {
@@ -87,14 +117,13 @@ class CVCF
     bool first_variant;
     int curr_alt_number; //allele from ALT field (from 1)
 
-    void *dst_int = nullptr;
-    void *dst_real = nullptr;
-    void *dst_str = nullptr;
-    void *dst_flag = nullptr;
-    int  ndst_int = 0;
-    int  ndst_real = 0;
-    int  ndst_str = 0;
-    int  ndst_flag = 0;
+    CParseBuffers parse_buffers;
+
+    // BGZF (de)compression of the input or output file is done by a pool of htslib threads
+    int no_io_threads;
+    htsThreadPool io_pool;
+
+    void attach_io_pool();
     
 public:
     bcf_hdr_t *vcf_hdr;
@@ -111,6 +140,9 @@ public:
 	// Close VCF file
 	bool Close();
 
+	// Set no. of htslib threads for BGZF (de)compression (0 - none); must be set before Open
+	void SetNoIOThreads(int _no_io_threads);
+
 	// If open, return no. of samples
 	int GetNoSamples();
 
@@ -131,6 +163,12 @@ public:
     
     // If open, return no. of possible FLT/INFO/FORMAT fields and the keys in vector keys
     bool GetFilterInfoFormatKeys(int &no_flt_keys, int &no_info_keys, int &no_fmt_keys, vector<key_desc> &keys, int & gt_key_id);
+
+    // If header is set, return name of the key as given in the header
+    string GetKeyName(key_desc &key);
+
+    // Remove the key from the header (ids of other keys do not change)
+    bool RemoveKey(key_desc &key);
     
 	// If file open give the next variant:
 	// desc - variant description
@@ -150,10 +188,19 @@ public:
 	bool GetVariantFromRec(bcf1_t *rec, variant_desc_t &desc, vector<field_desc> &fields, 
 		std::vector<int> &FilterIdToFieldId, std::vector<int> &InfoIdToFieldId, std::vector<int> &FormatIdToFieldId);
 
+	// As above, but thread-safe: records can be parsed concurrently if each thread uses own buffers (and arena).
+	// If arena is given, field data are allocated in it (and must not be deleted)
+	bool GetVariantFromRec(bcf1_t *rec, variant_desc_t &desc, vector<field_desc> &fields, 
+		std::vector<int> &FilterIdToFieldId, std::vector<int> &InfoIdToFieldId, std::vector<int> &FormatIdToFieldId, CParseBuffers &buffers, CArena *arena = nullptr);
+
 	// Store info about variant - parameters the same as for GetVariant
 	bool SetVariant(variant_desc_t &desc, vector<field_desc> &fields, vector<key_desc> &keys);
 	
+	// Thread-safe if contigs of the variants are in the header (see AddContig)
 	bool SetVariantToRec(bcf1_t* rec, variant_desc_t &desc, vector<field_desc> &fields, vector<key_desc> &keys);
+
+	// Add contig to the header if missing (otherwise SetVariantToRec would do this)
+	bool AddContig(const string &chrom);
 	
 	// Get vector with sample names
 	bool GetSamplesList(vector<string> &s_list);